@@ -1,5 +1,11 @@
 #include "Config.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+
+#include <coredecls.h>
+
 constexpr int documentSizeConfig = 2048;
 
 namespace
@@ -48,22 +54,110 @@ namespace
         }
         return false;
     }
+
+    /// @brief Check an optional string field
+    /// @param value Field to check
+    /// @param check Validation of the string
+    /// @returns true if the field is missing or a valid string
+    bool isOptionalValid(const JsonVariantConst& value, bool (*check)(const char*))
+    {
+        return value.isNull() || (value.is<const char*>() && check(value.as<const char*>()));
+    }
+
+    constexpr const uint16_t DEFAULT_PWM_FREQUENCY = 1000; /// Default PWM frequency in Hz
+    constexpr const uint16_t MIN_PWM_FREQUENCY = 100; /// Lowest PWM frequency in Hz supported by the core
+    constexpr const uint16_t MAX_PWM_FREQUENCY = 40000; /// Highest PWM frequency in Hz supported by the core
+
+    /// @brief Limit a PWM frequency to the range supported by the core
+    uint16_t clampPwmFrequency(const uint16_t frequency)
+    {
+        return std::max(MIN_PWM_FREQUENCY, std::min(frequency, MAX_PWM_FREQUENCY));
+    }
+
+    constexpr const uint16_t MAX_OUTBOX_RAM = 200; /// Most states kept in RAM, some 10 kB of heap
+    constexpr const uint16_t MAX_OUTBOX_FLASH = 2000; /// Most states kept on flash, some 100 kB of the file system
+
+    constexpr const uint16_t DEFAULT_POLL_INTERVAL = RENOGY_INTERVAL * 1000; /// Default poll interval in ms
+    constexpr const uint16_t MIN_POLL_INTERVAL = 500; /// Shortest poll interval in ms, a read takes some 100 ms
+    constexpr const uint16_t MAX_POLL_INTERVAL = 60000; /// Longest poll interval in ms
+
+    /// @brief Limit a poll interval to the supported range
+    uint16_t clampPollInterval(const uint16_t interval)
+    {
+        return std::max(MIN_POLL_INTERVAL, std::min(interval, MAX_POLL_INTERVAL));
+    }
+
+    constexpr const int16_t MIN_UTC_OFFSET = -12 * 60; /// Westernmost time zone in minutes
+    constexpr const int16_t MAX_UTC_OFFSET = 14 * 60; /// Easternmost time zone in minutes
+
+    /// @brief Limit an offset to UTC to the existing time zones
+    int16_t clampUtcOffset(const int16_t offset)
+    {
+        return std::max(MIN_UTC_OFFSET, std::min(offset, MAX_UTC_OFFSET));
+    }
+
+    /// @brief Check if a string is empty or the name of a Renogy field
+    bool isFieldName(const char* name)
+    {
+        return *name == '\0' || Renogy::fieldFromName(name) != Renogy::Field::count;
+    }
+
+    /// @brief Get the default deadband for reporting a field by exception
+    /// @param field Renogy data field
+    /// @returns Minimum change of the field which is reported
+    float defaultDeadband(const Renogy::Field field)
+    {
+        switch (field)
+        {
+        case Renogy::Field::batteryVoltage:
+        case Renogy::Field::loadVoltage:
+        case Renogy::Field::panelVoltage:
+        case Renogy::Field::batteryCurrent:
+        case Renogy::Field::loadCurrent:
+        case Renogy::Field::panelCurrent:
+            return 0.05f;
+        case Renogy::Field::loadEnabled:
+        case Renogy::Field::chargingState:
+        case Renogy::Field::errorState:
+            return 0.0f;
+        default:
+            return 1.0f;
+        }
+    }
+
+    const char SECTION_NAMES[Config::SECTION_COUNT][5] PROGMEM = {"wifi", "mqtt", "pvo", "dev"};
+    const char OUTPUT_NAMES[DeviceConfig::OUTPUT_COUNT][5] PROGMEM = {"load", "out1", "out2", "out3"};
+
+    constexpr const char* CONFIG_FILE = "/config.json"; /// Legacy JSON file, imported once
+    constexpr const char* SLOT_FILES[] = {"/config.a", "/config.b"}; /// Image slots, written alternately
+    constexpr const uint32_t IMAGE_MAGIC = 0x53474E52; /// "RNGS"
 } // namespace
 
 void Config::initConfig()
 {
+    revision = ESP.random();
     if (SPIFFS.begin())
     {
         RNG_DEBUGLN(F("[Config] Mounted file system"));
-        if (SPIFFS.exists("/config.json"))
+        if (loadImage())
+        {
+            return;
+        }
+        if (SPIFFS.exists(CONFIG_FILE))
         {
             readConfig();
+            saveConfig();
+            if (flush())
+            {
+                SPIFFS.remove(CONFIG_FILE);
+            }
         }
         else
         {
             RNG_DEBUGLN(F("[Config] File does not exist"));
             setDefaultConfig();
             saveConfig();
+            flush();
         }
     }
     else
@@ -102,44 +196,267 @@ void Config::setDefaultConfig()
 }
 
 void Config::saveConfig()
+{
+    ++revision;
+    const uint32_t now = millis();
+    if (!savePending)
+    {
+        savePending = true;
+        firstChangeAt = now;
+    }
+    lastChangeAt = now;
+}
+
+bool Config::flush()
+{
+    return !savePending || commit();
+}
+
+bool Config::commit()
 {
     RNG_DEBUGLN(F("[Config] Writing file"));
-    File configFile = SPIFFS.open("/config.json", "w");
 
-    JsonDocument json;
-    createJson(json);
+    // Measure first, then write header and payload with a single write
+    ConfigWriter measure(nullptr, 0);
+    networkConfig.toBinary(measure);
+    mqttConfig.toBinary(measure);
+    pvoutputConfig.toBinary(measure);
+    deviceConfig.toBinary(measure);
+    const size_t length = measure.length();
 
-    if (serializeJson(json, configFile) == 0)
+    std::unique_ptr<uint8_t[]> image(new (std::nothrow) uint8_t[sizeof(ImageHeader) + length]);
+    if (!image || length > UINT16_MAX)
     {
         RNG_DEBUGLN(F("[Config] Failed to write to file"));
+        retryCommit();
+        return false;
     }
-    else
+    uint8_t* payload = image.get() + sizeof(ImageHeader);
+    ConfigWriter out(payload, length);
+    networkConfig.toBinary(out);
+    mqttConfig.toBinary(out);
+    pvoutputConfig.toBinary(out);
+    deviceConfig.toBinary(out);
+    ImageHeader header {IMAGE_MAGIC, CONFIG_VERSION, static_cast<uint16_t>(length), generation + 1, 0};
+    header.crc = imageCrc(header, payload);
+    memcpy(image.get(), &header, sizeof(header));
+
+    // Never touch the active slot, it stays the fallback until the new one is verified
+    const uint8_t slot = activeSlot ^ 1;
+    File configFile = SPIFFS.open(SLOT_FILES[slot], "w");
+    const bool written
+        = configFile && configFile.write(image.get(), sizeof(header) + length) == sizeof(header) + length;
+    configFile.close();
+    image.reset();
+
+    ImageHeader check;
+    if (!written || !readSlot(slot, check) || check.generation != header.generation)
     {
-        RNG_DEBUGLN(F("[Config] Successfully updated config"));
+        RNG_DEBUGLN(F("[Config] Failed to write to file"));
+        retryCommit();
+        return false;
     }
-    configFile.close();
-    if (configFile)
+
+    activeSlot = slot;
+    generation = header.generation;
+    savePending = false;
+    RNG_DEBUGF("[Config] Successfully updated config, generation %u\n", generation);
+    return true;
+}
+
+void Config::retryCommit()
+{
+    // Treat the failed attempt as a new change, so the next one is delayed instead of hammering the flash
+    firstChangeAt = lastChangeAt = millis();
+}
+
+uint32_t Config::imageCrc(const ImageHeader& header, const uint8_t* payload)
+{
+    // Covers the header as well, so a torn write of the generation is detected
+    return crc32(payload, header.length, crc32(&header, offsetof(ImageHeader, crc)));
+}
+
+std::unique_ptr<uint8_t[]> Config::readSlot(const uint8_t slot, ImageHeader& header)
+{
+    File file = SPIFFS.open(SLOT_FILES[slot], "r");
+    if (!file)
     {
-        RNG_DEBUGLN(F("[Config] File was not closed"));
+        return nullptr;
     }
+
+    const size_t size = file.size();
+    // One extra byte, the reader terminates strings in place
+    std::unique_ptr<uint8_t[]> image(new (std::nothrow) uint8_t[size + 1]);
+    const bool complete = image && file.read(image.get(), size) == size;
+    file.close();
+
+    if (!complete || size < sizeof(header))
+    {
+        RNG_DEBUGF("[Config] Could not read slot %u\n", slot);
+        return nullptr;
+    }
+    memcpy(&header, image.get(), sizeof(header));
+    if (header.magic != IMAGE_MAGIC || header.version == 0 || header.version > CONFIG_VERSION
+        || header.length != size - sizeof(header) || imageCrc(header, image.get() + sizeof(header)) != header.crc)
+    {
+        RNG_DEBUGF("[Config] Invalid slot %u\n", slot);
+        return nullptr;
+    }
+    return image;
+}
+
+bool Config::loadImage()
+{
+    ImageHeader headers[2];
+    std::unique_ptr<uint8_t[]> images[2] = {readSlot(0, headers[0]), readSlot(1, headers[1])};
+
+    // Newest slot first, the older one is the fallback if the newest cannot be decoded
+    const uint8_t newest
+        = images[0] && images[1] ? static_cast<int32_t>(headers[1].generation - headers[0].generation) > 0 : !images[0];
+    for (const uint8_t slot : {newest, static_cast<uint8_t>(newest ^ 1)})
+    {
+        if (!images[slot])
+        {
+            continue;
+        }
+        const ImageHeader& header = headers[slot];
+
+        // Fields missing in older versions keep their defaults
+        setDefaultConfig();
+        ConfigReader in(images[slot].get() + sizeof(header), header.length, header.version);
+        networkConfig.fromBinary(in);
+        mqttConfig.fromBinary(in);
+        pvoutputConfig.fromBinary(in);
+        deviceConfig.fromBinary(in);
+        if (!in.ok() || !in.done())
+        {
+            RNG_DEBUGF("[Config] Invalid slot %u\n", slot);
+            continue;
+        }
+        activeSlot = slot;
+        generation = header.generation;
+
+        // MIGRATIONS[v] upgrades version v to v + 1, add one whenever CONFIG_VERSION is increased.
+        // Version 0 is the legacy JSON file, which is imported by readConfig instead.
+        // Migrations are only needed to convert values, added fields are covered by the defaults.
+        //  1 -> 2: OutputConfig::rule added
+        //  2 -> 3: OutputConfig switching limits added
+        //  3 -> 4: OutputConfig schedule and DeviceConfig location added
+        //  4 -> 5: OutputConfig PWM and DeviceConfig PWM frequency added
+        //  5 -> 6: DeviceConfig poll interval added
+        //  6 -> 7: DeviceConfig UTC offset in minutes instead of hours, converted by DeviceConfig::fromBinary
+        constexpr const Migration MIGRATIONS[CONFIG_VERSION]
+            = {nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+        for (uint16_t version = header.version; version < CONFIG_VERSION; ++version)
+        {
+            if (MIGRATIONS[version])
+            {
+                MIGRATIONS[version](*this);
+            }
+        }
+        if (header.version != CONFIG_VERSION)
+        {
+            RNG_DEBUGF("[Config] Migrated image from version %u\n", header.version);
+            saveConfig();
+        }
+
+        RNG_DEBUGF("[Config] Successfully loaded slot %u, generation %u\n", slot, generation);
+        return true;
+    }
+    setDefaultConfig();
+    return false;
 }
 
 void Config::createJson(JsonDocument& output)
 {
-    JsonObject wifi = output["wifi"].to<JsonObject>();
-    networkConfig.toJson(wifi);
-    JsonObject mqtt = output["mqtt"].to<JsonObject>();
-    mqttConfig.toJson(mqtt);
-    JsonObject pvo = output["pvo"].to<JsonObject>();
-    pvoutputConfig.toJson(pvo);
-    JsonObject dev = output["dev"].to<JsonObject>();
-    deviceConfig.toJson(dev);
+    for (uint8_t i = 0; i < SECTION_COUNT; ++i)
+    {
+        const Section section = static_cast<Section>(i);
+        JsonObject object = output[sectionName(section)].to<JsonObject>();
+        createSectionJson(section, object);
+    }
+}
+
+void Config::createSectionJson(const Section section, JsonObject& output)
+{
+    switch (section)
+    {
+    case Section::wifi:
+        networkConfig.toJson(output);
+        break;
+    case Section::mqtt:
+        mqttConfig.toJson(output);
+        break;
+    case Section::pvo:
+        pvoutputConfig.toJson(output);
+        break;
+    case Section::dev:
+        deviceConfig.toJson(output);
+        break;
+    default:
+        break;
+    }
+}
+
+bool Config::checkSectionUpdate(const Section section, const JsonObjectConst& object, String& error) const
+{
+    return section != Section::dev || deviceConfig.checkUpdate(object, error);
+}
+
+bool Config::tryUpdateSection(const Section section, const JsonObjectConst& object)
+{
+    switch (section)
+    {
+    case Section::wifi:
+        return networkConfig.tryUpdate(object);
+    case Section::mqtt:
+        return mqttConfig.tryUpdate(object);
+    case Section::pvo:
+        return pvoutputConfig.tryUpdate(object);
+    case Section::dev:
+        return deviceConfig.tryUpdate(object);
+    default:
+        return false;
+    }
+}
+
+void Config::onChange(const Section section, ChangeHandler handler)
+{
+    changeHandlers[static_cast<uint8_t>(section) % SECTION_COUNT].push_back(handler);
+}
+
+void Config::update()
+{
+    const uint8_t changes = pendingChanges;
+    pendingChanges = 0;
+    for (uint8_t i = 0; i < SECTION_COUNT; ++i)
+    {
+        if (changes & (1 << i))
+        {
+            RNG_DEBUGF("[Config] Applying %S\n", reinterpret_cast<PGM_P>(sectionName(static_cast<Section>(i))));
+            for (const ChangeHandler& handler : changeHandlers[i])
+            {
+                handler();
+            }
+        }
+    }
+
+    const uint32_t now = millis();
+    if (savePending && (now - lastChangeAt >= SAVE_DELAY_MS || now - firstChangeAt >= SAVE_MAX_DELAY_MS))
+    {
+        commit();
+    }
+}
+
+const __FlashStringHelper* Config::sectionName(const Section section)
+{
+    return FPSTR(SECTION_NAMES[static_cast<uint8_t>(section) % SECTION_COUNT]);
 }
 
 void Config::readConfig()
 {
-    RNG_DEBUGLN(F("[Config] Reading file"));
-    File configFile = SPIFFS.open("/config.json", "r");
+    RNG_DEBUGLN(F("[Config] Importing JSON file"));
+    File configFile = SPIFFS.open(CONFIG_FILE, "r");
 
     if (configFile)
     {
@@ -239,6 +556,36 @@ void NetworkConfig::toJson(JsonObject& object) const
     object["ap_password"] = apPassword;
 }
 
+void NetworkConfig::toBinary(ConfigWriter& out) const
+{
+    out.put(clientEnabled);
+    out.put(dhcpEnabled);
+    out.putString(clientSsid);
+    out.putString(clientPassword);
+    out.putIp(clientIp);
+    out.putIp(clientGateway);
+    out.putIp(clientDns);
+    out.putIp(clientMask);
+    out.put(apEnabled);
+    out.putString(apSsid);
+    out.putString(apPassword);
+}
+
+void NetworkConfig::fromBinary(ConfigReader& in)
+{
+    in.get(clientEnabled);
+    in.get(dhcpEnabled);
+    in.getString(clientSsid);
+    in.getString(clientPassword);
+    in.getIp(clientIp);
+    in.getIp(clientGateway);
+    in.getIp(clientDns);
+    in.getIp(clientMask);
+    in.get(apEnabled);
+    in.getString(apSsid);
+    in.getString(apPassword);
+}
+
 bool NetworkConfig::tryUpdate(const JsonObjectConst& object)
 {
     if (object.isNull())
@@ -280,7 +627,12 @@ bool MqttConfig::verify(const JsonObjectConst& object) const
     return object["enabled"].is<bool>() && object["hadisco"].is<bool>() && object["server"].is<const char*>()
         && object["port"].is<uint16_t>() && object["id"].is<const char*>() && object["user"].is<const char*>()
         && object["password"].is<const char*>() && object["topic"].is<const char*>() && object["interval"].is<uint8_t>()
-        && object["hadiscotopic"].is<const char*>() && object["split"].is<bool>();
+        && object["hadiscotopic"].is<const char*>() && object["split"].is<bool>() && object["rbe"].is<bool>()
+        && object["heartbeat"].is<uint16_t>() && object["deadband"].is<JsonObjectConst>()
+        && object["outbox_ram"].is<uint16_t>() && object["outbox_ram"].as<uint16_t>() <= MAX_OUTBOX_RAM
+        && object["outbox_flash"].is<uint16_t>() && object["outbox_flash"].as<uint16_t>() <= MAX_OUTBOX_FLASH
+        && object["outbox_rate"].is<uint8_t>() && object["outbox_newest"].is<bool>()
+        && object["state_format"].is<const char*>() && object["history_format"].is<const char*>();
 }
 
 void MqttConfig::fromJson(const JsonObjectConst& object)
@@ -297,6 +649,20 @@ void MqttConfig::fromJson(const JsonObjectConst& object)
     topic = object["topic"] | emptyString;
     interval = object["interval"];
     split = object["split"];
+    rbe = object["rbe"];
+    heartbeat = object["heartbeat"];
+    const JsonObjectConst deadband = object["deadband"];
+    for (uint8_t i = 0; i < Renogy::FIELD_COUNT; ++i)
+    {
+        const Renogy::Field field = static_cast<Renogy::Field>(i);
+        deadbands[i] = deadband[Renogy::fieldName(field)] | defaultDeadband(field);
+    }
+    outboxRam = std::min(object["outbox_ram"].as<uint16_t>(), MAX_OUTBOX_RAM);
+    outboxFlash = std::min(object["outbox_flash"].as<uint16_t>(), MAX_OUTBOX_FLASH);
+    outboxRate = object["outbox_rate"];
+    outboxNewestFirst = object["outbox_newest"];
+    stateFormat = StringToPayloadFormat(object["state_format"] | emptyString);
+    historyFormat = StringToPayloadFormat(object["history_format"] | emptyString);
 }
 
 void MqttConfig::toJson(JsonObject& object) const
@@ -312,6 +678,72 @@ void MqttConfig::toJson(JsonObject& object) const
     object["topic"] = topic;
     object["interval"] = interval;
     object["split"] = split;
+    object["rbe"] = rbe;
+    object["heartbeat"] = heartbeat;
+    JsonObject deadband = object["deadband"].to<JsonObject>();
+    for (uint8_t i = 0; i < Renogy::FIELD_COUNT; ++i)
+    {
+        deadband[Renogy::fieldName(static_cast<Renogy::Field>(i))] = deadbands[i];
+    }
+    object["outbox_ram"] = outboxRam;
+    object["outbox_flash"] = outboxFlash;
+    object["outbox_rate"] = outboxRate;
+    object["outbox_newest"] = outboxNewestFirst;
+    object["state_format"] = PayloadFormatToString(stateFormat);
+    object["history_format"] = PayloadFormatToString(historyFormat);
+}
+
+void MqttConfig::toBinary(ConfigWriter& out) const
+{
+    out.put(enabled);
+    out.put(hadiscovery);
+    out.putString(haDiscoveryTopic);
+    out.putString(server);
+    out.put(port);
+    out.putString(id);
+    out.putString(user);
+    out.putString(password);
+    out.putString(topic);
+    out.put(interval);
+    out.put(split);
+    out.put(rbe);
+    out.put(heartbeat);
+    out.put(deadbands);
+    out.put(outboxRam);
+    out.put(outboxFlash);
+    out.put(outboxRate);
+    out.put(outboxNewestFirst);
+    out.put(static_cast<uint8_t>(stateFormat));
+    out.put(static_cast<uint8_t>(historyFormat));
+}
+
+void MqttConfig::fromBinary(ConfigReader& in)
+{
+    in.get(enabled);
+    in.get(hadiscovery);
+    in.getString(haDiscoveryTopic);
+    in.getString(server);
+    in.get(port);
+    in.getString(id);
+    in.getString(user);
+    in.getString(password);
+    in.getString(topic);
+    in.get(interval);
+    in.get(split);
+    in.get(rbe);
+    in.get(heartbeat);
+    in.get(deadbands);
+    in.get(outboxRam);
+    in.get(outboxFlash);
+    in.get(outboxRate);
+    in.get(outboxNewestFirst);
+    outboxRam = std::min(outboxRam, MAX_OUTBOX_RAM);
+    outboxFlash = std::min(outboxFlash, MAX_OUTBOX_FLASH);
+    uint8_t format;
+    in.get(format);
+    stateFormat = static_cast<PayloadFormat>(format);
+    in.get(format);
+    historyFormat = static_cast<PayloadFormat>(format);
 }
 
 bool MqttConfig::tryUpdate(const JsonObjectConst& object)
@@ -332,6 +764,30 @@ bool MqttConfig::tryUpdate(const JsonObjectConst& object)
     changed |= updateField(object, "topic", topic);
     changed |= updateField(object, "interval", interval);
     changed |= updateField(object, "split", split);
+    changed |= updateField(object, "rbe", rbe);
+    changed |= updateField(object, "heartbeat", heartbeat);
+    const JsonObjectConst deadband = object["deadband"];
+    if (!deadband.isNull())
+    {
+        char name[16];
+        for (uint8_t i = 0; i < Renogy::FIELD_COUNT; ++i)
+        {
+            strncpy_P(name, reinterpret_cast<PGM_P>(Renogy::fieldName(static_cast<Renogy::Field>(i))), sizeof(name));
+            changed |= updateField(deadband, name, deadbands[i]);
+        }
+    }
+    changed |= updateField(object, "outbox_ram", outboxRam);
+    changed |= updateField(object, "outbox_flash", outboxFlash);
+    outboxRam = std::min(outboxRam, MAX_OUTBOX_RAM);
+    outboxFlash = std::min(outboxFlash, MAX_OUTBOX_FLASH);
+    changed |= updateField(object, "outbox_rate", outboxRate);
+    changed |= updateField(object, "outbox_newest", outboxNewestFirst);
+    String format = PayloadFormatToString(stateFormat);
+    changed |= updateField(object, "state_format", format);
+    stateFormat = StringToPayloadFormat(format);
+    format = PayloadFormatToString(historyFormat);
+    changed |= updateField(object, "history_format", format);
+    historyFormat = StringToPayloadFormat(format);
     return changed;
 }
 
@@ -345,6 +801,18 @@ void MqttConfig::setDefaultConfig()
     topic = "/rng";
     interval = 1;
     split = false;
+    rbe = false;
+    heartbeat = 300;
+    for (uint8_t i = 0; i < Renogy::FIELD_COUNT; ++i)
+    {
+        deadbands[i] = defaultDeadband(static_cast<Renogy::Field>(i));
+    }
+    outboxRam = 30;
+    outboxFlash = 0;
+    outboxRate = 5;
+    outboxNewestFirst = false;
+    stateFormat = PayloadFormat::json;
+    historyFormat = PayloadFormat::json;
 }
 
 bool PVOutputConfig::verify(const JsonObjectConst& object) const
@@ -371,6 +839,22 @@ void PVOutputConfig::toJson(JsonObject& object) const
     object["time_offset"] = timeOffset;
 }
 
+void PVOutputConfig::toBinary(ConfigWriter& out) const
+{
+    out.put(enabled);
+    out.put(systemId);
+    out.putString(apiKey);
+    out.put(timeOffset);
+}
+
+void PVOutputConfig::fromBinary(ConfigReader& in)
+{
+    in.get(enabled);
+    in.get(systemId);
+    in.getString(apiKey);
+    in.get(timeOffset);
+}
+
 bool PVOutputConfig::tryUpdate(const JsonObjectConst& object)
 {
     if (object.isNull())
@@ -397,7 +881,42 @@ bool OutputConfig::verify(const JsonObjectConst& object) const
 {
     RNG_DEBUGLN(F("[Config] Verifying OutputConfig"));
     return object["inputType"].is<const char*>() && object["inverted"].is<bool>() && object["min"].is<float>()
-        && object["max"].is<float>();
+        && object["max"].is<float>() && isOptionalValid(object["rule"], OutputRule::verify)
+        && Schedule::verifyWindow(object["schedule_start"] | "", object["schedule_end"] | "")
+        && isOptionalValid(object["pwm_field"], isFieldName);
+}
+
+bool OutputConfig::checkUpdate(const JsonObjectConst& object, String& error) const
+{
+    if (object.isNull())
+    {
+        return true;
+    }
+    const char* newRule = object["rule"];
+    if (newRule)
+    {
+        OutputRule compiled;
+        if (!compiled.compile(newRule))
+        {
+            error = F("invalid rule at offset ");
+            error += compiled.getErrorOffset();
+            return false;
+        }
+    }
+    // Edges may be updated one at a time, the resulting window has to be valid
+    if (!Schedule::verifyWindow(object["schedule_start"] | scheduleStart.c_str(),
+            object["schedule_end"] | scheduleEnd.c_str()))
+    {
+        error = F("invalid schedule, start and end are both required");
+        return false;
+    }
+    const char* newField = object["pwm_field"];
+    if (newField && !isFieldName(newField))
+    {
+        error = F("unknown pwm_field");
+        return false;
+    }
+    return true;
 }
 
 void OutputConfig::fromJson(const JsonObjectConst& object)
@@ -407,6 +926,78 @@ void OutputConfig::fromJson(const JsonObjectConst& object)
     inverted = object["inverted"];
     min = object["min"];
     max = object["max"];
+    rule = object["rule"] | emptyString;
+    minOnTime = object["min_on_time"] | 0;
+    minOffTime = object["min_off_time"] | 0;
+    settleTime = object["settle_time"] | 0;
+    maxSwitches = std::min<unsigned>(object["max_switches"] | 0u, OutputSwitch::MAX_SWITCHES_PER_HOUR);
+    scheduleStart = object["schedule_start"] | emptyString;
+    scheduleEnd = object["schedule_end"] | emptyString;
+    scheduleDays = object["schedule_days"] | Schedule::ALL_DAYS;
+    pwm = object["pwm"] | false;
+    duty = std::min<unsigned>(object["duty"] | 100u, 100);
+    rampTime = object["ramp_time"] | 0;
+    pwmField = object["pwm_field"] | emptyString;
+    pwmLow = object["pwm_low"] | 0.0f;
+    pwmHigh = object["pwm_high"] | 0.0f;
+}
+
+void OutputConfig::toBinary(ConfigWriter& out) const
+{
+    out.put(static_cast<uint8_t>(inputType));
+    out.put(inverted);
+    out.put(min);
+    out.put(max);
+    out.putString(rule);
+    out.put(minOnTime);
+    out.put(minOffTime);
+    out.put(settleTime);
+    out.put(maxSwitches);
+    out.putString(scheduleStart);
+    out.putString(scheduleEnd);
+    out.put(scheduleDays);
+    out.put(pwm);
+    out.put(duty);
+    out.put(rampTime);
+    out.putString(pwmField);
+    out.put(pwmLow);
+    out.put(pwmHigh);
+}
+
+void OutputConfig::fromBinary(ConfigReader& in)
+{
+    uint8_t type;
+    in.get(type);
+    inputType = static_cast<InputType>(type);
+    in.get(inverted);
+    in.get(min);
+    in.get(max);
+    if (in.getVersion() >= 2)
+    {
+        in.getString(rule);
+    }
+    if (in.getVersion() >= 3)
+    {
+        in.get(minOnTime);
+        in.get(minOffTime);
+        in.get(settleTime);
+        in.get(maxSwitches);
+    }
+    if (in.getVersion() >= 4)
+    {
+        in.getString(scheduleStart);
+        in.getString(scheduleEnd);
+        in.get(scheduleDays);
+    }
+    if (in.getVersion() >= 5)
+    {
+        in.get(pwm);
+        in.get(duty);
+        in.get(rampTime);
+        in.getString(pwmField);
+        in.get(pwmLow);
+        in.get(pwmHigh);
+    }
 }
 
 bool OutputConfig::tryUpdate(const JsonObjectConst& object)
@@ -422,22 +1013,99 @@ bool OutputConfig::tryUpdate(const JsonObjectConst& object)
     changed |= updateField(object, "inverted", inverted);
     changed |= updateField(object, "min", min);
     changed |= updateField(object, "max", max);
+    // Keep the previous rule if the new one does not compile
+    const char* newRule = object["rule"];
+    if (newRule && OutputRule::verify(newRule))
+    {
+        changed |= updateField(object, "rule", rule);
+    }
+    changed |= updateField(object, "min_on_time", minOnTime);
+    changed |= updateField(object, "min_off_time", minOffTime);
+    changed |= updateField(object, "settle_time", settleTime);
+    changed |= updateField(object, "max_switches", maxSwitches);
+    maxSwitches = std::min(maxSwitches, OutputSwitch::MAX_SWITCHES_PER_HOUR);
+    // Keep the previous window if the new one is invalid
+    if (Schedule::verifyWindow(object["schedule_start"] | scheduleStart.c_str(),
+            object["schedule_end"] | scheduleEnd.c_str()))
+    {
+        changed |= updateField(object, "schedule_start", scheduleStart);
+        changed |= updateField(object, "schedule_end", scheduleEnd);
+    }
+    changed |= updateField(object, "schedule_days", scheduleDays);
+    changed |= updateField(object, "pwm", pwm);
+    changed |= updateField(object, "duty", duty);
+    duty = std::min<uint8_t>(duty, 100);
+    changed |= updateField(object, "ramp_time", rampTime);
+    const char* newField = object["pwm_field"];
+    if (newField && isFieldName(newField))
+    {
+        changed |= updateField(object, "pwm_field", pwmField);
+    }
+    changed |= updateField(object, "pwm_low", pwmLow);
+    changed |= updateField(object, "pwm_high", pwmHigh);
     return changed;
 }
 
+OutputSwitch::Limits OutputConfig::getLimits() const
+{
+    return {minOnTime * 1000u, minOffTime * 1000u, settleTime * 1000u, maxSwitches};
+}
+
 void OutputConfig::setDefaultConfig()
 {
     inputType = InputType::disabled;
     inverted = false;
     min = 30.0;
     max = 48.0;
+    rule = "";
+    minOnTime = 0;
+    minOffTime = 0;
+    settleTime = 0;
+    maxSwitches = 0;
+    scheduleStart = "";
+    scheduleEnd = "";
+    scheduleDays = Schedule::ALL_DAYS;
+    pwm = false;
+    duty = 100;
+    rampTime = 0;
+    pwmField = "";
+    pwmLow = 0.0f;
+    pwmHigh = 0.0f;
 }
 
 bool DeviceConfig::verify(const JsonObjectConst& object) const
 {
     RNG_DEBUGLN(F("[Config] Verifying DeviceConfig"));
-    return object["address"].is<uint8_t>() && object["name"].is<const char*>() && load.verify(object["load"])
-        && out1.verify(object["out1"]) && out2.verify(object["out2"]) && out3.verify(object["out3"]);
+    if (!object["address"].is<uint8_t>() || !object["name"].is<const char*>())
+    {
+        return false;
+    }
+    for (uint8_t i = 0; i < OUTPUT_COUNT; ++i)
+    {
+        if (!outputs[i].verify(object[outputName(static_cast<Output>(i))]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DeviceConfig::checkUpdate(const JsonObjectConst& object, String& error) const
+{
+    if (object.isNull())
+    {
+        return true;
+    }
+    for (uint8_t i = 0; i < OUTPUT_COUNT; ++i)
+    {
+        const __FlashStringHelper* name = outputName(static_cast<Output>(i));
+        if (!outputs[i].checkUpdate(object[name], error))
+        {
+            error = String(name) + F(": ") + error;
+            return false;
+        }
+    }
+    return true;
 }
 
 void DeviceConfig::fromJson(const JsonObjectConst& object)
@@ -445,20 +1113,81 @@ void DeviceConfig::fromJson(const JsonObjectConst& object)
     constexpr const char* emptyString = "";
     address = object["address"];
     name = object["name"] | emptyString;
-    load.fromJson(object["load"]);
-    out1.fromJson(object["out1"]);
-    out2.fromJson(object["out2"]);
-    out3.fromJson(object["out3"]);
+    for (uint8_t i = 0; i < OUTPUT_COUNT; ++i)
+    {
+        outputs[i].fromJson(object[outputName(static_cast<Output>(i))]);
+    }
+    latitude = object["latitude"] | 0.0f;
+    longitude = object["longitude"] | 0.0f;
+    utcOffset = clampUtcOffset(object["utc_offset"] | 0);
+    pwmFrequency = clampPwmFrequency(object["pwm_frequency"] | DEFAULT_PWM_FREQUENCY);
+    pollInterval = clampPollInterval(object["poll_interval"] | DEFAULT_POLL_INTERVAL);
 }
 
 void DeviceConfig::toJson(JsonObject& object) const
 {
     object["address"] = address;
     object["name"] = name;
-    load.toJson(object["load"]);
-    out1.toJson(object["out1"]);
-    out2.toJson(object["out2"]);
-    out3.toJson(object["out3"]);
+    for (uint8_t i = 0; i < OUTPUT_COUNT; ++i)
+    {
+        outputs[i].toJson(object[outputName(static_cast<Output>(i))]);
+    }
+    object["latitude"] = latitude;
+    object["longitude"] = longitude;
+    object["utc_offset"] = utcOffset;
+    object["pwm_frequency"] = pwmFrequency;
+    object["poll_interval"] = pollInterval;
+}
+
+void DeviceConfig::toBinary(ConfigWriter& out) const
+{
+    out.put(address);
+    out.putString(name);
+    for (const OutputConfig& output : outputs)
+    {
+        output.toBinary(out);
+    }
+    out.put(latitude);
+    out.put(longitude);
+    out.put(utcOffset);
+    out.put(pwmFrequency);
+    out.put(pollInterval);
+}
+
+void DeviceConfig::fromBinary(ConfigReader& in)
+{
+    in.get(address);
+    in.getString(name);
+    for (OutputConfig& output : outputs)
+    {
+        output.fromBinary(in);
+    }
+    if (in.getVersion() >= 4)
+    {
+        in.get(latitude);
+        in.get(longitude);
+        if (in.getVersion() >= 7)
+        {
+            in.get(utcOffset);
+        }
+        else
+        {
+            // Stored in whole hours before
+            int8_t hours;
+            in.get(hours);
+            utcOffset = hours * 60;
+        }
+        utcOffset = clampUtcOffset(utcOffset);
+    }
+    if (in.getVersion() >= 5)
+    {
+        in.get(pwmFrequency);
+    }
+    if (in.getVersion() >= 6)
+    {
+        in.get(pollInterval);
+        pollInterval = clampPollInterval(pollInterval);
+    }
 }
 
 bool DeviceConfig::tryUpdate(const JsonObjectConst& object)
@@ -470,19 +1199,42 @@ bool DeviceConfig::tryUpdate(const JsonObjectConst& object)
     bool changed = false;
     changed |= updateField(object, "address", address);
     changed |= updateField(object, "name", name);
-    changed |= load.tryUpdate(object["load"]);
-    changed |= out1.tryUpdate(object["out1"]);
-    changed |= out2.tryUpdate(object["out2"]);
-    changed |= out3.tryUpdate(object["out3"]);
+    for (uint8_t i = 0; i < OUTPUT_COUNT; ++i)
+    {
+        changed |= outputs[i].tryUpdate(object[outputName(static_cast<Output>(i))]);
+    }
+    changed |= updateField(object, "latitude", latitude);
+    changed |= updateField(object, "longitude", longitude);
+    changed |= updateField(object, "utc_offset", utcOffset);
+    utcOffset = clampUtcOffset(utcOffset);
+    changed |= updateField(object, "pwm_frequency", pwmFrequency);
+    pwmFrequency = clampPwmFrequency(pwmFrequency);
+    changed |= updateField(object, "poll_interval", pollInterval);
+    pollInterval = clampPollInterval(pollInterval);
     return changed;
 }
 
+const __FlashStringHelper* DeviceConfig::outputName(const Output output)
+{
+    return FPSTR(OUTPUT_NAMES[static_cast<uint8_t>(output) % OUTPUT_COUNT]);
+}
+
+Schedule::Location DeviceConfig::getLocation() const
+{
+    return {latitude, longitude, utcOffset * 60};
+}
+
 void DeviceConfig::setDefaultConfig()
 {
     address = 0xFF;
     name = MODEL;
-    load.setDefaultConfig();
-    out1.setDefaultConfig();
-    out2.setDefaultConfig();
-    out3.setDefaultConfig();
+    for (OutputConfig& output : outputs)
+    {
+        output.setDefaultConfig();
+    }
+    latitude = 0.0f;
+    longitude = 0.0f;
+    utcOffset = 0;
+    pwmFrequency = DEFAULT_PWM_FREQUENCY;
+    pollInterval = DEFAULT_POLL_INTERVAL;
 }
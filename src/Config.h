@@ -1,11 +1,152 @@
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <vector>
+
 #include <ArduinoJson.h>
 #include <DNSServer.h>
 #include <ESPAsyncWebServer.h>
 #include <FS.h>
 
 #include "Constants.h"
+#include "OutputRule.h"
+#include "OutputSwitch.h"
+#include "Renogy.h"
+#include "Schedule.h"
+
+/// @brief Writes config fields into a binary image
+///
+/// Always counts the written bytes, but only stores them while they fit, so a first pass without a buffer measures
+/// the image.
+class ConfigWriter
+{
+public:
+    /// @brief Construct a new ConfigWriter object
+    ///
+    /// @param buffer Buffer to write into, null to only measure
+    /// @param capacity Size of the buffer
+    ConfigWriter(uint8_t* buffer, const size_t capacity) : buffer(buffer), capacity(capacity) { }
+
+    /// @brief Write a plain value
+    template <typename T>
+    void put(const T& value)
+    {
+        put(&value, sizeof(T));
+    }
+
+    /// @brief Write a string with its length
+    void putString(const String& str)
+    {
+        put<uint16_t>(str.length());
+        put(str.c_str(), str.length());
+    }
+
+    /// @brief Write an ip address
+    void putIp(const IPAddress& ip) { put<uint32_t>(ip); }
+
+    /// @brief Get the number of written bytes
+    size_t length() const { return written; }
+
+private:
+    void put(const void* data, const size_t size)
+    {
+        if (buffer && written + size <= capacity)
+        {
+            memcpy(buffer + written, data, size);
+        }
+        written += size;
+    }
+
+private:
+    uint8_t* buffer; /// Buffer to write into, may be null
+    size_t capacity; /// Size of the buffer
+    size_t written = 0; /// Number of written bytes
+};
+
+/// @brief Reads config fields from a binary image
+///
+/// Reading past the end yields zeros and marks the reader as failed, so structs can read all their fields
+/// unconditionally and the result is checked once with @ref ok.
+class ConfigReader
+{
+public:
+    /// @brief Construct a new ConfigReader object
+    ///
+    /// @param buffer Image to read, strings are temporarily null terminated in place
+    /// @param length Length of the image
+    /// @param version Schema version the image was written with
+    ConfigReader(uint8_t* buffer, const size_t length, const uint16_t version)
+        : buffer(buffer), length(length), version(version)
+    {
+    }
+
+    /// @brief Read a plain value
+    template <typename T>
+    void get(T& value)
+    {
+        get(&value, sizeof(T));
+    }
+
+    /// @brief Read a string written with its length
+    void getString(String& str)
+    {
+        uint16_t size = 0;
+        get(size);
+        if (!valid || offset + size > length)
+        {
+            valid = false;
+            str = "";
+            return;
+        }
+        // Terminate in place for the assignment, the following byte is restored afterwards
+        char* start = reinterpret_cast<char*>(buffer + offset);
+        const char next = start[size];
+        start[size] = '\0';
+        str = start;
+        start[size] = next;
+        offset += size;
+    }
+
+    /// @brief Read an ip address
+    void getIp(IPAddress& ip)
+    {
+        uint32_t address = 0;
+        get(address);
+        ip = IPAddress(address);
+    }
+
+    /// @brief Check if all reads were within the image
+    bool ok() const { return valid; }
+
+    /// @brief Check if all bytes of the image were read
+    bool done() const { return offset == length; }
+
+    /// @brief Get the schema version of the image, fields added later must only be read if it is new enough
+    uint16_t getVersion() const { return version; }
+
+private:
+    void get(void* data, const size_t size)
+    {
+        if (valid && offset + size <= length)
+        {
+            memcpy(data, buffer + offset, size);
+            offset += size;
+        }
+        else
+        {
+            valid = false;
+            memset(data, 0, size);
+        }
+    }
+
+private:
+    uint8_t* buffer; /// Image, the byte after it must be writable
+    size_t length; /// Length of the image
+    const uint16_t version; /// Schema version of the image
+    size_t offset = 0; /// Read position
+    bool valid = true; /// All reads were within the image
+};
 
 struct NetworkConfig
 {
@@ -26,6 +167,10 @@ struct NetworkConfig
     bool verify(const JsonObjectConst& object) const;
     void fromJson(const JsonObjectConst& object);
     void toJson(JsonObject& object) const;
+    /// @brief Write all fields into a binary image
+    void toBinary(ConfigWriter& out) const;
+    /// @brief Read all fields from a binary image
+    void fromBinary(ConfigReader& in);
 
     /// @brief Update all fields in object, if possible
     /// @returns true when any value was changed
@@ -35,6 +180,34 @@ struct NetworkConfig
     void setDefaultConfig();
 };
 
+/// @brief Encoding of a status payload
+enum class PayloadFormat
+{
+    json,
+    msgpack,
+};
+
+static const String PayloadFormatToString(const PayloadFormat format)
+{
+    switch (format)
+    {
+    case PayloadFormat::msgpack:
+        return "msgpack";
+    case PayloadFormat::json:
+    default:
+        return "json";
+    }
+}
+
+static PayloadFormat StringToPayloadFormat(const String& str)
+{
+    if (str.equals("msgpack"))
+    {
+        return PayloadFormat::msgpack;
+    }
+    return PayloadFormat::json;
+}
+
 struct MqttConfig
 {
     uint16_t port;
@@ -42,6 +215,15 @@ struct MqttConfig
     bool enabled;
     bool hadiscovery; /// Should one or more discovery messages be sent to haDiscoveryTopic
     bool split; /// Should data be split into separate topics
+    bool rbe; /// Report by exception, only publish values which changed by at least their deadband
+    uint16_t heartbeat; /// Interval in seconds at which the full state is published when reporting by exception
+    float deadbands[Renogy::FIELD_COUNT]; /// Minimum change of each field to be reported by exception
+    uint16_t outboxRam; /// Number of states kept in RAM while the broker is unreachable, 0 to disable
+    uint16_t outboxFlash; /// Number of states additionally kept on flash, 0 to disable
+    uint8_t outboxRate; /// Number of stored states published per second after reconnecting
+    bool outboxNewestFirst; /// Publish the newest stored states first instead of the oldest
+    PayloadFormat stateFormat; /// Encoding of the state topic
+    PayloadFormat historyFormat; /// Encoding of the history topic
     String server;
     String id;
     String user;
@@ -54,6 +236,10 @@ struct MqttConfig
     bool verify(const JsonObjectConst& object) const;
     void fromJson(const JsonObjectConst& object);
     void toJson(JsonObject& object) const;
+    /// @brief Write all fields into a binary image
+    void toBinary(ConfigWriter& out) const;
+    /// @brief Read all fields from a binary image
+    void fromBinary(ConfigReader& in);
 
     /// @brief Update all fields in object, if possible
     /// @returns true when any value was changed
@@ -75,6 +261,10 @@ struct PVOutputConfig
     bool verify(const JsonObjectConst& object) const;
     void fromJson(const JsonObjectConst& object);
     void toJson(JsonObject& object) const;
+    /// @brief Write all fields into a binary image
+    void toBinary(ConfigWriter& out) const;
+    /// @brief Read all fields from a binary image
+    void fromBinary(ConfigReader& in);
 
     /// @brief Update all fields in object, if possible
     /// @returns true when any value was changed
@@ -139,11 +329,32 @@ struct OutputConfig
     bool inverted; /// Output state should be inverted
     float min;
     float max;
+    String rule; /// @ref OutputRule expression, replaces inputType, min and max if not empty
+    uint16_t minOnTime; /// Minimum time in s the output stays on, 0 to disable
+    uint16_t minOffTime; /// Minimum time in s the output stays off, 0 to disable
+    uint16_t settleTime; /// Time in s a new state has to be requested before switching, 0 to disable
+    uint8_t maxSwitches; /// Maximum number of switches per hour, 0 to disable
+    String scheduleStart; /// @ref Schedule window start, the output is only on within the window if not empty
+    String scheduleEnd; /// @ref Schedule window end
+    uint8_t scheduleDays; /// Days the window starts on, bit 0 is Sunday
+    bool pwm; /// Drive the output with PWM instead of on/off, only for GPIO outputs
+    uint8_t duty; /// Duty cycle in percent while on, unless pwmField is set
+    uint16_t rampTime; /// Soft-start time in ms from 0 to 100 % duty cycle, 0 to disable
+    String pwmField; /// Renogy field (see @ref Renogy::fieldName) setting the duty cycle proportionally if not empty
+    float pwmLow; /// Value of pwmField at 0 % duty cycle
+    float pwmHigh; /// Value of pwmField at 100 % duty cycle
     bool lastState = false;
 
     /// @brief Verify that the object can be parsed
     /// @returns true if fromJson can be executed
     bool verify(const JsonObjectConst& object) const;
+
+    /// @brief Check the fields of a partial update which @ref tryUpdate would otherwise ignore
+    ///
+    /// @param object Fields to update, maybe null
+    /// @param error Receives a description of the first invalid field
+    /// @returns true if all contained fields are valid
+    bool checkUpdate(const JsonObjectConst& object, String& error) const;
     void fromJson(const JsonObjectConst& object);
     template <typename T>
     void toJson(T&& object) const
@@ -152,8 +363,29 @@ struct OutputConfig
         object["inverted"] = inverted;
         object["min"] = min;
         object["max"] = max;
+        object["rule"] = rule;
+        object["min_on_time"] = minOnTime;
+        object["min_off_time"] = minOffTime;
+        object["settle_time"] = settleTime;
+        object["max_switches"] = maxSwitches;
+        object["schedule_start"] = scheduleStart;
+        object["schedule_end"] = scheduleEnd;
+        object["schedule_days"] = scheduleDays;
+        object["pwm"] = pwm;
+        object["duty"] = duty;
+        object["ramp_time"] = rampTime;
+        object["pwm_field"] = pwmField;
+        object["pwm_low"] = pwmLow;
+        object["pwm_high"] = pwmHigh;
     }
 
+    /// @brief Get the switching limits for @ref OutputSwitch
+    OutputSwitch::Limits getLimits() const;
+    /// @brief Write all fields into a binary image
+    void toBinary(ConfigWriter& out) const;
+    /// @brief Read all fields from a binary image
+    void fromBinary(ConfigReader& in);
+
     /// @brief Update all fields in object, if possible
     /// @returns true when any value was changed
     bool tryUpdate(const JsonObjectConst& object);
@@ -164,18 +396,54 @@ struct OutputConfig
 
 struct DeviceConfig
 {
+    /// @brief Outputs, in config and API order
+    enum class Output : uint8_t
+    {
+        load, /// Renogy load output
+        out1, /// RNGBridge output 1
+        out2, /// RNGBridge output 2
+        out3, /// RNGBridge output 3
+        count, /// Number of outputs, not an output itself
+    };
+    constexpr static const uint8_t OUTPUT_COUNT = static_cast<uint8_t>(Output::count); /// Number of outputs
+
+    /// @brief Get the key of an output as used in the config and APIs (e.g. `out1`)
+    ///
+    /// @param output Output identifier
+    /// @return Name stored in flash
+    static const __FlashStringHelper* outputName(const Output output);
+
     uint8_t address; /// Address of the modbus client
     String name;
-    OutputConfig load;
-    OutputConfig out1;
-    OutputConfig out2;
-    OutputConfig out3;
+    OutputConfig outputs[OUTPUT_COUNT]; /// Output configs, indexed by @ref Output
+    float latitude; /// Latitude of the site in degrees for sun based schedules, north positive
+    float longitude; /// Longitude of the site in degrees for sun based schedules, east positive
+    int16_t utcOffset; /// Offset of the local time to UTC in minutes for schedules
+    uint16_t pwmFrequency; /// PWM frequency in Hz, shared by all PWM outputs
+    uint16_t pollInterval; /// Interval in ms at which the controller is read
+
+    /// @brief Get the location for @ref Schedule
+    Schedule::Location getLocation() const;
+
+    /// @brief Get the config of an output
+    OutputConfig& output(const Output output) { return outputs[static_cast<uint8_t>(output) % OUTPUT_COUNT]; }
 
     /// @brief Verify that the object can be parsed
     /// @returns true if fromJson can be executed
     bool verify(const JsonObjectConst& object) const;
+
+    /// @brief Check the output fields of a partial update, see @ref OutputConfig::checkUpdate
+    ///
+    /// @param object Fields to update, maybe null
+    /// @param error Receives a description of the first invalid field, prefixed with the output
+    /// @returns true if all contained fields are valid
+    bool checkUpdate(const JsonObjectConst& object, String& error) const;
     void fromJson(const JsonObjectConst& object);
     void toJson(JsonObject& object) const;
+    /// @brief Write all fields into a binary image
+    void toBinary(ConfigWriter& out) const;
+    /// @brief Read all fields from a binary image
+    void fromBinary(ConfigReader& in);
 
     /// @brief Update all fields in object, if possible
     /// @returns true when any value was changed
@@ -187,6 +455,27 @@ struct DeviceConfig
 
 class Config
 {
+public:
+    /// @brief Sections of the config, in file and API order
+    enum class Section : uint8_t
+    {
+        wifi,
+        mqtt,
+        pvo,
+        dev,
+        count, /// Number of sections, not a section itself
+    };
+    constexpr static const uint8_t SECTION_COUNT = static_cast<uint8_t>(Section::count); /// Number of sections
+
+    /// @brief Handler notified after a section changed, see @ref onChange
+    typedef std::function<void()> ChangeHandler;
+
+    /// @brief Get the key of a section as used in the config file and APIs (e.g. `wifi`)
+    ///
+    /// @param section Section identifier
+    /// @return Name stored in flash
+    static const __FlashStringHelper* sectionName(const Section section);
+
 public:
     void initConfig();
     NetworkConfig& getNetworkConfig();
@@ -194,13 +483,117 @@ public:
     PVOutputConfig& getPvoutputConfig();
     DeviceConfig& getDeviceConfig();
     void setDefaultConfig();
+
+    /// @brief Schedule writing the config as binary image, JSON is only used for import and export
+    ///
+    /// Rapid changes are coalesced, the image is written by @ref update once no change happened for
+    /// @ref SAVE_DELAY_MS, but at the latest @ref SAVE_MAX_DELAY_MS after the first change.
     void saveConfig();
+
+    /// @brief Write a scheduled save right away, e.g. before restarting
+    ///
+    /// @return true if nothing is left to write
+    bool flush();
     void createJson(JsonDocument& output);
 
+    /// @brief Write a single section
+    ///
+    /// @param section Section to write
+    /// @param output Object receiving the fields of the section
+    void createSectionJson(const Section section, JsonObject& output);
+
+    /// @brief Update all fields of a single section, if possible
+    ///
+    /// @param section Section to update
+    /// @param object Fields of the section, maybe null
+    /// @return true when any value was changed
+    bool tryUpdateSection(const Section section, const JsonObjectConst& object);
+
+    /// @brief Check a partial update of a single section before applying it with @ref tryUpdateSection
+    ///
+    /// Invalid rules and schedules would otherwise be skipped silently.
+    ///
+    /// @param section Section to check
+    /// @param object Fields of the section, maybe null
+    /// @param error Receives a description of the first invalid field
+    /// @return true if the update can be applied
+    bool checkSectionUpdate(const Section section, const JsonObjectConst& object, String& error) const;
+
+    /// @brief Add a handler applying changes of a section in place
+    ///
+    /// @param section Section to observe
+    /// @param handler Handler, called from @ref update
+    void onChange(const Section section, ChangeHandler handler);
+
+    /// @brief Mark a section as changed, its handlers are notified by the next @ref update
+    ///
+    /// Safe to call from web server callbacks, which may run while the loop is blocked inside a module.
+    ///
+    /// @param section Changed section
+    void notifyChanged(const Section section) { pendingChanges |= 1 << static_cast<uint8_t>(section); }
+
+    /// @brief Notify the handlers of changed sections and write scheduled saves, must be called from the loop
+    void update();
+
+    /// @brief Get the revision of the config, changes whenever it is saved
+    ///
+    /// Starts at a random value every boot, so revisions seen before a reboot do not match the current config
+    uint32_t getRevision() const { return revision; }
+
+public:
+    constexpr static const uint16_t CONFIG_VERSION = 7; /// Schema version of the binary image
+    constexpr static const uint32_t SAVE_DELAY_MS = 2000; /// Quiet time before a scheduled save is written
+    constexpr static const uint32_t SAVE_MAX_DELAY_MS = 10000; /// Longest a scheduled save is delayed
+
 private:
+    /// @brief Header of the binary image
+    struct ImageHeader
+    {
+        uint32_t magic; /// Identifies the file
+        uint16_t version; /// Schema version the payload was written with
+        uint16_t length; /// Length of the payload following the header
+        uint32_t generation; /// Incremented with every write, the slot with the higher generation is newer
+        uint32_t crc; /// CRC32 of the header fields before it and the payload
+    };
+
+    /// @brief Upgrades a config loaded from an image of one version to the next version
+    typedef void (*Migration)(Config& config);
+
+    /// @brief Load the newest valid slot with a single read, migrating older versions
+    ///
+    /// @return true if a valid image was loaded
+    bool loadImage();
+
+    /// @brief Read and check an image slot
+    ///
+    /// @param slot Slot index, 0 or 1
+    /// @param header Receives the header
+    /// @return Image including the header and one spare byte, null if missing or invalid
+    std::unique_ptr<uint8_t[]> readSlot(const uint8_t slot, ImageHeader& header);
+
+    /// @brief Write the image into the inactive slot and switch to it once it was read back successfully
+    ///
+    /// @return true if the image was written and verified
+    bool commit();
+
+    /// @brief Delay the next attempt after a failed @ref commit
+    void retryCommit();
+
+    /// @brief Calculate the CRC32 of an image
+    static uint32_t imageCrc(const ImageHeader& header, const uint8_t* payload);
+
+    /// @brief Import the legacy JSON file
     void readConfig();
 
 private:
+    uint32_t revision = 0; /// Revision of the config
+    uint32_t generation = 0; /// Generation of the active slot
+    uint8_t activeSlot = 1; /// Slot holding the last good image, the first write goes to slot 0
+    bool savePending = false; /// Changes have not been written yet
+    uint32_t firstChangeAt = 0; /// Time in ms of the first unwritten change
+    uint32_t lastChangeAt = 0; /// Time in ms of the last unwritten change
+    uint8_t pendingChanges = 0; /// Mask of sections changed since the last @ref update
+    std::vector<ChangeHandler> changeHandlers[SECTION_COUNT]; /// Handlers of each section
     NetworkConfig networkConfig;
     MqttConfig mqttConfig;
     PVOutputConfig pvoutputConfig;
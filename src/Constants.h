@@ -44,7 +44,7 @@ extern const char* HOSTNAME PROGMEM;
 // size: 13 chars
 extern char deviceMAC[13];
 
-constexpr static const uint32_t RENOGY_INTERVAL = 2; /// The interval in s at which the renogy data should be read
+constexpr static const uint32_t RENOGY_INTERVAL = 2; /// Default poll interval and PVOutput sample interval in s
 
 namespace RNGBridge
 {
@@ -0,0 +1,289 @@
+#include "EventStream.h"
+
+#include <algorithm>
+#include <new>
+
+#include "Constants.h"
+
+EventStreamClient::EventStreamClient(AsyncWebServerRequest* request, EventStream& stream)
+    : stream(stream), tcp(request->client())
+{
+    if (request->hasHeader("Last-Event-ID"))
+    {
+        _lastId = strtoul(request->getHeader("Last-Event-ID")->value().c_str(), nullptr, 10);
+    }
+    patches = request->hasParam("patches");
+    tcp->setRxTimeout(0);
+    tcp->onError(nullptr, nullptr);
+    tcp->onData(nullptr, nullptr);
+    tcp->onAck([](void* self, AsyncClient*, size_t, uint32_t) { static_cast<EventStreamClient*>(self)->onAck(); },
+        this);
+    tcp->onPoll([](void* self, AsyncClient*) { static_cast<EventStreamClient*>(self)->runQueue(); }, this);
+    tcp->onTimeout([](void*, AsyncClient* c, uint32_t) { c->close(true); }, this);
+    tcp->onDisconnect(
+        [](void* self, AsyncClient* c) {
+            // Deleted by EventStream::cleanup, which may not run in a TCP callback
+            auto client = static_cast<EventStreamClient*>(self);
+            client->tcp = nullptr;
+            client->queue.clear();
+            delete c;
+        },
+        this);
+    delete request;
+}
+
+EventStreamClient::~EventStreamClient()
+{
+    if (tcp)
+    {
+        tcp->onDisconnect(nullptr, nullptr);
+        tcp->close(true);
+        delete tcp;
+    }
+}
+
+void EventStreamClient::send(const char* message, const char* event, const uint32_t id, const Delivery delivery)
+{
+    uint16_t length;
+    const std::shared_ptr<char> data = EventStream::format(message, event, id, length);
+    if (data)
+    {
+        enqueue(data, length, delivery);
+    }
+}
+
+void EventStreamClient::enqueue(const std::shared_ptr<char>& data, const uint16_t length, const Delivery delivery)
+{
+    if (!tcp)
+    {
+        return;
+    }
+
+    if (delivery == Delivery::latest)
+    {
+        if (stale)
+        {
+            ++stream.droppedCount;
+            return;
+        }
+        if (queuedLatest >= MAX_QUEUED_LATEST || ESP.getFreeHeap() < MIN_SEND_HEAP)
+        {
+            // Falling behind, drop everything not started yet and resync once the queue is drained
+            for (auto it = queue.begin(); it != queue.end();)
+            {
+                if (it->delivery == Delivery::latest && !it->sent)
+                {
+                    it = queue.erase(it);
+                    --queuedLatest;
+                    ++stream.droppedCount;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            ++stream.droppedCount;
+            stale = true;
+            RNG_DEBUGF("[EventStream] Client %s fell behind, dropped events\n", tcp->remoteIP().toString().c_str());
+            return;
+        }
+        ++queuedLatest;
+    }
+
+    queue.push_back(Message {data, length, 0, delivery});
+    runQueue();
+}
+
+void EventStreamClient::runQueue()
+{
+    if (!tcp || !tcp->canSend())
+    {
+        return;
+    }
+
+    bool added = false;
+    while (!queue.empty() && tcp->space())
+    {
+        Message& message = queue.front();
+        const size_t written = tcp->add(message.data.get() + message.sent, message.length - message.sent);
+        if (!written)
+        {
+            break;
+        }
+        added = true;
+        message.sent += written;
+        if (message.sent == message.length)
+        {
+            if (message.delivery == Delivery::latest)
+            {
+                --queuedLatest;
+            }
+            queue.pop_front();
+        }
+    }
+    if (added)
+    {
+        tcp->send();
+    }
+
+    // Also reached from the poll callback, a client which went stale with nothing in flight gets no ACK
+    if (stale && queue.empty())
+    {
+        stale = false;
+        if (stream.resyncHandler)
+        {
+            stream.resyncHandler(this);
+        }
+    }
+}
+
+void EventStreamClient::onAck()
+{
+    runQueue();
+}
+
+EventStream::Response::Response(EventStream& stream) : stream(stream)
+{
+    _code = 200;
+    _contentType = "text/event-stream";
+    _sendContentLength = false;
+    addHeader("Cache-Control", "no-cache");
+    addHeader("Connection", "keep-alive");
+}
+
+void EventStream::Response::_respond(AsyncWebServerRequest* request)
+{
+    const String head = _assembleHead(request->version());
+    request->client()->write(head.c_str(), _headLength);
+    _state = RESPONSE_WAIT_ACK;
+}
+
+size_t EventStream::Response::_ack(AsyncWebServerRequest* request, size_t len, uint32_t time)
+{
+    if (len)
+    {
+        // Deletes the request and with it this response
+        EventStream& stream = this->stream;
+        EventStreamClient* client = new (std::nothrow) EventStreamClient(request, stream);
+        if (client)
+        {
+            stream.clients.emplace_back(client);
+            if (stream.connectHandler)
+            {
+                stream.connectHandler(client);
+            }
+        }
+    }
+    return 0;
+}
+
+void EventStream::send(
+    const char* message, const char* event, const uint32_t id, const Delivery delivery, ClientFilter filter)
+{
+    cleanup();
+    const size_t receivers = filter
+        ? std::count_if(clients.begin(), clients.end(), [filter](const std::unique_ptr<EventStreamClient>& client) {
+              return filter(*client);
+          })
+        : clients.size();
+    if (!receivers)
+    {
+        return;
+    }
+
+    uint16_t length;
+    const std::shared_ptr<char> data = format(message, event, id, length);
+    if (!data)
+    {
+        droppedCount += receivers;
+        return;
+    }
+    for (auto& client : clients)
+    {
+        if (!filter || filter(*client))
+        {
+            client->enqueue(data, length, delivery);
+        }
+    }
+}
+
+size_t EventStream::count()
+{
+    cleanup();
+    return clients.size();
+}
+
+bool EventStream::canHandle(AsyncWebServerRequest* request)
+{
+    if (request->method() != HTTP_GET || request->url() != url)
+    {
+        return false;
+    }
+    request->addInterestingHeader("Last-Event-ID");
+    return true;
+}
+
+void EventStream::handleRequest(AsyncWebServerRequest* request)
+{
+    cleanup();
+    if (clients.size() >= MAX_CLIENTS || ESP.getFreeHeap() < MIN_ADMISSION_HEAP)
+    {
+        ++refusedCount;
+        RNG_DEBUGF("[EventStream] Refusing client, %u connected, %u bytes free\n",
+            static_cast<unsigned>(clients.size()), ESP.getFreeHeap());
+        AsyncWebServerResponse* response = request->beginResponse(503);
+        response->addHeader("Retry-After", "10");
+        request->send(response);
+        return;
+    }
+    request->send(new Response(*this));
+}
+
+std::shared_ptr<char> EventStream::format(const char* message, const char* event, const uint32_t id, uint16_t& length)
+{
+    char header[48];
+    size_t headerLength = 0;
+    if (id)
+    {
+        headerLength += snprintf_P(header, sizeof(header), PSTR("id: %u\n"), id);
+    }
+    if (event)
+    {
+        headerLength += snprintf_P(header + headerLength, sizeof(header) - headerLength, PSTR("event: %s\n"), event);
+        headerLength = std::min(headerLength, sizeof(header) - 1);
+    }
+
+    const size_t messageLength = strlen(message);
+    const size_t total = headerLength + 6 + messageLength + 2;
+    if (total > UINT16_MAX)
+    {
+        return nullptr;
+    }
+    char* data = new (std::nothrow) char[total];
+    if (!data)
+    {
+        return nullptr;
+    }
+    memcpy(data, header, headerLength);
+    memcpy_P(data + headerLength, PSTR("data: "), 6);
+    memcpy(data + headerLength + 6, message, messageLength);
+    data[total - 2] = '\n';
+    data[total - 1] = '\n';
+    length = total;
+    return std::shared_ptr<char>(data, std::default_delete<char[]>());
+}
+
+void EventStream::cleanup()
+{
+    for (auto it = clients.begin(); it != clients.end();)
+    {
+        if ((*it)->connected())
+        {
+            ++it;
+        }
+        else
+        {
+            it = clients.erase(it);
+        }
+    }
+}
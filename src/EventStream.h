@@ -0,0 +1,192 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <ESPAsyncWebServer.h>
+
+class EventStream;
+
+/// @brief Delivery guarantee of a server-sent event
+enum class Delivery : uint8_t
+{
+    reliable, /// Always queued, e.g. OTA progress
+    latest, /// Only the latest state matters, may be dropped when the client falls behind
+};
+
+/// @brief Client connected to an @ref EventStream
+///
+/// Every client has its own queue of events not yet handed to the TCP stack. If more than
+/// @ref MAX_QUEUED_LATEST events with @ref Delivery::latest are waiting, or the heap runs low, all of them are dropped
+/// and further ones are refused until the queue is drained. Then the resync handler of the stream sends the current
+/// state once, so a slow client skips intermediate states instead of piling them up.
+class EventStreamClient
+{
+public:
+    /// @brief Take over the connection of an accepted request
+    ///
+    /// @param request Request, deleted by the constructor
+    /// @param stream Stream the client belongs to
+    EventStreamClient(AsyncWebServerRequest* request, EventStream& stream);
+
+    EventStreamClient(EventStreamClient&&) = delete;
+
+    ~EventStreamClient();
+
+    /// @brief Queue an event for this client
+    ///
+    /// @param message Data of the event, must not contain line breaks
+    /// @param event Event name, may be null
+    /// @param id Event id, 0 for none
+    /// @param delivery Delivery guarantee
+    void send(const char* message, const char* event = nullptr, const uint32_t id = 0,
+        const Delivery delivery = Delivery::latest);
+
+    /// @brief Get the id of the last event the client received before reconnecting
+    uint32_t lastId() const { return _lastId; }
+
+    /// @brief Check if the client asked for patch events with the `patches` query parameter
+    bool acceptsPatches() const { return patches; }
+
+    /// @brief Get the TCP connection, null once disconnected
+    AsyncClient* client() { return tcp; }
+
+    /// @brief Check if the client is still connected
+    bool connected() const { return tcp != nullptr; }
+
+    /// @brief Get the number of events waiting to be handed to the TCP stack
+    size_t queued() const { return queue.size(); }
+
+public:
+    constexpr static const uint8_t MAX_QUEUED_LATEST = 4; /// Maximum number of waiting events which may be dropped
+    constexpr static const uint32_t MIN_SEND_HEAP = 6144; /// Free heap below which droppable events are dropped
+
+private:
+    friend class EventStream;
+
+    /// @brief Formatted event, shared by all clients it is broadcast to
+    struct Message
+    {
+        std::shared_ptr<char> data; /// Formatted event
+        uint16_t length = 0; /// Length of the formatted event
+        uint16_t sent = 0; /// Bytes already handed to the TCP stack
+        Delivery delivery = Delivery::latest; /// Delivery guarantee
+    };
+
+    /// @brief Queue a formatted event, applying the drop policy
+    void enqueue(const std::shared_ptr<char>& data, const uint16_t length, const Delivery delivery);
+
+    /// @brief Hand waiting events to the TCP stack, as much as it accepts, and resync a stale client once drained
+    void runQueue();
+
+    /// @brief Called when the TCP stack acknowledged sent data
+    void onAck();
+
+private:
+    EventStream& stream; /// Stream the client belongs to
+    AsyncClient* tcp; /// TCP connection, null once disconnected
+    uint32_t _lastId = 0; /// Value of the `Last-Event-ID` header
+    bool patches = false; /// Client applies patch events, see @ref acceptsPatches
+    std::deque<Message> queue; /// Events not yet handed to the TCP stack
+    uint8_t queuedLatest = 0; /// Number of waiting events which may be dropped
+    bool stale = false; /// Events were dropped, the current state has to be sent again
+}; // class EventStreamClient
+
+/// @brief Server-sent events handler with per-client backpressure and admission control
+///
+/// Replaces AsyncEventSource, which queues every event for every client without limit and cannot tell about slow
+/// clients. New clients are refused with 503 if too many are connected or the free heap is below
+/// @ref MIN_ADMISSION_HEAP.
+///
+/// All callbacks run either in the sketch loop or the system context, which never preempts the loop, so no locking is
+/// needed.
+class EventStream : public AsyncWebHandler
+{
+public:
+    /// @brief Handler called with a client, see @ref onConnect and @ref onResync
+    typedef std::function<void(EventStreamClient* client)> ClientHandler;
+
+    /// @brief Selects the clients an event is sent to, see @ref send
+    typedef bool (*ClientFilter)(const EventStreamClient& client);
+
+public:
+    /// @brief Construct a new EventStream object
+    ///
+    /// @param url Path of the stream
+    EventStream(const char* url) : url(url) { }
+
+    EventStream(EventStream&&) = delete;
+
+    /// @brief Set the handler called when a client connected
+    void onConnect(ClientHandler handler) { connectHandler = handler; }
+
+    /// @brief Set the handler sending the current state to a client which had events dropped
+    void onResync(ClientHandler handler) { resyncHandler = handler; }
+
+    /// @brief Queue an event for all clients
+    ///
+    /// The event is formatted once and shared by all queues.
+    ///
+    /// @param message Data of the event, must not contain line breaks
+    /// @param event Event name, may be null
+    /// @param id Event id, 0 for none
+    /// @param delivery Delivery guarantee
+    /// @param filter Only send to clients it returns true for, null for all clients
+    void send(const char* message, const char* event = nullptr, const uint32_t id = 0,
+        const Delivery delivery = Delivery::latest, ClientFilter filter = nullptr);
+
+    /// @brief Get the number of connected clients
+    size_t count();
+
+    /// @brief Get the number of clients refused since boot
+    uint32_t refused() const { return refusedCount; }
+
+    /// @brief Get the number of events dropped since boot
+    uint32_t dropped() const { return droppedCount; }
+
+    bool canHandle(AsyncWebServerRequest* request) override;
+    void handleRequest(AsyncWebServerRequest* request) override;
+
+public:
+    constexpr static const uint8_t MAX_CLIENTS = 4; /// Maximum number of connected clients
+    constexpr static const uint32_t MIN_ADMISSION_HEAP = 12288; /// Free heap required to accept a new client
+
+private:
+    friend class EventStreamClient;
+
+    /// @brief Response sending the headers, then hands the connection to a new @ref EventStreamClient
+    class Response : public AsyncWebServerResponse
+    {
+    public:
+        Response(EventStream& stream);
+
+        void _respond(AsyncWebServerRequest* request) override;
+        size_t _ack(AsyncWebServerRequest* request, size_t len, uint32_t time) override;
+        bool _sourceValid() const override { return true; }
+
+    private:
+        EventStream& stream; /// Stream to add the client to
+    };
+
+    /// @brief Format an event
+    ///
+    /// @param message Data of the event
+    /// @param event Event name, may be null
+    /// @param id Event id, 0 for none
+    /// @param length Receives the length of the formatted event
+    /// @return Formatted event, null if out of memory
+    static std::shared_ptr<char> format(const char* message, const char* event, const uint32_t id, uint16_t& length);
+
+    /// @brief Delete disconnected clients
+    void cleanup();
+
+private:
+    const char* url; /// Path of the stream
+    std::vector<std::unique_ptr<EventStreamClient>> clients; /// Clients, disconnected ones until @ref cleanup
+    ClientHandler connectHandler; /// Called when a client connected
+    ClientHandler resyncHandler; /// Called when a client drained its queue after events were dropped
+    uint32_t refusedCount = 0; /// Number of refused clients
+    uint32_t droppedCount = 0; /// Number of dropped events
+}; // class EventStream
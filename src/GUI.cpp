@@ -2,72 +2,194 @@
 
 #include "Constants.h"
 
-String GUI::status = "";
+namespace
+{
+    constexpr const float VOLTAGE_STEP = 0.1f; /// Precision of voltages in V
+    constexpr const float CURRENT_STEP = 0.01f; /// Precision of currents in A
+
+    /// @brief Round a value to a multiple of step, so it is printed short and only changes when visible
+    float quantize(const float value, const float step)
+    {
+        return roundf(value / step) * step;
+    }
+
+    /// @brief Set a value if it differs from the current one and record the change in a merge patch
+    ///
+    /// @param variant Variant or member to set
+    /// @param patch Same member of the merge patch, may belong to an unbound variant to not record changes
+    /// @param value Value to set
+    /// @return true if the value changed
+    template <typename TVariant, typename TPatch, typename T>
+    bool assign(TVariant&& variant, TPatch&& patch, const T value)
+    {
+        if (!variant.isNull() && variant.template as<T>() == value)
+        {
+            return false;
+        }
+        variant.set(value);
+        patch.set(value);
+        return true;
+    }
+
+    template <typename TVariant, typename TPatch>
+    bool assign(TVariant&& variant, TPatch&& patch, const char* value)
+    {
+        const char* current = variant.template as<const char*>();
+        if (current && strcmp(current, value) == 0)
+        {
+            return false;
+        }
+        variant.set(value);
+        patch.set(value);
+        return true;
+    }
+} // namespace
+
+char GUI::status[STATUS_SIZE] = "";
+uint8_t GUI::packedStatus[STATUS_SIZE];
+size_t GUI::packedStatusLength = 0;
+uint32_t GUI::sequence = 0;
+char GUI::patches[PATCH_HISTORY][PATCH_SIZE] = {};
 
 void GUI::updateRenogyStatus(const Renogy::Data& data)
 {
-    auto battery = _status["b"];
-    battery["ch"] = data.batteryCharge;
-    battery["vo"] = data.batteryVoltage;
-    battery["cu"] = data.batteryCurrent;
-    battery["te"] = data.batteryTemperature;
-    battery["ge"] = data.generation;
-    battery["co"] = data.consumption;
-    battery["to"] = data.total;
-
-    auto load = _status["l"];
-    load["vo"] = data.loadVoltage;
-    load["cu"] = data.loadCurrent;
-
-    auto panel = _status["p"];
-    panel["vo"] = data.panelVoltage;
-    panel["cu"] = data.panelCurrent;
-
-    auto controller = _status["c"];
-    controller["st"] = data.chargingState;
-    controller["er"] = data.errorState;
-    controller["te"] = data.controllerTemperature;
+    if (writeRenogyStatus(_status, data, _patch))
+    {
+        dirty |= DIRTY_RENOGY;
+    }
+}
 
-    auto output = _status["o"];
-    output["l"] = data.loadEnabled;
+bool GUI::writeRenogyStatus(JsonVariant object, const Renogy::Data& data, JsonVariant patch)
+{
+    bool changed = false;
+
+    auto battery = object["b"];
+    auto batteryPatch = patch["b"];
+    changed |= assign(battery["ch"], batteryPatch["ch"], data.batteryCharge);
+    changed |= assign(battery["vo"], batteryPatch["vo"], quantize(data.batteryVoltage, VOLTAGE_STEP));
+    changed |= assign(battery["cu"], batteryPatch["cu"], quantize(data.batteryCurrent, CURRENT_STEP));
+    changed |= assign(battery["te"], batteryPatch["te"], data.batteryTemperature);
+    changed |= assign(battery["ge"], batteryPatch["ge"], data.generation);
+    changed |= assign(battery["co"], batteryPatch["co"], data.consumption);
+    changed |= assign(battery["to"], batteryPatch["to"], data.total);
+
+    auto load = object["l"];
+    auto loadPatch = patch["l"];
+    changed |= assign(load["vo"], loadPatch["vo"], quantize(data.loadVoltage, VOLTAGE_STEP));
+    changed |= assign(load["cu"], loadPatch["cu"], quantize(data.loadCurrent, CURRENT_STEP));
+
+    auto panel = object["p"];
+    auto panelPatch = patch["p"];
+    changed |= assign(panel["vo"], panelPatch["vo"], quantize(data.panelVoltage, VOLTAGE_STEP));
+    changed |= assign(panel["cu"], panelPatch["cu"], quantize(data.panelCurrent, CURRENT_STEP));
+
+    auto controller = object["c"];
+    auto controllerPatch = patch["c"];
+    changed |= assign(controller["st"], controllerPatch["st"], data.chargingState);
+    changed |= assign(controller["er"], controllerPatch["er"], data.errorState);
+    changed |= assign(controller["te"], controllerPatch["te"], data.controllerTemperature);
+
+    changed |= assign(object["o"]["l"], patch["o"]["l"], data.loadEnabled);
+
+    return changed;
 }
 
 void GUI::updateMQTTStatus(const String& status)
 {
-    _status["mqttsta"] = status;
+    if (assign(_status["mqttsta"], _patch["mqttsta"], status.c_str()))
+    {
+        dirty |= DIRTY_MQTT;
+    }
 }
 
 void GUI::updatePVOutputStatus(const String& status)
 {
-    _status["pvosta"] = status;
+    if (assign(_status["pvosta"], _patch["pvosta"], status.c_str()))
+    {
+        dirty |= DIRTY_PVO;
+    }
 }
 
 void GUI::updateOutputStatus(const OutputStatus& status)
 {
+    // The load state is taken from the controller data, see writeRenogyStatus
     auto output = _status["o"];
-    output["o1"] = status.out1;
-    output["o2"] = status.out2;
-    output["o3"] = status.out3;
+    auto outputPatch = _patch["o"];
+    bool changed = false;
+    for (uint8_t i = static_cast<uint8_t>(Output::out1); i < DeviceConfig::OUTPUT_COUNT; ++i)
+    {
+        char key[3];
+        snprintf_P(key, sizeof(key), PSTR("o%u"), i);
+        changed |= assign(output[key], outputPatch[key], status.states[i]);
+    }
+    if (changed)
+    {
+        dirty |= DIRTY_OUTPUT;
+    }
 }
 
 void GUI::updateOtaStatus(const String& status)
 {
-    _status["otasta"] = status;
+    if (assign(_status["otasta"], _patch["otasta"], status.c_str()))
+    {
+        dirty |= DIRTY_OTA;
+    }
 }
 
 void GUI::updateUptime(const uint32_t uptime)
 {
-    _status["up"] = uptime;
+    this->uptime = uptime;
+    if (assign(_status["up"], _patch["up"], uptime))
+    {
+        dirty |= DIRTY_TELEMETRY;
+    }
 }
 
 void GUI::updateHeap(const uint32_t heap)
 {
-    _status["he"] = heap;
+    if (assign(_status["he"], _patch["he"], heap))
+    {
+        dirty |= DIRTY_TELEMETRY;
+    }
 }
 
 void GUI::update()
 {
-    _status["rssi"] = RNGBridge::rssi;
-    status.clear();
-    serializeJson(_status, status);
+    if (assign(_status["rssi"], _patch["rssi"], RNGBridge::rssi))
+    {
+        dirty |= DIRTY_TELEMETRY;
+    }
+
+    // Telemetry alone changes every second, so it only causes a new status every few seconds
+    if (!dirty || (dirty == DIRTY_TELEMETRY && uptime - serializedAt < TELEMETRY_INTERVAL_S))
+    {
+        return;
+    }
+
+    const size_t length = serializeJson(_status, status, sizeof(status));
+    if (length >= sizeof(status) - 1)
+    {
+        RNG_DEBUGLN(F("[GUI] Status truncated"));
+    }
+    packedStatusLength = serializeMsgPack(_status, packedStatus, sizeof(packedStatus));
+
+    ++sequence;
+    char* patch = patches[sequence % PATCH_HISTORY];
+    if (serializeJson(_patch, patch, PATCH_SIZE) >= PATCH_SIZE - 1)
+    {
+        // Too large to be complete, receivers have to fall back to the status
+        patch[0] = '\0';
+    }
+    _patch.clear();
+    dirty = 0;
+    serializedAt = uptime;
+}
+
+const char* GUI::getPatch(const uint32_t id)
+{
+    if (id == 0 || id > sequence || sequence - id >= PATCH_HISTORY || !patches[id % PATCH_HISTORY][0])
+    {
+        return nullptr;
+    }
+    return patches[id % PATCH_HISTORY];
 }
@@ -5,6 +5,12 @@
 #include "OutputControl.h"
 #include "Renogy.h"
 
+/// @brief Status shown in the UI and published via MQTT
+///
+/// Fields mark what they changed in a dirty mask. @ref update only serializes the status into its fixed buffers if
+/// something changed, telemetry which changes every second is only included every @ref TELEMETRY_INTERVAL_S.
+/// Changed fields are also collected into a JSON merge patch (RFC 7386), which turns the previous status into the
+/// current one, so receivers which already have a status only need the patch.
 class GUI
 {
 public:
@@ -26,11 +32,53 @@ public:
 
     void updateHeap(const uint32_t heap);
 
+    /// @brief Serialize the status if it changed
+    ///
+    /// Should be called once every second
     void update();
 
+    /// @brief Write renogy data into the given object using the keys and precision of the status
+    ///
+    /// @param object Object to write into
+    /// @param data Renogy data
+    /// @param patch Object to write changed values into, optional
+    /// @return true if any value changed
+    static bool writeRenogyStatus(JsonVariant object, const Renogy::Data& data, JsonVariant patch = JsonVariant());
+
+    /// @brief Get the merge patch which turned the status with sequence `id - 1` into the status with sequence `id`
+    ///
+    /// @param id Sequence of the status the patch results in
+    /// @return Null terminated JSON merge patch or null if it is no longer or not completely available
+    static const char* getPatch(const uint32_t id);
+
 public:
-    static String status;
+    constexpr static const size_t STATUS_SIZE = 768; /// Size of the serialized status buffers
+    constexpr static const uint32_t TELEMETRY_INTERVAL_S = 10; /// Interval of publishing telemetry only changes
+    constexpr static const size_t PATCH_SIZE = 256; /// Size of a serialized merge patch
+    constexpr static const uint8_t PATCH_HISTORY = 4; /// Number of kept merge patches, for resuming receivers
+
+    static char status[STATUS_SIZE]; /// Status as null terminated JSON
+    static uint8_t packedStatus[STATUS_SIZE]; /// Status as MessagePack
+    static size_t packedStatusLength; /// Length of @ref packedStatus
+    static uint32_t sequence; /// Incremented whenever the serialized status changed, lets senders skip duplicates
+    static char patches[PATCH_HISTORY][PATCH_SIZE]; /// Latest merge patches, indexed by their sequence
+
+private:
+    /// @brief Parts of the status which changed since the last @ref update
+    enum Dirty : uint8_t
+    {
+        DIRTY_RENOGY = 1 << 0,
+        DIRTY_OUTPUT = 1 << 1,
+        DIRTY_MQTT = 1 << 2,
+        DIRTY_PVO = 1 << 3,
+        DIRTY_OTA = 1 << 4,
+        DIRTY_TELEMETRY = 1 << 5, /// Uptime, heap and rssi
+    };
 
 private:
     JsonDocument _status;
+    JsonDocument _patch; /// Changes since the last @ref update
+    uint8_t dirty = 0; /// Mask of @ref Dirty parts
+    uint32_t uptime = 0; /// Uptime in seconds
+    uint32_t serializedAt = 0; /// Uptime in seconds the status was last serialized
 };
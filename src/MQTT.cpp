@@ -1,311 +1,800 @@
 #include "MQTT.h"
 
 #include <ArduinoJson.h>
+#include <ESP8266WiFi.h>
+#include <time.h>
 
 #include "Constants.h"
 #include "GUI.h"
 
-void Mqtt::connect()
+namespace
 {
-    // Set last will and connect
-    const bool connected = mqtt.connect(mqttConfig.id.c_str(), mqttConfig.user.c_str(), mqttConfig.password.c_str(),
-        (mqttConfig.topic + "/lwt").c_str(), 2, true, DISCONNECTED);
+    /// @brief Value which is published to its own topic when splitting is enabled
+    struct SplitTopic
+    {
+        Renogy::Field field; /// Field of the renogy data
+        uint8_t decimals; /// Number of decimals when formatting the value
+        char suffix[24]; /// Suffix appended to the base topic
+    };
+
+    const SplitTopic SPLIT_TOPICS[] PROGMEM = {
+        {Renogy::Field::batteryCharge, 0, "/battery/charge"},
+        {Renogy::Field::batteryVoltage, 2, "/battery/voltage"},
+        {Renogy::Field::batteryCurrent, 2, "/battery/current"},
+        {Renogy::Field::batteryTemperature, 0, "/battery/temperature"},
+        {Renogy::Field::consumption, 0, "/battery/consumption"},
+        {Renogy::Field::generation, 0, "/battery/generation"},
+        {Renogy::Field::loadVoltage, 2, "/load/voltage"},
+        {Renogy::Field::loadCurrent, 2, "/load/current"},
+        {Renogy::Field::panelVoltage, 2, "/panel/voltage"},
+        {Renogy::Field::panelCurrent, 2, "/panel/current"},
+        {Renogy::Field::chargingState, 0, "/controller/state"},
+        {Renogy::Field::errorState, 0, "/controller/error"},
+        {Renogy::Field::controllerTemperature, 0, "/controller/temperature"},
+    };
+
+    /// Suffixes of the topics before Mqtt::TOPIC_SPLIT, each terminated by '\0'
+    const char BASE_SUFFIXES[] PROGMEM = "/lwt\0/state\0/ol\0/o1\0/o2\0/o3\0/history\0/response\0/cmd/poll\0"
+                                         "/cmd/interval\0/cmd/output/load\0/cmd/output/out1\0/cmd/output/out2\0"
+                                         "/cmd/output/out3";
+
+    /// @brief Home Assistant entity announced via MQTT discovery
+    struct Discovery
+    {
+        char component[7]; /// Home Assistant component, `sensor` or `switch`
+        char name[23]; /// Human readable name
+        char id[7]; /// Unique id of the entity, switches use it as command topic suffix
+        char deviceClass[16]; /// Optional device class
+        char unit[4]; /// Optional unit of measurement
+        char stateClass[17]; /// Optional state class
+        char valueTemplate[120]; /// Template extracting the value from the state topic
+        char icon[26]; /// Optional icon
+    };
+
+    const Discovery DISCOVERIES[] PROGMEM = {
+        // Battery related
+        {"sensor", "Battery SOC", "batsoc", "battery", "%", "measurement", "{{value_json.b.ch}}", ""},
+        {"sensor", "Battery Voltage", "batvol", "voltage", "V", "measurement", "{{value_json.b.vo|round(1)}}",
+            "mdi:battery"},
+        {"sensor", "Battery Current", "batcur", "current", "A", "measurement", "{{value_json.b.cu|round(1)}}",
+            "mdi:battery"},
+        {"sensor", "Battery Temperature", "battem", "temperature", "°C", "measurement", "{{value_json.b.te}}",
+            "mdi:battery"},
+
+        {"sensor", "Generation", "engen", "energy", "Wh", "total_increasing", "{{value_json.b.ge}}", "mdi:plus"},
+        {"sensor", "Consumption", "encon", "energy", "Wh", "total_increasing", "{{value_json.b.co}}", "mdi:minus"},
+
+        // Load related
+        {"sensor", "Load Voltage", "loavol", "voltage", "V", "measurement", "{{value_json.l.vo|round(1)}}",
+            "mdi:alpha-l-box-outline"},
+        {"sensor", "Load Current", "loacur", "current", "A", "measurement", "{{value_json.l.cu|round(1)}}",
+            "mdi:alpha-l-box-outline"},
+        {"sensor", "Load Power", "loapow", "power", "W", "measurement",
+            "{{(value_json.l.vo*value_json.l.cu)|round(1)}}", "mdi:alpha-l-box-outline"},
+
+        // Panel related
+        {"sensor", "Panel Voltage", "panvol", "voltage", "V", "measurement", "{{value_json.p.vo|round(1)}}",
+            "mdi:solar-panel"},
+        {"sensor", "Panel Current", "pancur", "current", "A", "measurement", "{{value_json.p.cu|round(1)}}",
+            "mdi:solar-panel"},
+        {"sensor", "Panel Power", "panpow", "power", "W", "measurement",
+            "{{(value_json.p.vo*value_json.p.cu)|round(1)}}", "mdi:solar-panel"},
+
+        // Controller related
+        {"sensor", "Controller State", "consta", "", "", "",
+            "{{['Unknown',"
+            "'Deactivated',"
+            "'Activated',"
+            "'MPPT',"
+            "'Equalizing',"
+            "'Boost',"
+            "'Floating',"
+            "'Overpower'][value_json.c.st|int(-1)+1]}}",
+            "mdi:server"},
+        {"sensor", "Controller Error", "conerr", "", "", "", "{{value_json.c.er}}", "mdi:server"},
+        {"sensor", "Controller Temperature", "contem", "temperature", "°C", "measurement", "{{value_json.c.te}}",
+            "mdi:server"},
+
+        // Telemetry
+        {"sensor", "RSSI", "rssi", "signal_strength", "dBm", "measurement", "{{value_json.rssi}}", ""},
+
+        // Output (incl. load)
+        {"switch", "Load", "ol", "", "", "", "{{'true' if value_json.o.l else 'false'}}", "mdi:alpha-l-box-outline"},
+        {"switch", "Out 1", "o1", "", "", "", "{{'true' if value_json.o.o1 else 'false'}}",
+            "mdi:numeric-1-box-outline"},
+        {"switch", "Out 2", "o2", "", "", "", "{{'true' if value_json.o.o2 else 'false'}}",
+            "mdi:numeric-2-box-outline"},
+        {"switch", "Out 3", "o3", "", "", "", "{{'true' if value_json.o.o3 else 'false'}}",
+            "mdi:numeric-3-box-outline"},
+    };
+
+    /// @brief Print which only counts the written bytes, used to measure streamed payloads
+    class CountingPrint : public Print
+    {
+    public:
+        size_t write(uint8_t) override
+        {
+            ++count;
+            return 1;
+        }
+        size_t write(const uint8_t*, size_t size) override
+        {
+            count += size;
+            return size;
+        }
+
+    public:
+        size_t count = 0; /// Number of written bytes
+    };
 
-    if (connected)
+    /// @brief Write a string escaped for JSON, without quotes
+    ///
+    /// @param out Output
+    /// @param str String to escape
+    void writeEscaped(Print& out, const char* str)
     {
-        // Publish connected message
-        publish((mqttConfig.topic + "/lwt").c_str(), CONNECTED, true);
+        const char* start = str;
+        for (; *str; ++str)
+        {
+            if (*str == '"' || *str == '\\')
+            {
+                out.write(reinterpret_cast<const uint8_t*>(start), str - start);
+                out.write('\\');
+                start = str;
+            }
+        }
+        out.write(reinterpret_cast<const uint8_t*>(start), str - start);
+    }
 
-        // Update status
-        notify(FPSTR(CONNECTED));
+    /// @brief Write a JSON member with a string value
+    ///
+    /// @param out Output
+    /// @param key Key including quotes, colon and leading comma if needed, e.g. `,"name":`
+    /// @param value String value to escape and quote
+    void writeMember(Print& out, const __FlashStringHelper* key, const char* value)
+    {
+        out.print(key);
+        out.write('"');
+        writeEscaped(out, value);
+        out.write('"');
+    }
+
+    /// @brief Write a discovery message
+    ///
+    /// @param out Output
+    /// @param entry Entity to announce
+    /// @param deviceID Device identifier
+    /// @param baseTopic Base topic of the bridge
+    /// @param url Configuration url of the bridge
+    void writeDiscovery(
+        Print& out, const Discovery& entry, const char* deviceID, const char* baseTopic, const char* url)
+    {
+        out.print(F("{\"dev\":{\"mf\":\"enwi\",\"mdl\":\""));
+        writeEscaped(out, MODEL);
+        out.write(' ');
+        writeEscaped(out, HARDWARE_VERSION);
+        out.write('"');
+        writeMember(out, F(",\"name\":"), deviceID);
+        writeMember(out, F(",\"sw\":"), SOFTWARE_VERSION);
+        writeMember(out, F(",\"cu\":"), url);
+        writeMember(out, F(",\"ids\":["), deviceID);
+        out.print(F("]}"));
+
+        if (entry.deviceClass[0])
+        {
+            writeMember(out, F(",\"dev_cla\":"), entry.deviceClass);
+            writeMember(out, F(",\"unit_of_meas\":"), entry.unit);
+            writeMember(out, F(",\"stat_cla\":"), entry.stateClass);
+        }
 
-        setupLoadControl();
+        out.print(F(",\"name\":\""));
+        writeEscaped(out, deviceID);
+        out.write(' ');
+        writeEscaped(out, entry.name);
+        out.print(F("\",\"uniq_id\":\""));
+        writeEscaped(out, deviceID);
+        out.write('_');
+        writeEscaped(out, entry.id);
+        out.write('"');
+        writeMember(out, F(",\"~\":"), baseTopic);
+        out.print(F(",\"avty_t\":\"~/lwt\""));
+        writeMember(out, F(",\"pl_avail\":"), CONNECTED);
+        writeMember(out, F(",\"pl_not_avail\":"), DISCONNECTED);
+        out.print(F(",\"stat_t\":\"~/state\""));
+        writeMember(out, F(",\"val_tpl\":"), entry.valueTemplate);
+
+        if (strcmp_P(entry.component, PSTR("switch")) == 0)
+        {
+            out.print(F(",\"cmd_t\":\"~/"));
+            writeEscaped(out, entry.id);
+            out.print(F("\",\"payload_off\":\"false\",\"payload_on\":\"true\""));
+        }
+        if (entry.icon[0])
+        {
+            writeMember(out, F(",\"ic\":"), entry.icon);
+        }
+        out.write('}');
+    }
 
-        if (mqttConfig.hadiscovery)
+    /// @brief Hash a topic with 32 bit FNV-1a
+    ///
+    /// @param topic Null terminated topic
+    /// @return Hash of the topic
+    uint32_t hashTopic(const char* topic)
+    {
+        uint32_t hash = 2166136261UL;
+        for (; *topic; ++topic)
         {
-            // Battery related
-            publishSensorDiscovery("Battery SOC", "batsoc", "battery", "%", "measurement", "{{value_json.b.ch}}");
-            publishSensorDiscovery("Battery Voltage", "batvol", "voltage", "V", "measurement",
-                "{{value_json.b.vo|round(1)}}", "mdi:battery");
-            publishSensorDiscovery("Battery Current", "batcur", "current", "A", "measurement",
-                "{{value_json.b.cu|round(1)}}", "mdi:battery");
-            publishSensorDiscovery("Battery Temperature", "battem", "temperature", "°C", "measurement",
-                "{{value_json.b.te}}", "mdi:battery");
-
-            publishSensorDiscovery(
-                "Generation", "engen", "energy", "Wh", "total_increasing", "{{value_json.b.ge}}", "mdi:plus");
-            publishSensorDiscovery(
-                "Consumption", "encon", "energy", "Wh", "total_increasing", "{{value_json.b.co}}", "mdi:minus");
-
-            // Load related
-            publishSensorDiscovery("Load Voltage", "loavol", "voltage", "V", "measurement",
-                "{{value_json.l.vo|round(1)}}", "mdi:alpha-l-box-outline");
-            publishSensorDiscovery("Load Current", "loacur", "current", "A", "measurement",
-                "{{value_json.l.cu|round(1)}}", "mdi:alpha-l-box-outline");
-            publishSensorDiscovery("Load Power", "loapow", "power", "W", "measurement",
-                "{{(value_json.l.vo*value_json.l.cu)|round(1)}}", "mdi:alpha-l-box-outline");
-
-            // Panel related
-            publishSensorDiscovery("Panel Voltage", "panvol", "voltage", "V", "measurement",
-                "{{value_json.p.vo|round(1)}}", "mdi:solar-panel");
-            publishSensorDiscovery("Panel Current", "pancur", "current", "A", "measurement",
-                "{{value_json.p.cu|round(1)}}", "mdi:solar-panel");
-            publishSensorDiscovery("Panel Power", "panpow", "power", "W", "measurement",
-                "{{(value_json.p.vo*value_json.p.cu)|round(1)}}", "mdi:solar-panel");
-
-            // Controller related
-            publishSensorDiscovery("Controller State", "consta",
-                "{{['Unknown',"
-                "'Deactivated',"
-                "'Activated',"
-                "'MPPT',"
-                "'Equalizing',"
-                "'Boost',"
-                "'Floating',"
-                "'Overpower'][value_json.c.st|int(-1)+1]}}",
-                "mdi:server");
-            publishSensorDiscovery("Controller Error", "conerr", "{{value_json.c.er}}", "mdi:server");
-            publishSensorDiscovery("Controller Temperature", "contem", "temperature", "°C", "measurement",
-                "{{value_json.c.te}}", "mdi:server");
-
-            // Telemetry
-            publishSensorDiscovery("RSSI", "rssi", "signal_strength", "dBm", "measurement", "{{value_json.rssi}}");
-
-            // Output (incl. load)
-            // TODO command_topic
-            publishSwitchDiscovery(
-                "Load", "ol", "{{'true' if value_json.o.l else 'false'}}", "mdi:alpha-l-box-outline");
-            publishSwitchDiscovery(
-                "Out 1", "o1", "{{'true' if value_json.o.o1 else 'false'}}", "mdi:numeric-1-box-outline");
-            publishSwitchDiscovery(
-                "Out 2", "o2", "{{'true' if value_json.o.o2 else 'false'}}", "mdi:numeric-2-box-outline");
-            publishSwitchDiscovery(
-                "Out 3", "o3", "{{'true' if value_json.o.o3 else 'false'}}", "mdi:numeric-3-box-outline");
+            hash = (hash ^ static_cast<uint8_t>(*topic)) * 16777619UL;
         }
+        return hash;
     }
-    else
+} // namespace
+
+bool Mqtt::connect()
+{
+    buildTopics();
+
+    // Set last will and start connecting
+    if (!mqtt.connect(applied.id.c_str(), applied.user.c_str(), applied.password.c_str(),
+            topic(TOPIC_LWT), 2, true, DISCONNECTED))
     {
-        // Update status
         notify(F("Could not connect"));
+        scheduleReconnect();
+        return false;
     }
+    state = State::connecting;
+    return true;
+}
+
+void Mqtt::onConnected()
+{
+    // Publish connected message
+    publish(topic(TOPIC_LWT), CONNECTED, true, 1);
+
+    // Update status
+    notify(FPSTR(CONNECTED));
+    state = State::connected;
+    backoff = 0;
+
+    // Report everything again after reconnecting
+    hasReported = false;
+
+    setupCommands();
 }
 
 void Mqtt::disconnect()
 {
     mqtt.disconnect();
     notify(FPSTR(DISCONNECTED));
+    scheduleReconnect();
 }
 
 void Mqtt::loop()
 {
-    mqtt.loop();
-    if (!mqtt.connected())
+    switch (state)
     {
-        if (_value.startsWith("C"))
+    case State::connected:
+        mqtt.loop();
+        if (mqtt.connected())
+        {
+            if (pollPending)
+            {
+                pollPending = false;
+                if (pollHandler)
+                {
+                    pollHandler();
+                }
+            }
+            if (discoveryPending && applied.hadiscovery)
+            {
+                discoveryPending = !publishDiscovery();
+            }
+            drainOutbox();
+            // Send everything published in this cycle in as few segments as possible
+            mqtt.flush();
+#ifdef RNG_DEBUG_SERIAL
+            if (millis() - statsLoggedAt >= STATS_LOG_INTERVAL_MS)
+            {
+                statsLoggedAt = millis();
+                const MqttClient::Stats& stats = mqtt.getStats();
+                RNG_DEBUGF("[MQTT] %u publishes in %u sends, %u writes, %u bytes\n", stats.publishes, stats.sends,
+                    stats.writes, stats.bytes);
+            }
+#endif
+        }
+        else
         {
             notify(FPSTR(DISCONNECTED));
+            scheduleReconnect();
+        }
+        break;
+    case State::disabled:
+        break;
+    case State::waiting:
+        if (static_cast<int32_t>(millis() - reconnectAt) >= 0)
+        {
+            connect();
         }
-        connect();
+        break;
+    case State::connecting:
+        mqtt.loop();
+        if (mqtt.connected())
+        {
+            onConnected();
+            mqtt.flush();
+        }
+        else if (mqtt.getState() == MqttClient::State::disconnected)
+        {
+            notify(F("Could not connect"));
+            scheduleReconnect();
+        }
+        break;
     }
-    else
+}
+
+void Mqtt::reconfigure()
+{
+    const bool reconnect = mqttConfig.enabled != applied.enabled || mqttConfig.server != applied.server
+        || mqttConfig.port != applied.port || mqttConfig.id != applied.id || mqttConfig.user != applied.user
+        || mqttConfig.password != applied.password || mqttConfig.topic != applied.topic
+        || mqttConfig.haDiscoveryTopic != applied.haDiscoveryTopic;
+    const bool rediscover = reconnect || mqttConfig.hadiscovery != applied.hadiscovery
+        || mqttConfig.split != applied.split;
+    const bool outboxChanged = mqttConfig.outboxRam != applied.outboxRam
+        || mqttConfig.outboxFlash != applied.outboxFlash || mqttConfig.outboxNewestFirst != applied.outboxNewestFirst;
+    applied = mqttConfig;
+
+    if (reconnect)
     {
-        if (_value.startsWith("D"))
+        if (mqtt.connected())
         {
-            notify(FPSTR(CONNECTED));
+            // Graceful disconnects suppress the last will, so announce it on the old topic
+            publish(topic(TOPIC_LWT), DISCONNECTED, true, 1);
         }
+        mqtt.disconnect();
+        mqtt.setServer(applied.server.c_str(), applied.port);
+        birthTopic = applied.haDiscoveryTopic + "/status";
+        backoff = 0;
+        reconnectAt = millis();
+        state = applied.enabled ? State::waiting : State::disabled;
+        notify(applied.enabled ? FPSTR(DISCONNECTED) : F("Disabled"));
+    }
+    if (rediscover)
+    {
+        discoveryPending = true;
+        discoveryNext = 0;
+    }
+    if (outboxChanged)
+    {
+        RNG_DEBUGLN(F("[MQTT] Outbox changed, dropping stored states"));
+        outbox.reset();
+        createOutbox();
     }
+
+    // Deadbands or formats may have changed, report everything once
+    hasReported = false;
+    publishedSequence = 0;
+}
+
+void Mqtt::createOutbox()
+{
+    if (applied.outboxRam)
+    {
+        outbox.reset(new Outbox(applied.outboxRam, applied.outboxFlash,
+            applied.outboxNewestFirst ? Outbox::Policy::newestFirst : Outbox::Policy::oldestFirst));
+        if (outbox->getRamCapacity() == 0)
+        {
+            RNG_DEBUGLN(F("[MQTT] Outbox disabled, no heap"));
+            outbox.reset();
+        }
+    }
+}
+
+void Mqtt::scheduleReconnect()
+{
+    backoff = backoff ? std::min(backoff * 2, BACKOFF_MAX_MS) : BACKOFF_MIN_MS;
+    // Equal jitter, so a restarted broker is not hit by all bridges at once
+    const uint32_t wait = backoff / 2 + random(backoff / 2 + 1);
+    reconnectAt = millis() + wait;
+    state = State::waiting;
+    RNG_DEBUGF("[MQTT] Reconnecting in %u ms\n", wait);
 }
 
 void Mqtt::updateRenogyStatus(const Renogy::Data& data)
 {
     const uint32_t timeS = millis() / 1000;
-    if (timeS - lastUpdate >= mqttConfig.interval)
+    if (state == State::disabled)
+    {
+        return;
+    }
+    if (!mqtt.connected())
+    {
+        // Keep states for publishing them after reconnecting
+        if (outbox && timeS - lastUpdate >= mqttConfig.interval)
+        {
+            lastUpdate = timeS;
+            storeState(data);
+        }
+    }
+    else if (mqttConfig.rbe)
+    {
+        reportByException(data, timeS);
+    }
+    else if (timeS - lastUpdate >= mqttConfig.interval)
     {
         lastUpdate = timeS;
 
-        const String topic = mqttConfig.topic + "/state";
-        publishLarge(topic.c_str(), GUI::status.c_str(), true);
+        // State is retained, so there is no need to publish it again if it did not change
+        if (GUI::sequence != publishedSequence)
+        {
+            publishState();
+        }
 
         if (mqttConfig.split)
         {
-            publish((mqttConfig.topic + "/battery/charge").c_str(), String(data.batteryCharge).c_str(), false);
-            publish((mqttConfig.topic + "/battery/voltage").c_str(), String(data.batteryVoltage).c_str(), false);
-            publish((mqttConfig.topic + "/battery/current").c_str(), String(data.batteryCurrent).c_str(), false);
-            publish(
-                (mqttConfig.topic + "/battery/temperature").c_str(), String(data.batteryTemperature).c_str(), false);
-            publish((mqttConfig.topic + "/battery/consumption").c_str(), String(data.consumption).c_str(), false);
-            publish((mqttConfig.topic + "/battery/generation").c_str(), String(data.generation).c_str(), false);
-
-            publish((mqttConfig.topic + "/load/voltage").c_str(), String(data.loadVoltage).c_str(), false);
-            publish((mqttConfig.topic + "/load/current").c_str(), String(data.loadCurrent).c_str(), false);
-
-            publish((mqttConfig.topic + "/panel/voltage").c_str(), String(data.panelVoltage).c_str(), false);
-            publish((mqttConfig.topic + "/panel/current").c_str(), String(data.panelCurrent).c_str(), false);
-
-            publish((mqttConfig.topic + "/controller/state").c_str(), String(data.chargingState).c_str(), false);
-            publish((mqttConfig.topic + "/controller/error").c_str(), String(data.errorState).c_str(), false);
-            publish((mqttConfig.topic + "/controller/temperature").c_str(), String(data.controllerTemperature).c_str(),
-                false);
+            publishSplit(data);
         }
     }
+    // State and split values leave in as few segments as possible
+    mqtt.flush();
 }
 
-void Mqtt::setupLoadControl()
+void Mqtt::storeState(const Renogy::Data& data)
 {
-    subscribe(mqttConfig.topic + "/ol");
-    subscribe(mqttConfig.topic + "/o1");
-    subscribe(mqttConfig.topic + "/o2");
-    subscribe(mqttConfig.topic + "/o3");
+    if (!time.isSynced())
+    {
+        RNG_DEBUGLN(F("[MQTT] Time not synced, dropping state"));
+        return;
+    }
 
-    mqtt.setCallback([&](char* topic, uint8_t* data, unsigned int size) {
-        data[size] = '\0';
+    Outbox::Entry entry;
+    entry.timestamp = time.getUtcTime();
+    entry.data = data;
+    outbox->push(entry);
+}
 
-        const bool enable = strstr((char*)(data), "true") != nullptr;
-        if (strstr(topic, "ol"))
-        {
-            // Serial.println("Control load");
-            outputs.enableLoad(enable);
-        }
-        else if (strstr(topic, "o1"))
-        {
-            // Serial.println("Control out1");
-            outputs.enableOut1(enable);
-        }
-        else if (strstr(topic, "o2"))
-        {
-            // Serial.println("Control out2");
-            outputs.enableOut2(enable);
-        }
-        else if (strstr(topic, "o3"))
+void Mqtt::drainOutbox()
+{
+    if (!outbox || outbox->empty() || millis() - drainedAt < DRAIN_INTERVAL_MS)
+    {
+        return;
+    }
+    drainedAt = millis();
+
+    Outbox::Entry entry;
+    for (uint8_t i = 0; i < mqttConfig.outboxRate && outbox->peek(entry); ++i)
+    {
+        if (!publishHistory(entry))
         {
-            // Serial.println("Control out3");
-            outputs.enableOut3(enable);
+            break;
         }
-    });
+        outbox->pop();
+    }
+    outbox->flush();
 }
 
-void Mqtt::addDeviceInfo(JsonDocument& json, const String& deviceID)
+void Mqtt::publishState()
 {
-    auto dev = json["dev"];
-    dev["mf"] = "enwi";
-    dev["mdl"] = String(MODEL) + " " + HARDWARE_VERSION;
-    dev["name"] = deviceID;
-    dev["sw"] = SOFTWARE_VERSION;
-    dev["cu"] = String("http://") + WiFi.localIP().toString();
-
-    dev["ids"].to<JsonArray>().add(deviceID);
+    const bool published = mqttConfig.stateFormat == PayloadFormat::msgpack
+        ? mqtt.publish(topic(TOPIC_STATE), GUI::packedStatus, GUI::packedStatusLength, true, 1)
+        : publish(topic(TOPIC_STATE), GUI::status, true, 1);
+    if (published)
+    {
+        publishedSequence = GUI::sequence;
+    }
 }
 
-void Mqtt::publishSensorDiscovery(const String& name, const String& id, const String& valueTemplate, const String& icon)
+bool Mqtt::publishHistory(const Outbox::Entry& entry)
 {
-    JsonDocument autoConfig;
-
-    const String deviceID = getDeviceID();
-    addDeviceInfo(autoConfig, deviceID);
-
-    autoConfig["name"] = deviceID + " " + name;
-    autoConfig["uniq_id"] = deviceID + "_" + id;
-    autoConfig["~"] = mqttConfig.topic;
-    autoConfig["avty_t"] = "~/lwt";
-    autoConfig["pl_avail"] = CONNECTED;
-    autoConfig["pl_not_avail"] = DISCONNECTED;
-    autoConfig["stat_t"] = "~/state";
-    autoConfig["val_tpl"] = valueTemplate;
-    if (!icon.isEmpty())
+    const Renogy::Data& data = entry.data;
+    if (mqttConfig.historyFormat == PayloadFormat::msgpack)
     {
-        autoConfig["ic"] = icon;
+        JsonDocument json;
+        json["ts"] = entry.timestamp;
+        GUI::writeRenogyStatus(json, data);
+        uint8_t payload[256];
+        const size_t length = serializeMsgPack(json, payload, sizeof(payload));
+        return mqtt.publish(topic(TOPIC_HISTORY), payload, length, false, 1);
     }
 
-    const String topic = "homeassistant/sensor/" + deviceID + "/" + id + "/config";
-    publishJSON(topic, autoConfig, true);
+    char payload[320];
+    snprintf_P(payload, sizeof(payload),
+        PSTR("{\"ts\":%lu,\"b\":{\"ch\":%u,\"vo\":%.2f,\"cu\":%.2f,\"te\":%d,\"ge\":%d,\"co\":%d,\"to\":%ld},"
+             "\"l\":{\"vo\":%.2f,\"cu\":%.2f},\"p\":{\"vo\":%.2f,\"cu\":%.2f},"
+             "\"c\":{\"st\":%d,\"er\":%ld,\"te\":%d},\"o\":{\"l\":%s}}"),
+        static_cast<unsigned long>(entry.timestamp), data.batteryCharge, data.batteryVoltage, data.batteryCurrent,
+        data.batteryTemperature, data.generation, data.consumption, static_cast<long>(data.total), data.loadVoltage,
+        data.loadCurrent, data.panelVoltage, data.panelCurrent, data.chargingState,
+        static_cast<long>(data.errorState), data.controllerTemperature, data.loadEnabled ? "true" : "false");
+    return publish(topic(TOPIC_HISTORY), payload, false, 1);
 }
 
-void Mqtt::publishSensorDiscovery(const String& name, const String& id, const String& deviceClass, const String& unit,
-    const String& stateClass, const String& valueTemplate, const String& icon)
+void Mqtt::reportByException(const Renogy::Data& data, const uint32_t timeS)
 {
-    JsonDocument autoConfig;
+    const bool heartbeat = !hasReported || timeS - lastUpdate >= mqttConfig.heartbeat;
 
-    const String deviceID = getDeviceID();
-    addDeviceInfo(autoConfig, deviceID);
+    uint32_t changed = 0;
+    for (uint8_t i = 0; i < Renogy::FIELD_COUNT; ++i)
+    {
+        const double value = data.get(static_cast<Renogy::Field>(i));
+        const double delta = fabs(value - reported[i]);
+        if (heartbeat || (delta > 0.0 && delta >= mqttConfig.deadbands[i]))
+        {
+            reported[i] = value;
+            changed |= 1UL << i;
+        }
+    }
 
-    autoConfig["dev_cla"] = deviceClass;
-    autoConfig["unit_of_meas"] = unit;
-    autoConfig["stat_cla"] = stateClass;
+    if (mqttConfig.split && changed)
+    {
+        publishSplit(data, changed);
+    }
 
-    autoConfig["name"] = deviceID + " " + name;
-    autoConfig["uniq_id"] = deviceID + "_" + id;
-    autoConfig["~"] = mqttConfig.topic;
-    autoConfig["avty_t"] = "~/lwt";
-    autoConfig["pl_avail"] = CONNECTED;
-    autoConfig["pl_not_avail"] = DISCONNECTED;
-    autoConfig["stat_t"] = "~/state";
-    autoConfig["val_tpl"] = valueTemplate;
-    if (!icon.isEmpty())
+    if (heartbeat || (!mqttConfig.split && changed))
     {
-        autoConfig["ic"] = icon;
+        publishState();
     }
 
-    const String topic = "homeassistant/sensor/" + deviceID + "/" + id + "/config";
-    publishJSON(topic, autoConfig, true);
+    if (heartbeat)
+    {
+        lastUpdate = timeS;
+        hasReported = true;
+    }
 }
 
-void Mqtt::publishSwitchDiscovery(const String& name, const String& id, const String& valueTemplate, const String& icon)
+void Mqtt::buildTopics()
 {
-    JsonDocument autoConfig;
+    static_assert(sizeof(SPLIT_TOPICS) / sizeof(SPLIT_TOPICS[0]) == SPLIT_TOPIC_COUNT, "Split topics incomplete");
 
-    const String deviceID = getDeviceID();
-    addDeviceInfo(autoConfig, deviceID);
+    // Collect suffixes, which all live in flash
+    PGM_P suffixes[TOPIC_COUNT];
+    PGM_P base = BASE_SUFFIXES;
+    for (uint8_t i = 0; i < TOPIC_SPLIT; ++i)
+    {
+        suffixes[i] = base;
+        base += strlen_P(base) + 1;
+    }
+    for (uint8_t i = 0; i < SPLIT_TOPIC_COUNT; ++i)
+    {
+        suffixes[TOPIC_SPLIT + i] = SPLIT_TOPICS[i].suffix;
+    }
 
-    autoConfig["name"] = deviceID + " " + name;
-    autoConfig["uniq_id"] = deviceID + "_" + id;
-    autoConfig["~"] = mqttConfig.topic;
-    autoConfig["avty_t"] = "~/lwt";
-    autoConfig["pl_avail"] = CONNECTED;
-    autoConfig["pl_not_avail"] = DISCONNECTED;
-    autoConfig["stat_t"] = "~/state";
-    autoConfig["val_tpl"] = valueTemplate;
+    topicBaseLength = applied.topic.length();
+    const size_t baseLength = topicBaseLength;
+    size_t size = 0;
+    for (uint8_t i = 0; i < TOPIC_COUNT; ++i)
+    {
+        size += baseLength + strlen_P(suffixes[i]) + 1;
+    }
+
+    topics.reset(new char[size]);
+    char* cursor = topics.get();
+    for (uint8_t i = 0; i < TOPIC_COUNT; ++i)
+    {
+        topicOffsets[i] = cursor - topics.get();
+        memcpy(cursor, applied.topic.c_str(), baseLength);
+        cursor += baseLength;
+        strcpy_P(cursor, suffixes[i]);
+        cursor += strlen(cursor) + 1;
+    }
+}
+
+void Mqtt::publishSplit(const Renogy::Data& data, const uint32_t fields)
+{
+    char value[16];
+    for (uint8_t i = 0; i < SPLIT_TOPIC_COUNT; ++i)
+    {
+        const Renogy::Field field = static_cast<Renogy::Field>(pgm_read_byte(&SPLIT_TOPICS[i].field));
+        if (!(fields & (1UL << static_cast<uint8_t>(field))))
+        {
+            continue;
+        }
+        const uint8_t decimals = pgm_read_byte(&SPLIT_TOPICS[i].decimals);
+        snprintf_P(value, sizeof(value), PSTR("%.*f"), decimals, data.get(field));
+        publish(topic(TOPIC_SPLIT + i), value, false);
+    }
+}
 
-    autoConfig["cmd_t"] = "~/" + id;
-    autoConfig["payload_off"] = "false";
-    autoConfig["payload_on"] = "true";
-    if (!icon.isEmpty())
+void Mqtt::setupCommands()
+{
+    for (CommandSlot& slot : commandSlots)
+    {
+        slot.topic = NO_COMMAND;
+    }
+    for (uint8_t i = TOPIC_LOAD; i <= TOPIC_OUT3; ++i)
+    {
+        subscribeCommand(static_cast<Topic>(i));
+    }
+    for (uint8_t i = TOPIC_CMD_POLL; i <= TOPIC_CMD_OUT3; ++i)
+    {
+        subscribeCommand(static_cast<Topic>(i));
+    }
+    if (applied.hadiscovery)
     {
-        autoConfig["ic"] = icon;
+        subscribe(birthTopic.c_str());
     }
 
-    const String topic = "homeassistant/switch/" + deviceID + "/" + id + "/config";
-    publishJSON(topic, autoConfig, true);
+    mqtt.setCallback([&](char* topic, uint8_t* data, unsigned int size) {
+        if (applied.hadiscovery && birthTopic.equals(topic))
+        {
+            // Home Assistant (re)started, announce entities again from the loop
+            discoveryPending = size == 6 && memcmp(data, "online", 6) == 0;
+            discoveryNext = 0;
+            return;
+        }
+        handleCommand(topic, data, size);
+    });
 }
 
-void Mqtt::subscribe(const String& topic)
+void Mqtt::subscribeCommand(const Topic command)
 {
-    const bool subscribed = mqtt.subscribe(topic.c_str());
-    RNG_DEBUGF("Subscribed %s %s\n", topic.c_str(), subscribed ? "successfully" : "unsuccessfully");
+    const char* commandTopic = topic(command);
+    const uint32_t hash = hashTopic(commandTopic);
+    uint8_t index = hash & (COMMAND_SLOTS - 1);
+    while (commandSlots[index].topic != NO_COMMAND)
+    {
+        index = (index + 1) & (COMMAND_SLOTS - 1);
+    }
+    commandSlots[index] = {hash, command};
+    subscribe(commandTopic);
 }
 
-bool Mqtt::publishJSON(const String& topic, const JsonDocument& json, const bool retain)
+void Mqtt::handleCommand(const char* commandTopic, const uint8_t* data, const unsigned int size)
 {
-    const size_t size = measureJson(json);
-    if (mqtt.beginPublish(topic.c_str(), size, true))
+    // Find the command, the table is never full so probing ends at an empty slot
+    const uint32_t hash = hashTopic(commandTopic);
+    uint8_t index = hash & (COMMAND_SLOTS - 1);
+    while (commandSlots[index].topic != NO_COMMAND
+        && (commandSlots[index].hash != hash || strcmp(topic(commandSlots[index].topic), commandTopic) != 0))
+    {
+        index = (index + 1) & (COMMAND_SLOTS - 1);
+    }
+    const uint8_t command = commandSlots[index].topic;
+    if (command == NO_COMMAND)
+    {
+        return;
+    }
+
+    // Payload is not null terminated and must not be written past its size
+    char payload[MAX_COMMAND_PAYLOAD + 1];
+    if (size > MAX_COMMAND_PAYLOAD)
     {
-        serializeJson(json, mqtt);
-        return mqtt.endPublish();
+        acknowledge(command, false, PSTR("payload too long"));
+        return;
     }
-    return false;
+    memcpy(payload, data, size);
+    payload[size] = '\0';
+
+    switch (command)
+    {
+    case TOPIC_LOAD:
+    case TOPIC_OUT1:
+    case TOPIC_OUT2:
+    case TOPIC_OUT3:
+    {
+        const Output output = static_cast<Output>(command - TOPIC_LOAD);
+        if (*payload >= '0' && *payload <= '9')
+        {
+            // Duty cycle in percent
+            char* end;
+            const unsigned long duty = strtoul(payload, &end, 10);
+            if (*end != '\0' || duty > 100)
+            {
+                acknowledge(command, false, PSTR("expected 0-100 percent"));
+                return;
+            }
+            outputs.setDuty(output, duty);
+            break;
+        }
+        const bool enable = strcmp_P(payload, PSTR("true")) == 0;
+        if (!enable && strcmp_P(payload, PSTR("false")) != 0)
+        {
+            acknowledge(command, false, PSTR("expected true, false or 0-100 percent"));
+            return;
+        }
+        outputs.enable(output, enable);
+        break;
+    }
+    case TOPIC_CMD_POLL:
+        // Polling publishes the new state, which is not possible from within the callback
+        pollPending = true;
+        break;
+    case TOPIC_CMD_INTERVAL:
+    {
+        char* end;
+        const unsigned long interval = strtoul(payload, &end, 10);
+        if (end == payload || *end != '\0' || interval == 0 || interval > UINT8_MAX)
+        {
+            acknowledge(command, false, PSTR("expected 1-255 seconds"));
+            return;
+        }
+        if (mqttConfig.interval != interval)
+        {
+            mqttConfig.interval = interval;
+            config.saveConfig();
+        }
+        break;
+    }
+    case TOPIC_CMD_LOAD:
+    case TOPIC_CMD_OUT1:
+    case TOPIC_CMD_OUT2:
+    case TOPIC_CMD_OUT3:
+    {
+        JsonDocument json;
+        if (deserializeJson(json, payload, size) || !json.is<JsonObject>())
+        {
+            acknowledge(command, false, PSTR("invalid JSON object"));
+            return;
+        }
+        // tryUpdate keeps the current value of an invalid field, reject the command instead of reporting success
+        OutputConfig& outputConfig = config.getDeviceConfig().outputs[command - TOPIC_CMD_LOAD];
+        String error;
+        if (!outputConfig.checkUpdate(json.as<JsonObjectConst>(), error))
+        {
+            acknowledge(command, false, error.c_str());
+            return;
+        }
+        if (outputConfig.tryUpdate(json.as<JsonObjectConst>()))
+        {
+            config.saveConfig();
+            config.notifyChanged(Config::Section::dev);
+        }
+        break;
+    }
+    default:
+        return;
+    }
+    acknowledge(command, true, PSTR("ok"));
 }
 
-bool Mqtt::publish(const String& payload, bool retain)
+void Mqtt::acknowledge(const uint8_t command, const bool success, PGM_P message)
 {
-    return mqtt.publish(
-        mqttConfig.topic.c_str(), reinterpret_cast<const uint8_t*>(payload.c_str()), payload.length(), retain);
+    // Name commands by their topic relative to the base topic
+    char payload[128];
+    snprintf_P(payload, sizeof(payload), PSTR("{\"cmd\":\"%s\",\"ok\":%s,\"msg\":\"%S\"}"),
+        topic(command) + topicBaseLength + 1, success ? "true" : "false", message);
+    publish(topic(TOPIC_RESPONSE), payload);
 }
 
-bool Mqtt::publish(const char* payload, bool retain)
+bool Mqtt::publishDiscovery()
 {
-    return publish(mqttConfig.topic.c_str(), payload, retain);
+    char deviceID[24];
+    snprintf_P(deviceID, sizeof(deviceID), PSTR("rngbridge-%s"), deviceMAC);
+    char url[24];
+    snprintf_P(url, sizeof(url), PSTR("http://%s"), WiFi.localIP().toString().c_str());
+
+    constexpr const uint8_t count = sizeof(DISCOVERIES) / sizeof(DISCOVERIES[0]);
+    char configTopic[128];
+    Discovery entry;
+    for (; discoveryNext < count; ++discoveryNext)
+    {
+        memcpy_P(&entry, &DISCOVERIES[discoveryNext], sizeof(entry));
+        const size_t length = snprintf_P(configTopic, sizeof(configTopic), PSTR("%s/%s/%s/%s/config"),
+            applied.haDiscoveryTopic.c_str(), entry.component, deviceID, entry.id);
+        if (length >= sizeof(configTopic))
+        {
+            RNG_DEBUGLN(F("[MQTT] Discovery topic too long"));
+            discoveryNext = 0;
+            return true;
+        }
+
+        // Measure first, then stream the payload without building it in memory
+        CountingPrint counter;
+        writeDiscovery(counter, entry, deviceID, applied.topic.c_str(), url);
+        if (!mqtt.publish(configTopic, counter.count, true, 1,
+                [&](Print& out) { writeDiscovery(out, entry, deviceID, applied.topic.c_str(), url); }))
+        {
+            // Client is busy, continue with this entity next time
+            return false;
+        }
+    }
+    discoveryNext = 0;
+    return true;
 }
 
-bool Mqtt::publish(const char* topic, const char* payload, bool retain)
+void Mqtt::subscribe(const char* topic)
 {
-    return mqtt.publish(topic, reinterpret_cast<const uint8_t*>(payload), strlen(payload), retain);
+    const bool subscribed = mqtt.subscribe(topic);
+    RNG_DEBUGF("Subscribed %s %s\n", topic, subscribed ? "successfully" : "unsuccessfully");
 }
@@ -1,12 +1,14 @@
 #pragma once
 
 #include <functional>
-
-#include <PubSubClient.h>
+#include <memory>
 
 #include "Config.h"
+#include "MqttClient.h"
 #include "Observerable.h"
+#include "Outbox.h"
 #include "OutputControl.h"
+#include "RNGTime.h"
 #include "Renogy.h"
 
 // Quality Of Service (QOS)
@@ -17,96 +19,229 @@
 class Mqtt : public Observerable<String>
 {
 public:
-    Mqtt(const MqttConfig& mqttConfig, OutputControl& outputs)
-        : mqttConfig(mqttConfig), outputs(outputs), mqtt(espClient)
+    typedef std::function<void()> PollHandler;
+
+public:
+    Mqtt(Config& config, OutputControl& outputs, RNGTime& time)
+        : config(config), mqttConfig(config.getMqttConfig()), applied(mqttConfig), outputs(outputs), time(time)
     {
         notify("Enabled");
-        // mqtt.setBufferSize(512);
-        mqtt.setServer(mqttConfig.server.c_str(), mqttConfig.port);
+        // The applied copy keeps the host valid while the config is edited
+        mqtt.setServer(applied.server.c_str(), applied.port);
+        birthTopic = applied.haDiscoveryTopic + "/status";
+        // Jitter the first attempt as well, e.g. when a whole site powers up at once
+        reconnectAt = millis() + random(BACKOFF_MIN_MS);
+        createOutbox();
     }
 
     Mqtt(Mqtt&&) = delete;
 
-    void connect();
+    /// @brief Start connecting to the broker, @ref loop handles the result
+    ///
+    /// @return true if connecting was started
+    bool connect();
 
     void disconnect();
 
+    /// @brief Handle incoming messages, reconnect with backoff and publish stored states
+    ///
+    /// Should be called once every second
     void loop();
 
     void updateRenogyStatus(const Renogy::Data& data);
 
+    /// @brief Apply a changed mqtt config without restarting
+    ///
+    /// Reconnects only if the broker, credentials or topics changed and publishes discovery again only if it depends
+    /// on a changed value. A disabled client disconnects and stays idle until enabled again.
+    void reconfigure();
+
+    /// @brief Set a handler for reading the controller immediately, requested with the poll command
+    ///
+    /// @param handler PollHandler, called from @ref loop
+    void setPollHandler(PollHandler handler) { pollHandler = handler; }
+
 private:
-    const String getDeviceID() { return String("rngbridge-") + deviceMAC; }
-    /// @brief Setup load control via MQTT
+    /// @brief Topics derived from the configured base topic, see @ref buildTopics
+    enum Topic : uint8_t
+    {
+        TOPIC_LWT, /// Last will and availability
+        TOPIC_STATE, /// Complete status as JSON
+        TOPIC_LOAD, /// Load output control
+        TOPIC_OUT1, /// Output 1 control
+        TOPIC_OUT2, /// Output 2 control
+        TOPIC_OUT3, /// Output 3 control
+        TOPIC_HISTORY, /// Timestamped states stored while disconnected
+        TOPIC_RESPONSE, /// Acknowledgements of commands
+        TOPIC_CMD_POLL, /// Read the controller immediately
+        TOPIC_CMD_INTERVAL, /// Set the publish interval in seconds
+        TOPIC_CMD_LOAD, /// Update the load output config with a JSON object
+        TOPIC_CMD_OUT1, /// Update the output 1 config with a JSON object
+        TOPIC_CMD_OUT2, /// Update the output 2 config with a JSON object
+        TOPIC_CMD_OUT3, /// Update the output 3 config with a JSON object
+        TOPIC_SPLIT, /// First of the split value topics
+    };
+    static_assert(TOPIC_OUT3 - TOPIC_LOAD + 1 == DeviceConfig::OUTPUT_COUNT, "One control topic per output");
+    static_assert(TOPIC_CMD_OUT3 - TOPIC_CMD_LOAD + 1 == DeviceConfig::OUTPUT_COUNT, "One config topic per output");
+    constexpr static const uint8_t SPLIT_TOPIC_COUNT = 13; /// Number of values published when splitting
+    constexpr static const uint8_t TOPIC_COUNT = TOPIC_SPLIT + SPLIT_TOPIC_COUNT;
+
+    /// @brief Slot of the command hash table
+    struct CommandSlot
+    {
+        uint32_t hash; /// FNV-1a hash of the command topic
+        uint8_t topic; /// Command topic, NO_COMMAND if the slot is empty
+    };
+    constexpr static const uint8_t COMMAND_SLOTS = 16; /// Power of two, at least twice the number of commands
+    constexpr static const uint8_t NO_COMMAND = UINT8_MAX; /// Marks an empty command slot
+    constexpr static const uint8_t MAX_COMMAND_PAYLOAD = 127; /// Longer command payloads are rejected
+
+    /// @brief Connection state, see @ref loop
+    enum class State : uint8_t
+    {
+        waiting, /// Waiting for the backoff to elapse before connecting
+        connecting, /// Non-blocking connect to the broker is in progress
+        connected, /// Connected to the broker
+        disabled, /// Disabled by the config
+    };
+
+    constexpr static const uint32_t BACKOFF_MIN_MS = 1000; /// Backoff after the first failed attempt
+    constexpr static const uint32_t BACKOFF_MAX_MS = 300000; /// Upper limit of the backoff
+    constexpr static const uint32_t STATS_LOG_INTERVAL_MS = 60000; /// Interval of logging transmit counters
+    constexpr static const uint32_t DRAIN_INTERVAL_MS = 1000; /// Interval of publishing stored states
+
+private:
+    /// @brief Publish the online message and subscribe to commands once the broker accepted the connection
+    void onConnected();
+
+    /// @brief Schedule the next connect attempt with exponential backoff and jitter
+    void scheduleReconnect();
+
+    /// @brief Create the outbox according to the config, null if disabled
+    void createOutbox();
+
+    /// @brief Build all topics into a single allocation
     ///
-    /// Will subscribe control topics for each output and then register a callback for handling received messages
-    void setupLoadControl();
+    /// Called on every connect, so the publish path only looks up prebuilt strings. Uses the applied base topic, an
+    /// edited config only takes effect with @ref reconfigure.
+    void buildTopics();
 
-    /// @brief Add the device info object to the given json object
+    /// @brief Get a prebuilt topic
     ///
-    /// @param json JSON object
-    /// @param deviceID Device identifier
-    void addDeviceInfo(JsonDocument& json, const String& deviceID);
+    /// @param index Topic index, @ref Topic or `TOPIC_SPLIT + n` for the n-th split value
+    /// @return Null terminated topic
+    const char* topic(const uint8_t index) const { return topics.get() + topicOffsets[index]; }
 
-    /// @brief Publish homeassistant sensor discorvery message
+    /// @brief Publish values to their own topics
     ///
-    /// @param name Sensor name
-    /// @param id Unique sensor identifier
-    /// @param valueTemplate Template for sensor value
-    /// @param icon Optional sensor icon
-    void publishSensorDiscovery(
-        const String& name, const String& id, const String& valueTemplate, const String& icon = "");
+    /// @param data Renogy data to publish
+    /// @param fields Bit mask of @ref Renogy::Field values to publish, defaults to all
+    void publishSplit(const Renogy::Data& data, const uint32_t fields = UINT32_MAX);
 
-    /// @brief Publish homeassistant extended sensor discorvery message
+    /// @brief Store the data with the current time in the outbox, if the time is known
     ///
-    /// @param name Sensor name
-    /// @param id Unique sensor identifier
-    /// @param deviceClass Sensor device class
-    /// @param unit Sensor unit (e.g. `°C`, `%`, `W`, etc.)
-    /// @param stateClass Sensor state class
-    /// @param valueTemplate Template for sensor value
-    /// @param icon Optional sensor icon
-    void publishSensorDiscovery(const String& name, const String& id, const String& deviceClass, const String& unit,
-        const String& stateClass, const String& valueTemplate, const String& icon = "");
+    /// @param data Renogy data to store
+    void storeState(const Renogy::Data& data);
 
-    /// @brief Publish homeassistant switch discorvery message
+    /// @brief Publish the status to the state topic in the configured format
+    void publishState();
+
+    /// @brief Publish stored states to the history topic, limited to the configured rate
+    ///
+    /// The MQTT task runs several times per second, so at most MqttConfig::outboxRate states are published once per
+    /// DRAIN_INTERVAL_MS.
+    void drainOutbox();
+
+    /// @brief Publish a stored state to the history topic
+    ///
+    /// @param entry Stored state
+    /// @return true if published
+    bool publishHistory(const Outbox::Entry& entry);
+
+    /// @brief Publish only values which changed by at least their deadband and the full state as heartbeat
+    ///
+    /// Split topics are published as soon as their value changes. The state topic is published at the heartbeat
+    /// interval, or on every change if splitting is disabled.
+    ///
+    /// @param data Renogy data to report
+    /// @param timeS Current uptime in seconds
+    void reportByException(const Renogy::Data& data, const uint32_t timeS);
+
+    /// @brief Subscribe to all command topics and register a callback dispatching received messages
+    void setupCommands();
+
+    /// @brief Subscribe to a command topic and add it to the command hash table
     ///
-    /// @param name Switch name
-    /// @param id Unique switch identifier
-    /// @param valueTemplate Template for switch state
-    /// @param icon Optional switch icon
-    void publishSwitchDiscovery(
-        const String& name, const String& id, const String& valueTemplate, const String& icon = "");
+    /// @param command Command topic
+    void subscribeCommand(const Topic command);
+
+    /// @brief Execute the command of a received message and acknowledge it on the response topic
+    ///
+    /// Topics are matched exactly using the hash table, unknown topics are ignored
+    ///
+    /// @param commandTopic Topic the message was received on
+    /// @param data Payload, not null terminated
+    /// @param size Size of the payload
+    void handleCommand(const char* commandTopic, const uint8_t* data, const unsigned int size);
+
+    /// @brief Publish the result of a command to the response topic
+    ///
+    /// @param command Command topic
+    /// @param success Was the command executed
+    /// @param message Message describing the result, in flash or RAM as %S reads both on the ESP8266
+    void acknowledge(const uint8_t command, const bool success, PGM_P message);
+
+    /// @brief Publish homeassistant discovery messages of all entities
+    ///
+    /// Payloads are streamed from a table in flash without building a JSON document. Publishes as many messages as
+    /// the client accepts and continues with the next one on the following call.
+    ///
+    /// @return true if all messages were published
+    bool publishDiscovery();
 
     /// @brief Subscribe to a given topic
     ///
     /// @param topic Topic to subscribe to
-    void subscribe(const String& topic);
-    /// @brief Publish the given JSON document to the topic
+    void subscribe(const char* topic);
+
+    /// @brief Publish a null terminated payload
     ///
     /// @param topic Topic to publish to
-    /// @param json JSON document to publish
-    /// @param retain OPtionally reatin the message (true) or not (false)
-    /// @return true if the JSON document was published
-    /// @return false if not
-    bool publishJSON(const String& topic, const JsonDocument& json, const bool retain = false);
-    bool publish(const String& payload, bool retain = false);
-    bool publish(const char* payload, bool retain = false);
-    bool publish(const char* topic, const char* payload, bool retain = false);
-    bool publishLarge(const char* topic, const char* payload, bool retain = false)
+    /// @param payload Payload
+    /// @param retain Should the message be retained
+    /// @param qos 0 or 1
+    /// @return true if the message was queued
+    bool publish(const char* topic, const char* payload, const bool retain = false, const uint8_t qos = 0)
     {
-        if (mqtt.beginPublish(topic, strlen(payload), retain))
-        {
-            mqtt.write(reinterpret_cast<const uint8_t*>(payload), strlen(payload));
-            return mqtt.endPublish();
-        }
-        return false;
+        return mqtt.publish(topic, payload, retain, qos);
     }
 
 private:
-    const MqttConfig& mqttConfig;
+    Config& config; /// Config, saved when changed by commands
+    MqttConfig& mqttConfig;
+    MqttConfig applied; /// Copy of the config the client was set up with, see @ref reconfigure
     OutputControl& outputs;
-    WiFiClient espClient;
-    PubSubClient mqtt;
+    RNGTime& time; /// Time source for stored states
+    MqttClient mqtt;
     uint32_t lastUpdate = 0; /// last time in seconds we updated
+    State state = State::waiting; /// Connection state
+    uint32_t reconnectAt = 0; /// Time in ms of the next connect attempt
+    uint32_t backoff = 0; /// Current backoff in ms, 0 after a successful connect
+    bool hasReported = false; /// Were values reported since connecting, see @ref reportByException
+    uint32_t publishedSequence = 0; /// GUI::sequence of the last published state
+    double reported[Renogy::FIELD_COUNT] = {}; /// Last reported value of each field
+    std::unique_ptr<Outbox> outbox; /// States which could not be published, null if disabled
+    uint32_t drainedAt = 0; /// Time in ms stored states were last published, see @ref drainOutbox
+    String birthTopic; /// Topic Home Assistant announces its (re)start on
+    bool discoveryPending = true; /// Discovery messages should be published, after boot or Home Assistant restart
+    uint8_t discoveryNext = 0; /// Next discovery message to publish, see @ref publishDiscovery
+#ifdef RNG_DEBUG_SERIAL
+    uint32_t statsLoggedAt = 0; /// Time in ms the transmit counters were last logged
+#endif
+    std::unique_ptr<char[]> topics; /// Arena containing all null terminated topics
+    uint16_t topicOffsets[TOPIC_COUNT] = {}; /// Offset of each topic inside @ref topics
+    size_t topicBaseLength = 0; /// Length of the base topic the topics were built from
+    CommandSlot commandSlots[COMMAND_SLOTS] = {}; /// Command hash table with linear probing, see @ref setupCommands
+    PollHandler pollHandler; /// Reads the controller, see @ref setPollHandler
+    bool pollPending = false; /// Poll command was received and is executed in @ref loop
 }; // class MQTT
@@ -0,0 +1,617 @@
+#include "MqttClient.h"
+
+#include <new>
+
+#include "Constants.h"
+
+namespace
+{
+    /// Control packet types, already shifted into the upper nibble of the fixed header
+    constexpr const uint8_t CONNECT = 0x10;
+    constexpr const uint8_t CONNACK = 0x20;
+    constexpr const uint8_t PUBLISH = 0x30;
+    constexpr const uint8_t PUBACK = 0x40;
+    constexpr const uint8_t SUBSCRIBE = 0x82; /// Includes the reserved flags
+    constexpr const uint8_t SUBACK = 0x90;
+    constexpr const uint8_t PINGREQ = 0xC0;
+    constexpr const uint8_t PINGRESP = 0xD0;
+    constexpr const uint8_t DISCONNECT = 0xE0;
+
+    constexpr const uint8_t PUBLISH_DUP = 0x08; /// Flag of retransmitted PUBLISH packets
+
+    /// @brief Result of decoding a fixed header
+    enum class Header : uint8_t
+    {
+        complete,
+        incomplete,
+        malformed,
+    };
+
+    /// @brief Decode the fixed header of a packet
+    ///
+    /// @param data Start of the packet
+    /// @param available Number of available bytes
+    /// @param headerLength Length of the fixed header
+    /// @param remaining Remaining length of the packet
+    /// @return Header::complete if headerLength and remaining were set
+    Header decodeHeader(const uint8_t* data, const size_t available, size_t& headerLength, size_t& remaining)
+    {
+        remaining = 0;
+        for (uint8_t i = 1; i <= 4; ++i)
+        {
+            if (i >= available)
+            {
+                return Header::incomplete;
+            }
+            remaining |= static_cast<size_t>(data[i] & 0x7F) << (7 * (i - 1));
+            if (!(data[i] & 0x80))
+            {
+                headerLength = i + 1;
+                return Header::complete;
+            }
+        }
+        return Header::malformed;
+    }
+
+    /// @brief Get the length of the fixed header for the given remaining length
+    size_t headerSize(const size_t remaining)
+    {
+        return remaining < 128 ? 2 : remaining < 16384 ? 3 : remaining < 2097152 ? 4 : 5;
+    }
+} // namespace
+
+MqttClient::MqttClient() : txBuffer(new uint8_t[TX_BUFFER_SIZE]), rxBuffer(new uint8_t[RX_BUFFER_SIZE])
+{
+    tcp.onConnect([this](void*, AsyncClient*) {
+        // Coalescing is done here, so don't let Nagle delay the last segment of a cycle
+        tcp.setNoDelay(true);
+        flush();
+    });
+    tcp.onAck([this](void*, AsyncClient*, size_t, uint32_t) { transmit(flushPending); });
+    tcp.onData([this](void*, AsyncClient*, void* data, size_t length) {
+        receive(static_cast<const uint8_t*>(data), length);
+    });
+    tcp.onError([](void*, AsyncClient*, int8_t error) {
+        RNG_DEBUGF("[MqttClient] TCP error %s\n", AsyncClient::errorToString(error));
+    });
+    tcp.onDisconnect([this](void*, AsyncClient*) { state = State::disconnected; });
+}
+
+void MqttClient::setServer(const char* host, const uint16_t port)
+{
+    this->host = host;
+    this->port = port;
+}
+
+bool MqttClient::connect(const char* id, const char* user, const char* password, const char* willTopic,
+    const uint8_t willQos, const bool willRetain, const char* willMessage)
+{
+    if (state != State::disconnected || !host)
+    {
+        return false;
+    }
+
+    // Start from empty buffers, a clean session discards everything but unacknowledged messages
+    txHead = 0;
+    txCount = 0;
+    flushPending = false;
+    rxLength = 0;
+    rxComplete = 0;
+    rxDiscard = 0;
+    rxFailed = false;
+    pingSentAt = 0;
+
+    const bool hasWill = willTopic && *willTopic;
+    const bool hasUser = user && *user;
+    const bool hasPassword = password && *password;
+
+    size_t remaining = 10 + 2 + strlen(id);
+    if (hasWill)
+    {
+        remaining += 2 + strlen(willTopic) + 2 + strlen(willMessage);
+    }
+    if (hasUser)
+    {
+        remaining += 2 + strlen(user);
+    }
+    if (hasPassword)
+    {
+        remaining += 2 + strlen(password);
+    }
+    if (!beginPacket(CONNECT, remaining))
+    {
+        return false;
+    }
+
+    const uint8_t protocol[] = {0, 4, 'M', 'Q', 'T', 'T', 4};
+    put(protocol, sizeof(protocol));
+    uint8_t flags = 0x02; // Clean session
+    if (hasWill)
+    {
+        flags |= 0x04 | (willQos & 0x03) << 3 | (willRetain ? 0x20 : 0);
+    }
+    if (hasUser)
+    {
+        flags |= 0x80;
+    }
+    if (hasPassword)
+    {
+        flags |= 0x40;
+    }
+    put(flags);
+    putWord(keepAlive);
+    putString(id);
+    if (hasWill)
+    {
+        putString(willTopic);
+        putString(willMessage);
+    }
+    if (hasUser)
+    {
+        putString(user);
+    }
+    if (hasPassword)
+    {
+        putString(password);
+    }
+
+    // CONNECT is sent as soon as the TCP connection is established
+    state = State::connecting;
+    stateSince = millis();
+    if (!tcp.connect(host, port))
+    {
+        state = State::disconnected;
+        return false;
+    }
+    return true;
+}
+
+void MqttClient::disconnect()
+{
+    if (state == State::connected && beginPacket(DISCONNECT, 0))
+    {
+        flush();
+    }
+    tcp.close();
+    state = State::disconnected;
+}
+
+void MqttClient::loop()
+{
+    if (state == State::disconnected)
+    {
+        return;
+    }
+    if (rxFailed)
+    {
+        RNG_DEBUGLN(F("[MqttClient] Received data lost or malformed"));
+        reset();
+        return;
+    }
+
+    // Handle complete packets, handlers may queue packets but data is only received outside of the loop
+    size_t offset = 0;
+    while (offset < rxComplete && state != State::disconnected)
+    {
+        size_t headerLength;
+        size_t remaining;
+        decodeHeader(rxBuffer.get() + offset, rxComplete - offset, headerLength, remaining);
+        handlePacket(rxBuffer.get() + offset, headerLength, headerLength + remaining);
+        offset += headerLength + remaining;
+    }
+    if (state == State::disconnected)
+    {
+        return;
+    }
+    memmove(rxBuffer.get(), rxBuffer.get() + offset, rxLength - offset);
+    rxLength -= offset;
+    rxComplete -= offset;
+
+    const uint32_t now = millis();
+    if (state == State::connecting)
+    {
+        if (now - stateSince >= CONNECT_TIMEOUT_MS)
+        {
+            RNG_DEBUGLN(F("[MqttClient] Connect timed out"));
+            reset();
+        }
+        return;
+    }
+
+    if (keepAlive)
+    {
+        const uint32_t interval = keepAlive * 1000UL;
+        if (pingSentAt && now - pingSentAt >= interval)
+        {
+            RNG_DEBUGLN(F("[MqttClient] Broker did not answer ping"));
+            reset();
+            return;
+        }
+        if (!pingSentAt && now - lastOutbound >= interval && beginPacket(PINGREQ, 0))
+        {
+            pingSentAt = now | 1;
+        }
+    }
+    retransmit(false);
+    flush();
+}
+
+bool MqttClient::publish(
+    const char* topic, const uint8_t* payload, const size_t length, const bool retain, const uint8_t qos)
+{
+    InFlight* slot;
+    if (!beginPublish(topic, length, retain, qos, slot))
+    {
+        return false;
+    }
+    put(payload, length);
+    endPublish();
+    return true;
+}
+
+bool MqttClient::publish(
+    const char* topic, const size_t length, const bool retain, const uint8_t qos, const PayloadWriter& writer)
+{
+    InFlight* slot;
+    if (!beginPublish(topic, length, retain, qos, slot))
+    {
+        return false;
+    }
+    PayloadPrint out(*this, length);
+    writer(out);
+    // Keep the stream in sync even if the writer broke its promise
+    for (; out.remaining; --out.remaining)
+    {
+        put(' ');
+    }
+    endPublish();
+    return true;
+}
+
+bool MqttClient::subscribe(const char* topic)
+{
+    if (state != State::connected || !beginPacket(SUBSCRIBE, 2 + 2 + strlen(topic) + 1))
+    {
+        return false;
+    }
+    putWord(nextId());
+    putString(topic);
+    put(0); // QoS 0
+    return true;
+}
+
+uint8_t MqttClient::inFlight() const
+{
+    uint8_t count = 0;
+    for (const InFlight& message : inFlightMessages)
+    {
+        count += message.packet ? 1 : 0;
+    }
+    return count;
+}
+
+size_t MqttClient::PayloadPrint::write(const uint8_t* buffer, size_t size)
+{
+    size = std::min(size, remaining);
+    client.put(buffer, size);
+    remaining -= size;
+    return size;
+}
+
+void MqttClient::receive(const uint8_t* data, size_t length)
+{
+    while (length)
+    {
+        if (rxDiscard)
+        {
+            const size_t skip = std::min(rxDiscard, length);
+            rxDiscard -= skip;
+            data += skip;
+            length -= skip;
+            continue;
+        }
+
+        const size_t chunk = std::min(length, RX_BUFFER_SIZE - rxLength);
+        if (!chunk)
+        {
+            // Buffer is full of packets the loop did not handle yet
+            rxFailed = true;
+            return;
+        }
+        memcpy(rxBuffer.get() + rxLength, data, chunk);
+        rxLength += chunk;
+        data += chunk;
+        length -= chunk;
+
+        // Advance over complete packets
+        while (rxComplete < rxLength)
+        {
+            size_t headerLength;
+            size_t remaining;
+            const Header header
+                = decodeHeader(rxBuffer.get() + rxComplete, rxLength - rxComplete, headerLength, remaining);
+            if (header == Header::malformed)
+            {
+                rxFailed = true;
+                return;
+            }
+            if (header == Header::incomplete)
+            {
+                break;
+            }
+            const size_t total = headerLength + remaining;
+            if (total > RX_BUFFER_SIZE)
+            {
+                // Can never be buffered, drop the part received so far and skip the rest
+                rxDiscard = total - (rxLength - rxComplete);
+                rxLength = rxComplete;
+                RNG_DEBUGF("[MqttClient] Dropping packet of %u bytes\n", total);
+                break;
+            }
+            if (rxLength - rxComplete < total)
+            {
+                break;
+            }
+            rxComplete += total;
+        }
+    }
+}
+
+void MqttClient::handlePacket(uint8_t* packet, const size_t headerLength, const size_t length)
+{
+    uint8_t* const body = packet + headerLength;
+    const size_t bodyLength = length - headerLength;
+
+    switch (packet[0] & 0xF0)
+    {
+    case CONNACK:
+        if (state != State::connecting || bodyLength < 2)
+        {
+            break;
+        }
+        if (body[1] != 0)
+        {
+            RNG_DEBUGF("[MqttClient] Connection refused with code %u\n", body[1]);
+            reset();
+            break;
+        }
+        state = State::connected;
+        stateSince = millis();
+        // Clean session, so the broker lost all unacknowledged messages
+        retransmit(true);
+        break;
+    case PUBLISH:
+    {
+        const uint8_t qos = (packet[0] >> 1) & 0x03;
+        if (bodyLength < 2)
+        {
+            break;
+        }
+        const size_t topicLength = body[0] << 8 | body[1];
+        const size_t payloadStart = 2 + topicLength + (qos ? 2 : 0);
+        if (payloadStart > bodyLength)
+        {
+            break;
+        }
+        if (qos == 1 && beginPacket(PUBACK, 2))
+        {
+            put(body + 2 + topicLength, 2);
+        }
+        // Move the topic over its length to null terminate it in place
+        memmove(body, body + 2, topicLength);
+        body[topicLength] = '\0';
+        if (messageHandler)
+        {
+            messageHandler(reinterpret_cast<char*>(body), body + payloadStart, bodyLength - payloadStart);
+        }
+        break;
+    }
+    case PUBACK:
+    {
+        if (bodyLength < 2)
+        {
+            break;
+        }
+        const uint16_t id = body[0] << 8 | body[1];
+        for (InFlight& message : inFlightMessages)
+        {
+            if (message.packet && message.packetId == id)
+            {
+                message.packet.reset();
+                break;
+            }
+        }
+        break;
+    }
+    case PINGRESP:
+        pingSentAt = 0;
+        break;
+    case SUBACK:
+    default:
+        break;
+    }
+}
+
+bool MqttClient::beginPacket(const uint8_t type, const size_t remaining)
+{
+    if (TX_BUFFER_SIZE - txCount < headerSize(remaining) + remaining)
+    {
+        return false;
+    }
+    put(type);
+    size_t value = remaining;
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value)
+        {
+            byte |= 0x80;
+        }
+        put(byte);
+    } while (value);
+    lastOutbound = millis();
+    return true;
+}
+
+void MqttClient::put(const uint8_t* data, const size_t length)
+{
+    if (capture)
+    {
+        memcpy(capture, data, length);
+        capture += length;
+    }
+    // Write in at most two parts, wrapping around at the end of the ring
+    const size_t tail = (txHead + txCount) % TX_BUFFER_SIZE;
+    const size_t first = std::min(length, TX_BUFFER_SIZE - tail);
+    memcpy(txBuffer.get() + tail, data, first);
+    memcpy(txBuffer.get(), data + first, length - first);
+    txCount += length;
+}
+
+void MqttClient::putWord(const uint16_t word)
+{
+    put(word >> 8);
+    put(word & 0xFF);
+}
+
+void MqttClient::putString(const char* str)
+{
+    const size_t length = strlen(str);
+    putWord(length);
+    put(reinterpret_cast<const uint8_t*>(str), length);
+}
+
+bool MqttClient::beginPublish(
+    const char* topic, const size_t length, const bool retain, const uint8_t qos, InFlight*& slot)
+{
+    slot = nullptr;
+    if (state != State::connected)
+    {
+        return false;
+    }
+
+    const size_t remaining = 2 + strlen(topic) + (qos ? 2 : 0) + length;
+    const size_t total = headerSize(remaining) + remaining;
+    if (TX_BUFFER_SIZE - txCount < total)
+    {
+        return false;
+    }
+    if (qos)
+    {
+        for (InFlight& message : inFlightMessages)
+        {
+            if (!message.packet)
+            {
+                slot = &message;
+                break;
+            }
+        }
+        if (!slot)
+        {
+            return false;
+        }
+        // Keep a copy of the whole packet for retransmissions
+        slot->packet.reset(new (std::nothrow) uint8_t[total]);
+        if (!slot->packet)
+        {
+            return false;
+        }
+        slot->length = total;
+        slot->packetId = nextId();
+        slot->sentAt = millis();
+        capture = slot->packet.get();
+    }
+
+    beginPacket(PUBLISH | (qos ? 0x02 : 0) | (retain ? 0x01 : 0), remaining);
+    putString(topic);
+    if (slot)
+    {
+        putWord(slot->packetId);
+    }
+    return true;
+}
+
+void MqttClient::endPublish()
+{
+    capture = nullptr;
+    ++stats.publishes;
+    // Only full segments are sent right away, the rest waits for the flush at the end of the cycle
+    transmit(flushPending);
+}
+
+void MqttClient::flush()
+{
+    flushPending = true;
+    transmit(true);
+}
+
+void MqttClient::transmit(const bool all)
+{
+    if (!tcp.connected())
+    {
+        return;
+    }
+    const size_t mss = tcp.getMss() ? tcp.getMss() : TX_BUFFER_SIZE;
+    size_t amount = all ? txCount : txCount - txCount % mss;
+    bool added = false;
+    while (amount)
+    {
+        const size_t contiguous = std::min(amount, TX_BUFFER_SIZE - txHead);
+        const size_t chunk = tcp.add(reinterpret_cast<const char*>(txBuffer.get() + txHead), contiguous);
+        ++stats.writes;
+        if (!chunk)
+        {
+            break;
+        }
+        added = true;
+        txHead = (txHead + chunk) % TX_BUFFER_SIZE;
+        txCount -= chunk;
+        amount -= chunk;
+        stats.bytes += chunk;
+    }
+    if (added)
+    {
+        tcp.send();
+        ++stats.sends;
+    }
+    if (!txCount)
+    {
+        flushPending = false;
+    }
+}
+
+void MqttClient::retransmit(const bool all)
+{
+    const uint32_t now = millis();
+    for (InFlight& message : inFlightMessages)
+    {
+        if (!message.packet || (!all && now - message.sentAt < RETRY_MS))
+        {
+            continue;
+        }
+        if (TX_BUFFER_SIZE - txCount < message.length)
+        {
+            break;
+        }
+        message.packet[0] |= PUBLISH_DUP;
+        put(message.packet.get(), message.length);
+        message.sentAt = now;
+        lastOutbound = now;
+    }
+}
+
+uint16_t MqttClient::nextId()
+{
+    if (++packetId == 0)
+    {
+        ++packetId;
+    }
+    return packetId;
+}
+
+void MqttClient::reset()
+{
+    tcp.close(true);
+    state = State::disconnected;
+}
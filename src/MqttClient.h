@@ -0,0 +1,256 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include <ESPAsyncTCP.h>
+
+/// @brief Non-blocking MQTT 3.1.1 client on top of an asynchronous TCP connection
+///
+/// Received data is framed into packets by the TCP callbacks and handled in @ref loop. Publishing writes into a
+/// transmit ring, so no call ever blocks. The ring combines consecutive packets: full segments are handed to the TCP
+/// stack right away, the remainder once per cycle by @ref flush or @ref loop.
+/// QoS 1 messages are kept until the broker acknowledges them and are retransmitted if the acknowledgement is late,
+/// at most @ref MAX_IN_FLIGHT at a time.
+///
+/// TCP callbacks run in the system context, which never preempts the sketch loop, so no locking is needed.
+class MqttClient
+{
+public:
+    /// @brief Handler for received messages
+    ///
+    /// The topic is null terminated, the payload is not. Both are only valid during the call.
+    typedef std::function<void(char* topic, uint8_t* payload, unsigned int length)> MessageHandler;
+
+    /// @brief Writes exactly the announced number of payload bytes, see @ref publish
+    typedef std::function<void(Print& out)> PayloadWriter;
+
+    /// @brief Transmit counters, to compare the number of publishes with the TCP work they cause
+    struct Stats
+    {
+        uint32_t publishes = 0; /// Queued PUBLISH packets
+        uint32_t writes = 0; /// Calls handing data to the TCP stack
+        uint32_t sends = 0; /// Calls triggering TCP output, at most one segment train each
+        uint32_t bytes = 0; /// Bytes handed to the TCP stack
+    };
+
+    /// @brief Connection state
+    enum class State : uint8_t
+    {
+        disconnected, /// Not connected, a new connection can be started
+        connecting, /// TCP connect or MQTT handshake in progress
+        connected, /// Broker accepted the connection
+    };
+
+public:
+    MqttClient();
+
+    MqttClient(MqttClient&&) = delete;
+
+    /// @brief Set the broker
+    ///
+    /// @param host Host name or ip address, must stay valid
+    /// @param port Port
+    void setServer(const char* host, const uint16_t port);
+
+    /// @brief Set the keep alive interval
+    ///
+    /// @param seconds Interval in seconds, 0 to disable
+    void setKeepAlive(const uint16_t seconds) { keepAlive = seconds; }
+
+    /// @brief Set the handler for received messages
+    ///
+    /// @param handler MessageHandler, called from @ref loop
+    void setCallback(MessageHandler handler) { messageHandler = handler; }
+
+    /// @brief Start connecting to the broker with a clean session
+    ///
+    /// Returns immediately, @ref getState tells when the connection is established or failed
+    ///
+    /// @param id Client identifier
+    /// @param user User name, may be empty
+    /// @param password Password, may be empty
+    /// @param willTopic Topic of the last will
+    /// @param willQos QoS of the last will
+    /// @param willRetain Should the last will be retained
+    /// @param willMessage Last will message
+    /// @return true if connecting was started
+    /// @return false if already connecting or connected
+    bool connect(const char* id, const char* user, const char* password, const char* willTopic,
+        const uint8_t willQos, const bool willRetain, const char* willMessage);
+
+    /// @brief Gracefully disconnect, the last will is not published
+    void disconnect();
+
+    /// @brief Handle received packets, keep alive and retransmissions and send buffered data
+    void loop();
+
+    /// @brief Send all buffered packets, should be called at the end of a publish cycle
+    void flush();
+
+    /// @brief Get the connection state
+    State getState() const { return state; }
+
+    /// @brief Check if the broker accepted the connection
+    bool connected() const { return state == State::connected; }
+
+    /// @brief Publish a message
+    ///
+    /// @param topic Topic
+    /// @param payload Payload
+    /// @param length Length of the payload
+    /// @param retain Should the message be retained
+    /// @param qos 0 or 1
+    /// @return true if the message was queued
+    /// @return false if not connected, the transmit ring is full or no QoS 1 slot is free
+    bool publish(
+        const char* topic, const uint8_t* payload, const size_t length, const bool retain, const uint8_t qos = 0);
+
+    /// @brief Publish a null terminated message
+    bool publish(const char* topic, const char* payload, const bool retain, const uint8_t qos = 0)
+    {
+        return publish(topic, reinterpret_cast<const uint8_t*>(payload), strlen(payload), retain, qos);
+    }
+
+    /// @brief Publish a message whose payload is streamed by a writer
+    ///
+    /// The writer is called once and directly writes into the transmit ring. Bytes beyond the announced length are
+    /// ignored, missing bytes are padded with spaces.
+    ///
+    /// @param topic Topic
+    /// @param length Exact length of the payload
+    /// @param retain Should the message be retained
+    /// @param qos 0 or 1
+    /// @param writer Writes the payload
+    /// @return true if the message was queued
+    /// @return false if not connected, the transmit ring is full or no QoS 1 slot is free
+    bool publish(
+        const char* topic, const size_t length, const bool retain, const uint8_t qos, const PayloadWriter& writer);
+
+    /// @brief Subscribe to a topic with QoS 0
+    ///
+    /// @param topic Topic
+    /// @return true if the subscription was queued
+    bool subscribe(const char* topic);
+
+    /// @brief Get the number of QoS 1 messages waiting for their acknowledgement
+    uint8_t inFlight() const;
+
+    /// @brief Get the transmit counters since boot
+    const Stats& getStats() const { return stats; }
+
+public:
+    constexpr static const uint8_t MAX_IN_FLIGHT = 8; /// Maximum number of unacknowledged QoS 1 messages
+    constexpr static const size_t TX_BUFFER_SIZE = 2048; /// Size of the transmit ring
+    constexpr static const size_t RX_BUFFER_SIZE = 1024; /// Size of the receive buffer, larger packets are dropped
+
+private:
+    /// @brief QoS 1 message waiting for its acknowledgement
+    struct InFlight
+    {
+        std::unique_ptr<uint8_t[]> packet; /// Complete PUBLISH packet, null if the slot is free
+        size_t length = 0; /// Length of the packet
+        uint16_t packetId = 0; /// Packet identifier
+        uint32_t sentAt = 0; /// Time in ms the packet was last queued
+    };
+
+    /// @brief Print handed to payload writers, limited to the announced payload length
+    class PayloadPrint : public Print
+    {
+    public:
+        PayloadPrint(MqttClient& client, const size_t remaining) : client(client), remaining(remaining) { }
+
+        size_t write(uint8_t byte) override { return write(&byte, 1); }
+        size_t write(const uint8_t* buffer, size_t size) override;
+
+    public:
+        MqttClient& client; /// Client to write into
+        size_t remaining; /// Payload bytes still to be written
+    };
+
+    constexpr static const uint32_t CONNECT_TIMEOUT_MS = 10000; /// Time to wait for the TCP connect and CONNACK
+    constexpr static const uint32_t RETRY_MS = 10000; /// Time to wait for a PUBACK before retransmitting
+
+private:
+    /// @brief Frame received data into packets, called from the TCP callback
+    ///
+    /// @param data Received data
+    /// @param length Length of the data
+    void receive(const uint8_t* data, size_t length);
+
+    /// @brief Handle a complete received packet
+    ///
+    /// @param packet Packet starting with the fixed header
+    /// @param headerLength Length of the fixed header
+    /// @param length Length of the packet
+    void handlePacket(uint8_t* packet, const size_t headerLength, const size_t length);
+
+    /// @brief Start a packet in the transmit ring
+    ///
+    /// @param type First byte of the fixed header
+    /// @param remaining Remaining length
+    /// @return true if the whole packet fits into the transmit ring
+    bool beginPacket(const uint8_t type, const size_t remaining);
+
+    /// @brief Write bytes into the transmit ring and the capture buffer, space must have been checked
+    void put(const uint8_t* data, const size_t length);
+    void put(const uint8_t byte) { put(&byte, 1); }
+    void putWord(const uint16_t word);
+    void putString(const char* str);
+
+    /// @brief Queue the fixed and variable header of a PUBLISH packet
+    ///
+    /// @param topic Topic
+    /// @param length Length of the payload which has to follow
+    /// @param retain Should the message be retained
+    /// @param qos 0 or 1
+    /// @param slot In-flight slot capturing the packet, null for QoS 0
+    /// @return true if the whole packet fits and was started
+    bool beginPublish(const char* topic, const size_t length, const bool retain, const uint8_t qos, InFlight*& slot);
+
+    /// @brief Finish capturing the current PUBLISH packet and send it
+    void endPublish();
+
+    /// @brief Hand buffered data to the TCP stack, as much as it accepts
+    ///
+    /// @param all true to send everything, false to only send full segments
+    void transmit(const bool all);
+
+    /// @brief Queue in-flight messages again with the DUP flag
+    ///
+    /// @param all true to retransmit all, false to only retransmit late messages
+    void retransmit(const bool all);
+
+    /// @brief Get the next packet identifier, never 0
+    uint16_t nextId();
+
+    /// @brief Reset buffers and drop the TCP connection
+    void reset();
+
+private:
+    AsyncClient tcp; /// TCP connection
+    const char* host = nullptr; /// Broker host
+    uint16_t port = 1883; /// Broker port
+    uint16_t keepAlive = 15; /// Keep alive interval in seconds
+    MessageHandler messageHandler; /// Handler for received messages
+    State state = State::disconnected; /// Connection state
+    uint32_t stateSince = 0; /// Time in ms the state last changed
+    uint32_t lastOutbound = 0; /// Time in ms a packet was last queued
+    uint32_t pingSentAt = 0; /// Time in ms of the unanswered PINGREQ, 0 if none
+    uint16_t packetId = 0; /// Last used packet identifier
+
+    std::unique_ptr<uint8_t[]> txBuffer; /// Transmit ring
+    size_t txHead = 0; /// Index of the oldest byte in the transmit ring
+    size_t txCount = 0; /// Number of bytes in the transmit ring
+    bool flushPending = false; /// Everything should be sent, but the TCP send buffer was full
+    uint8_t* capture = nullptr; /// Receives a copy of written bytes while queueing a QoS 1 message
+
+    std::unique_ptr<uint8_t[]> rxBuffer; /// Received data, complete packets first
+    size_t rxLength = 0; /// Number of bytes in the receive buffer
+    size_t rxComplete = 0; /// Number of bytes of complete packets at the start of the receive buffer
+    size_t rxDiscard = 0; /// Bytes of a packet exceeding the receive buffer still to be dropped
+    bool rxFailed = false; /// Received data was lost or malformed, the connection is dropped in @ref loop
+
+    InFlight inFlightMessages[MAX_IN_FLIGHT]; /// QoS 1 messages waiting for their acknowledgement
+    Stats stats; /// Transmit counters
+}; // class MqttClient
@@ -5,6 +5,36 @@
 
 #include "RNGBridgeUI/cpp/build.html.gz.h"
 
+namespace
+{
+    /// @brief Add a run time window and histogram to a metrics object
+    void addProfileJson(JsonObject output, const Scheduler::Profile& profile)
+    {
+        const Scheduler::Window& window = profile.last;
+        output["count"] = window.count;
+        output["min"] = window.minUs;
+        output["avg"] = window.avgUs();
+        output["max"] = window.maxUs;
+        JsonArray histogram = output["hist"].to<JsonArray>();
+        for (uint32_t count : profile.histogram)
+        {
+            histogram.add(count);
+        }
+    }
+
+    /// @brief Select event stream clients which apply patch events
+    bool wantsPatches(const EventStreamClient& client)
+    {
+        return client.acceptsPatches();
+    }
+
+    /// @brief Select event stream clients which only understand status events
+    bool wantsStatus(const EventStreamClient& client)
+    {
+        return !client.acceptsPatches();
+    }
+} // namespace
+
 void Networking::initWifi()
 {
     if (isInitialized)
@@ -39,10 +69,13 @@ void Networking::initWifi()
     isInitialized = true;
 }
 
-void Networking::initServer(OutputControl& outputs)
+void Networking::initServer(OutputControl& outputs, const Scheduler& scheduler)
 {
+    // Assets only change with the firmware
+    buildTag = '"' + ESP.getSketchMD5() + '"';
+
     // Handle EventSource
-    es.onConnect([this](AsyncEventSourceClient* client) {
+    es.onConnect([this](EventStreamClient* client) {
         RNG_DEBUGF("[Networking] ES[%s] connect\n", client->client()->remoteIP().toString().c_str());
 
         JsonDocument output;
@@ -54,10 +87,15 @@ void Networking::initServer(OutputControl& outputs)
         buffer.reserve(measureJson(output));
         serializeJson(output, buffer);
 
-        client->send(buffer.c_str(), "status");
+        client->send(buffer.c_str(), "status", 0, Delivery::reliable);
+        resumeEvents(client);
     });
+    es.onResync([](EventStreamClient* client) { client->send(GUI::status, "status", GUI::sequence); });
     server.addHandler(&es);
 
+    // Handle binary live telemetry
+    server.addHandler(&telemetry.handler());
+
     // Handle binary software updates
     server.on(
         "/ota", HTTP_POST, [](AsyncWebServerRequest* request) { request->send(200); },
@@ -66,9 +104,11 @@ void Networking::initServer(OutputControl& outputs)
 
     // Handle configuration
     server.on("/api/config", HTTP_GET, [this](AsyncWebServerRequest* r) { handleConfigApiGet(r); });
-    AsyncCallbackJsonWebHandler* handlerSetConfig = new AsyncCallbackJsonWebHandler("/api/config",
-        [this](AsyncWebServerRequest* request, JsonVariant& json) { handleConfigApiPost(request, json); });
-    server.addHandler(handlerSetConfig);
+    server.on(
+        "/api/config", HTTP_POST, [this](AsyncWebServerRequest* r) { handleConfigApiPost(r); }, nullptr,
+        [](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+            bufferConfigBody(request, data, len, index, total);
+        });
 
     // Handle control
     AsyncCallbackJsonWebHandler* handlerControl = new AsyncCallbackJsonWebHandler(
@@ -80,14 +120,23 @@ void Networking::initServer(OutputControl& outputs)
     // Handle state
     server.on("/api/state", HTTP_GET, [this](AsyncWebServerRequest* r) { handleStateApiGet(r); });
 
+    // Handle metrics
+    server.on("/api/metrics", HTTP_GET,
+        [this, &scheduler](AsyncWebServerRequest* r) { handleMetricsApiGet(r, scheduler); });
+
     // Serve UI
     server.on("/", HTTP_GET, [this](AsyncWebServerRequest* r) { handleIndex(r); });
 
     // Serve favicon
-    server.on("/favicon.ico", [](AsyncWebServerRequest* r) {
+    server.on("/favicon.ico", [this](AsyncWebServerRequest* r) {
+        if (notModified(r, buildTag, NO_CACHE))
+        {
+            return;
+        }
         AsyncWebServerResponse* response
             = r->beginResponse_P(200, "image/x-icon", favicon_ico_gz_start, favicon_ico_gz_size);
         response->addHeader("Content-Encoding", "gzip");
+        addCacheHeaders(response, buildTag, NO_CACHE);
         r->send(response);
     });
 
@@ -104,12 +153,12 @@ void Networking::initServer(OutputControl& outputs)
     RNG_DEBUGLN(F("[Networking] Server setup"));
 }
 
-void Networking::init(OutputControl& outputs)
+void Networking::init(OutputControl& outputs, const Scheduler& scheduler)
 {
     if (!isInitialized)
     {
         initWifi();
-        initServer(outputs);
+        initServer(outputs, scheduler);
     }
 }
 
@@ -155,7 +204,7 @@ void Networking::handleOTAUpload(
     if (len)
     {
         const size_t written = Update.write(data, len);
-        es.send(String(index + written, 10).c_str(), "ota");
+        es.send(String(index + written, 10).c_str(), "ota", 0, Delivery::reliable);
     }
 
     // if the final flag is set then this is the last frame of data
@@ -179,56 +228,157 @@ void Networking::handleOTAUpload(
 
 void Networking::handleIndex(AsyncWebServerRequest* request)
 {
+    // Revalidated on every load, so a firmware update is picked up right away
+    if (notModified(request, buildTag, NO_CACHE))
+    {
+        return;
+    }
     AsyncWebServerResponse* response
         = request->beginResponse_P(200, F("text/html"), build_html_gz_start, build_html_gz_size);
     response->addHeader(F("Content-Encoding"), F("gzip"));
+    addCacheHeaders(response, buildTag, NO_CACHE);
     request->send(response);
 }
 
 void Networking::handleConfigApiGet(AsyncWebServerRequest* request)
 {
-    String buffer;
-    buffer.reserve(512);
+    const String etag = "\"c" + String(config.getRevision(), 16) + '"';
+    if (notModified(request, etag, NO_CACHE) || !admit(request))
+    {
+        return;
+    }
+    // Stream one section at a time, the filler is called whenever the TCP stack has space
+    std::shared_ptr<ConfigStream> stream = std::make_shared<ConfigStream>();
+    AsyncWebServerResponse* response = request->beginChunkedResponse(
+        "application/json", [this, stream](uint8_t* buffer, size_t maxLen, size_t) -> size_t {
+            while (stream->offset == stream->chunk.length())
+            {
+                if (stream->next > Config::SECTION_COUNT)
+                {
+                    return 0;
+                }
+                stream->chunk = configChunk(stream->next++);
+                stream->offset = 0;
+            }
+            const size_t length = std::min(maxLen, stream->chunk.length() - stream->offset);
+            memcpy(buffer, stream->chunk.c_str() + stream->offset, length);
+            stream->offset += length;
+            return length;
+        });
+    addCacheHeaders(response, etag, NO_CACHE);
+    request->send(response);
+}
+
+String Networking::configChunk(const uint8_t index)
+{
+    if (index == Config::SECTION_COUNT)
+    {
+        return F("}");
+    }
+
+    const Config::Section section = static_cast<Config::Section>(index);
     JsonDocument document;
-    config.createJson(document);
+    JsonObject object = document.to<JsonObject>();
+    config.createSectionJson(section, object);
 
-    auto&& wifi = document["wifi"];
-    wifi.remove("client_password");
-    wifi.remove("ap_password");
-    wifi["client_has_password"] = config.getNetworkConfig().clientPassword.length() != 0;
-    wifi["ap_has_password"] = config.getNetworkConfig().apPassword.length() != 0;
-    auto&& mqtt = document["mqtt"];
-    mqtt.remove("has_password");
+    if (section == Config::Section::wifi)
+    {
+        object.remove("client_password");
+        object.remove("ap_password");
+        object["client_has_password"] = config.getNetworkConfig().clientPassword.length() != 0;
+        object["ap_has_password"] = config.getNetworkConfig().apPassword.length() != 0;
+    }
+    else if (section == Config::Section::mqtt)
+    {
+        object.remove("has_password");
+    }
 
-    serializeJson(document, buffer);
+    String chunk;
+    chunk.reserve(measureJson(document) + 10);
+    chunk += index ? F(",\"") : F("{\"");
+    chunk += Config::sectionName(section);
+    chunk += F("\":");
+    serializeJson(document, chunk);
+    return chunk;
+}
 
-    request->send(200, "application/json", buffer);
+void Networking::bufferConfigBody(
+    AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
+{
+    if (total > MAX_CONFIG_BODY)
+    {
+        return;
+    }
+    if (index == 0)
+    {
+        // Freed with the request
+        request->_tempObject = malloc(total + 1);
+    }
+    char* body = static_cast<char*>(request->_tempObject);
+    if (body && index + len <= total)
+    {
+        memcpy(body + index, data, len);
+        body[index + len] = '\0';
+    }
 }
 
-void Networking::handleConfigApiPost(AsyncWebServerRequest* request, JsonVariant& json)
+void Networking::handleConfigApiPost(AsyncWebServerRequest* request)
 {
     RNG_DEBUGLN(F("[Networking] Received new config"));
 
+    if (request->contentLength() > MAX_CONFIG_BODY)
+    {
+        request->send(413, "text/plain", "Config too large");
+        return;
+    }
+    const char* body = static_cast<const char*>(request->_tempObject);
+    if (!body)
+    {
+        request->send(400, "text/plain", "Missing config");
+        return;
+    }
+
 #ifdef DEBUG_CONFIG
-    String jsonstr;
-    jsonstr.reserve(measureJsonPretty(json));
-    serializeJsonPretty(json, jsonstr);
-    RNG_DEBUGLN(jsonstr);
+    RNG_DEBUGLN(body);
 #endif
 
-    JsonObject&& data = json.as<JsonObject>();
-
-    NetworkConfig& wifi = config.getNetworkConfig();
-    bool changed = wifi.tryUpdate(data["wifi"]);
-
-    MqttConfig& mqtt = config.getMqttConfig();
-    changed |= mqtt.tryUpdate(data["mqtt"]);
-
-    PVOutputConfig& pvo = config.getPvoutputConfig();
-    changed |= pvo.tryUpdate(data["pvo"]);
-
-    DeviceConfig& dev = config.getDeviceConfig();
-    changed |= dev.tryUpdate(data["dev"]);
+    // Parse one section at a time, the filter skips all others while parsing. The first pass only checks, so an
+    // invalid field rejects the whole config instead of being skipped.
+    uint8_t changed = 0;
+    for (uint8_t pass = 0; pass < 2; ++pass)
+    {
+        for (uint8_t i = 0; i < Config::SECTION_COUNT; ++i)
+        {
+            const Config::Section section = static_cast<Config::Section>(i);
+            JsonDocument filter;
+            filter[Config::sectionName(section)] = true;
+
+            JsonDocument json;
+            const DeserializationError error = deserializeJson(json, body, request->contentLength(),
+                DeserializationOption::Filter(filter), DeserializationOption::NestingLimit(CONFIG_NESTING_LIMIT));
+            if (error)
+            {
+                RNG_DEBUGF("[Networking] Invalid config: %s\n", error.c_str());
+                request->send(400, "text/plain", "Invalid config");
+                return;
+            }
+            const JsonObjectConst object = json[Config::sectionName(section)];
+            if (pass == 0)
+            {
+                String invalid;
+                if (!config.checkSectionUpdate(section, object, invalid))
+                {
+                    RNG_DEBUGF("[Networking] Rejected config: %s\n", invalid.c_str());
+                    request->send(400, "text/plain", invalid);
+                    return;
+                }
+            }
+            else if (config.tryUpdateSection(section, object))
+            {
+                changed |= 1 << i;
+            }
+        }
+    }
 
     if (changed)
     {
@@ -242,9 +392,18 @@ void Networking::handleConfigApiPost(AsyncWebServerRequest* request, JsonVariant
     AsyncWebServerResponse* response = request->beginResponse(200, "text/plain", "OK");
     request->send(response);
 
-    if (changed)
+    // Wifi can only be applied by restarting, all other sections are applied in place
+    if (changed & (1 << static_cast<uint8_t>(Config::Section::wifi)))
     {
         restartESP = true;
+        return;
+    }
+    for (uint8_t i = 0; i < Config::SECTION_COUNT; ++i)
+    {
+        if (changed & (1 << i))
+        {
+            config.notifyChanged(static_cast<Config::Section>(i));
+        }
     }
 }
 
@@ -253,49 +412,141 @@ void Networking::handleRenogyApi(AsyncWebServerRequest* request, JsonVariant& js
     JsonObject&& data = json.as<JsonObject>();
 
     bool success = false;
-    if (data.containsKey("load"))
+    for (uint8_t i = 0; i < DeviceConfig::OUTPUT_COUNT; ++i)
+    {
+        const Output output = static_cast<Output>(i);
+        const JsonVariant value = data[DeviceConfig::outputName(output)];
+        if (value.is<bool>())
+        {
+            outputs.enable(output, value.as<bool>());
+            success = true;
+        }
+        else if (value.is<unsigned int>())
+        {
+            // Duty cycle in percent
+            outputs.setDuty(output, std::min(value.as<unsigned int>(), 100u));
+            success = true;
+        }
+    }
+
+    if (success)
     {
-        const bool enabled = data["load"];
-        outputs.enableLoad(enabled);
-        success = true;
+        AsyncWebServerResponse* response = request->beginResponse(200, "text/plain", "OK");
+        request->send(response);
+        return;
     }
 
-    if (data.containsKey("out1"))
+    AsyncWebServerResponse* response
+        = request->beginResponse(400, "text/plain", "JSON does not contain `load`, `out1`, `out2` or `out3` key");
+    request->send(response);
+}
+
+void Networking::handleStateApiGet(AsyncWebServerRequest* request)
+{
+    AsyncWebHeader* accept = request->getHeader("Accept");
+    const bool msgpack = accept && accept->value().indexOf("msgpack") >= 0;
+    // Both representations change with the status sequence, but need distinct tags
+    const String etag = "\"s" + String(GUI::sequence, 16) + (msgpack ? "m\"" : "\"");
+    if (notModified(request, etag, NO_CACHE) || !admit(request))
     {
-        const bool enabled = data["out1"];
-        outputs.enableOut1(enabled);
-        success = true;
+        return;
     }
+    if (msgpack)
+    {
+        // Copied into the response, the status may be updated while it is sent
+        AsyncResponseStream* response = request->beginResponseStream("application/msgpack");
+        response->write(GUI::packedStatus, GUI::packedStatusLength);
+        response->addHeader("Vary", "Accept");
+        addCacheHeaders(response, etag, NO_CACHE);
+        request->send(response);
+        return;
+    }
+    AsyncWebServerResponse* response = request->beginResponse(200, "application/json", GUI::status);
+    response->addHeader("Vary", "Accept");
+    addCacheHeaders(response, etag, NO_CACHE);
+    request->send(response);
+}
 
-    if (data.containsKey("out2"))
+void Networking::handleMetricsApiGet(AsyncWebServerRequest* request, const Scheduler& scheduler)
+{
+    if (!admit(request))
     {
-        const bool enabled = data["out2"];
-        outputs.enableOut2(enabled);
-        success = true;
+        return;
     }
+    JsonDocument document;
+    document["uptime"] = millis() / 1000;
+    const uint32_t windowMs = scheduler.getWindowLength();
+    document["window"] = windowMs;
 
-    if (data.containsKey("out3"))
+    JsonArray buckets = document["buckets"].to<JsonArray>();
+    for (uint8_t i = 0; i < Scheduler::HISTOGRAM_BUCKETS - 1; ++i)
     {
-        const bool enabled = data["out3"];
-        outputs.enableOut3(enabled);
-        success = true;
+        buckets.add(Scheduler::Profile::bucketLimit(i));
     }
 
-    if (success)
+    JsonObject heap = document["heap"].to<JsonObject>();
+    heap["free"] = ESP.getFreeHeap();
+    heap["max_block"] = ESP.getMaxFreeBlockSize();
+
+    JsonObject events = document["events"].to<JsonObject>();
+    events["refused"] = es.refused();
+    events["dropped"] = es.dropped();
+
+    addProfileJson(document["loop"].to<JsonObject>(), scheduler.getLoopProfile());
+
+    JsonArray tasks = document["tasks"].to<JsonArray>();
+    for (uint8_t i = 0; i < scheduler.count(); ++i)
     {
-        AsyncWebServerResponse* response = request->beginResponse(200, "text/plain", "OK");
-        request->send(response);
-        return;
+        const Scheduler::Stats& stats = scheduler.getStats(i);
+        JsonObject task = tasks.add<JsonObject>();
+        task["name"] = scheduler.getName(i);
+        task["runs"] = stats.runs;
+        task["late"] = stats.late;
+        task["overruns"] = stats.overruns;
+        task["last"] = stats.lastUs;
+        task["peak"] = stats.maxUs;
+        // Share of the CPU in the last window in permille
+        task["cpu"] = windowMs ? static_cast<uint32_t>(stats.profile.last.totalUs / windowMs) : 0;
+        addProfileJson(task, stats.profile);
     }
 
-    AsyncWebServerResponse* response
-        = request->beginResponse(400, "text/plain", "JSON does not contain `load`, `out1`, `out2` or `out3` key");
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(document, *response);
+    response->addHeader("Cache-Control", NO_CACHE);
     request->send(response);
 }
 
-void Networking::handleStateApiGet(AsyncWebServerRequest* request)
+bool Networking::notModified(AsyncWebServerRequest* request, const String& etag, const char* cacheControl)
+{
+    AsyncWebHeader* ifNoneMatch = request->getHeader("If-None-Match");
+    if (!ifNoneMatch || (ifNoneMatch->value() != "*" && ifNoneMatch->value().indexOf(etag) < 0))
+    {
+        return false;
+    }
+    AsyncWebServerResponse* response = request->beginResponse(304);
+    addCacheHeaders(response, etag, cacheControl);
+    response->addHeader("Vary", "Accept");
+    request->send(response);
+    return true;
+}
+
+void Networking::addCacheHeaders(AsyncWebServerResponse* response, const String& etag, const char* cacheControl)
+{
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", cacheControl);
+}
+
+bool Networking::admit(AsyncWebServerRequest* request)
 {
-    request->send(200, "application/json", GUI::status);
+    if (ESP.getFreeHeap() >= MIN_REQUEST_HEAP)
+    {
+        return true;
+    }
+    RNG_DEBUGF("[Networking] Refusing %s, %u bytes free\n", request->url().c_str(), ESP.getFreeHeap());
+    AsyncWebServerResponse* response = request->beginResponse(503);
+    response->addHeader("Retry-After", "5");
+    request->send(response);
+    return false;
 }
 
 bool Networking::isIp(const String& str)
@@ -318,6 +569,8 @@ void Networking::update()
 
     if (restartESP)
     {
+        // Scheduled config saves would be lost otherwise
+        config.flush();
         if (_rebootHandler)
         {
             _rebootHandler();
@@ -333,10 +586,62 @@ void Networking::update()
         RNGBridge::rssi = RNGBridge::rssi * 0.7f + WiFi.RSSI() * 0.3f;
     }
 
-    if (es.count())
+    telemetry.cleanup();
+
+    if (GUI::sequence != sentSequence)
     {
-        es.send(GUI::status.c_str(), "status");
-        // RNG_DEBUGF("[Networking] AVG ES packages %d\n", es.avgPacketsWaiting());
+        if (es.count())
+        {
+            sendPatches();
+        }
+        sentSequence = GUI::sequence;
+    }
+}
+
+void Networking::resumeEvents(EventStreamClient* client)
+{
+    if (!GUI::sequence)
+    {
+        return;
+    }
+    if (!client->acceptsPatches())
+    {
+        client->send(GUI::status, "status", GUI::sequence);
+        return;
+    }
+
+    // Resume a reconnecting client with the patches it missed, if they are all still available
+    const uint32_t lastId = client->lastId();
+    bool resumable = lastId && lastId <= GUI::sequence;
+    for (uint32_t id = lastId + 1; resumable && id <= GUI::sequence; ++id)
+    {
+        resumable = GUI::getPatch(id) != nullptr;
+    }
+    if (!resumable)
+    {
+        client->send(GUI::status, "status", GUI::sequence);
+        return;
+    }
+    for (uint32_t id = lastId + 1; id <= GUI::sequence; ++id)
+    {
+        client->send(GUI::getPatch(id), "patch", id);
+    }
+}
+
+void Networking::sendPatches()
+{
+    // Clients which did not ask for patches, like UIs predating them, keep getting the whole status
+    es.send(GUI::status, "status", GUI::sequence, Delivery::latest, wantsStatus);
+    for (uint32_t id = sentSequence + 1; id <= GUI::sequence; ++id)
+    {
+        const char* patch = GUI::getPatch(id);
+        if (!patch)
+        {
+            // Missing patch, replace the status of all patch clients
+            es.send(GUI::status, "status", GUI::sequence, Delivery::latest, wantsPatches);
+            return;
+        }
+        es.send(patch, "patch", id, Delivery::latest, wantsPatches);
     }
 }
 
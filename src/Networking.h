@@ -7,7 +7,10 @@
 
 #include "Config.h"
 #include "Constants.h"
+#include "EventStream.h"
 #include "OutputControl.h"
+#include "Scheduler.h"
+#include "TelemetrySocket.h"
 
 #if defined(ESP32)
 #include <Update.h>
@@ -35,7 +38,7 @@ public:
 
     void initWifi();
 
-    void init(OutputControl& outputs);
+    void init(OutputControl& outputs, const Scheduler& scheduler);
 
     void getStatusJsonString(JsonObject& output);
 
@@ -60,9 +63,10 @@ public:
 
     ///@brief Handle the config POST api
     ///
+    /// The body has been collected by @ref bufferConfigBody and contains the configuration of wifi, mqtt, etc.
+    ///
     ///@param request Request coming from webserver
-    ///@param json JSON object containing configuration of wifi, mqtt, etc.
-    void handleConfigApiPost(AsyncWebServerRequest* request, JsonVariant& json);
+    void handleConfigApiPost(AsyncWebServerRequest* request);
 
     ///@brief Handle the renogy
     ///
@@ -73,9 +77,19 @@ public:
 
     ///@brief Handle the status GET api
     ///
+    /// Responds with MessagePack if the `Accept` header asks for it, JSON otherwise
+    ///
     ///@param request Request coming from webserver
     void handleStateApiGet(AsyncWebServerRequest* request);
 
+    ///@brief Handle the metrics GET api
+    ///
+    /// Responds with the run time profile of every task, the loop jitter, the heap and the event stream counters
+    ///
+    ///@param request Request coming from webserver
+    ///@param scheduler Scheduler running the tasks
+    void handleMetricsApiGet(AsyncWebServerRequest* request, const Scheduler& scheduler);
+
     /// @brief Check if the given string is an ip address
     ///
     /// @param str String to check
@@ -88,12 +102,66 @@ public:
     /// Should be called once every second
     void update();
 
+    ///@brief Push new renogy data to live telemetry clients
+    ///
+    ///@param data Data read from the controller
+    void updateRenogyData(const Renogy::Data& data) { telemetry.publish(data); }
+
     ///@brief Set a handler for rebooting the ESP upon being called
     ///
     ///@param handler RebootHandler
     void setRebootHandler(RebootHandler handler);
 
 private:
+    /// @brief Send a newly connected event source client the status or the patches it missed
+    ///
+    /// Status events carry the whole status, patch events a JSON merge patch. Both use the status sequence as id,
+    /// so reconnecting clients can resume with the `Last-Event-ID` header. Only clients connecting with the `patches`
+    /// query parameter get patch events, all others get a status event for every change.
+    ///
+    /// @param client Connected client
+    void resumeEvents(EventStreamClient* client);
+
+    /// @brief Send all patches since the last sent status sequence to patch clients, the status to all others
+    void sendPatches();
+
+    /// @brief State of a streamed config response
+    struct ConfigStream
+    {
+        uint8_t next = 0; /// Index of the next chunk, see @ref configChunk
+        String chunk; /// Current chunk
+        size_t offset = 0; /// Bytes of the current chunk already sent
+    };
+
+    /// @brief Create a chunk of the config GET response
+    ///
+    /// @param index Index of the section, Config::SECTION_COUNT for the closing brace
+    /// @return Section as JSON member, without passwords
+    String configChunk(const uint8_t index);
+
+    /// @brief Collect the body of a config POST, bodies larger than @ref MAX_CONFIG_BODY are ignored
+    static void bufferConfigBody(
+        AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total);
+
+    /// @brief Answer a conditional request with 304 if the client already has the current version
+    ///
+    /// @param request Request to check
+    /// @param etag Strong entity tag of the current version, including the quotes
+    /// @param cacheControl Value of the Cache-Control header
+    /// @return true If the request was answered
+    /// @return false If the full response has to be sent
+    bool notModified(AsyncWebServerRequest* request, const String& etag, const char* cacheControl);
+
+    /// @brief Add the ETag and Cache-Control headers to a response
+    static void addCacheHeaders(AsyncWebServerResponse* response, const String& etag, const char* cacheControl);
+
+    /// @brief Refuse a request with 503 if the free heap is too low to build its response
+    ///
+    /// @param request Request to check
+    /// @return true If the request can be handled
+    /// @return false If the request was refused
+    bool admit(AsyncWebServerRequest* request);
+
     /// @brief Callback used for captive portal webserver
     ///
     /// @param request Request to check and handle captive portal for
@@ -114,14 +182,23 @@ private:
     /// @brief Initialize server and rest endpoints
     ///
     /// @param outputs Output control
-    void initServer(OutputControl& outputs);
+    /// @param scheduler Scheduler whose profile is served as metrics
+    void initServer(OutputControl& outputs, const Scheduler& scheduler);
 
 private:
+    constexpr static const uint32_t MIN_REQUEST_HEAP = 8192; /// Free heap required to build an API response
+    constexpr static const size_t MAX_CONFIG_BODY = 4096; /// Maximum size of a config POST body
+    constexpr static const uint8_t CONFIG_NESTING_LIMIT = 4; /// Maximum nesting of a config POST body
+    constexpr static const char* NO_CACHE = "no-cache"; /// Always revalidate with the ETag
+
     const IPAddress AP_IP = {192, 168, 4, 1};
     const IPAddress AP_NETMASK = {255, 255, 255, 0};
     DNSServer dnsServer; // DNS server for captive portal
     AsyncWebServer server {80}; /// Webserver for OTA
-    AsyncEventSource es {"/events"}; /// EventSource for updating clients with live data
+    EventStream es {"/events"}; /// EventSource for updating clients with live data
+    String buildTag; /// ETag of the assets, the firmware hash
+    TelemetrySocket telemetry {"/ws"}; /// WebSocket for high rate binary samples
+    uint32_t sentSequence = 0; /// GUI::sequence of the last status sent to event source clients
     bool isInitialized = false;
     bool restartESP = false; /// Restart ESP after config change
     RebootHandler _rebootHandler; /// Handler for restarting ESP and gracefully shutting down stuff
@@ -0,0 +1,228 @@
+#include "Outbox.h"
+
+#include <new>
+
+#include "Constants.h"
+
+namespace
+{
+    constexpr const char* OUTBOX_FILE = "/outbox.bin"; /// Flash ring file
+    constexpr const uint32_t OUTBOX_MAGIC = 0x4F474E52; /// "RNGO"
+} // namespace
+
+Outbox::Outbox(const uint16_t ramCapacity, const uint16_t flashCapacity, const Policy policy)
+    : ramCapacity(ramCapacity), flashCapacity(flashCapacity), policy(policy)
+{
+    // A fragmented heap must not abort, fall back to a smaller ring
+    while (this->ramCapacity && !ram)
+    {
+        ram.reset(new (std::nothrow) Entry[this->ramCapacity]);
+        if (!ram)
+        {
+            RNG_DEBUGF("[Outbox] No heap for %u entries\n", this->ramCapacity);
+            this->ramCapacity /= 2;
+        }
+    }
+    if (flashCapacity)
+    {
+        loadFlash();
+    }
+    else
+    {
+        SPIFFS.remove(OUTBOX_FILE);
+    }
+}
+
+void Outbox::push(const Entry& entry)
+{
+    if (ramCount == ramCapacity)
+    {
+        if (flashCapacity)
+        {
+            spill();
+        }
+        if (ramCount == ramCapacity)
+        {
+            // Still full, drop the oldest entry
+            ramHead = (ramHead + 1) % ramCapacity;
+            --ramCount;
+            ++droppedCount;
+        }
+    }
+    ram[(ramHead + ramCount) % ramCapacity] = entry;
+    ++ramCount;
+}
+
+bool Outbox::peek(Entry& entry)
+{
+    const bool fromFlash = policy == Policy::oldestFirst ? flashCount != 0 : ramCount == 0;
+    if (!fromFlash)
+    {
+        if (!ramCount)
+        {
+            return false;
+        }
+        const uint16_t index = policy == Policy::oldestFirst ? ramHead : (ramHead + ramCount - 1) % ramCapacity;
+        entry = ram[index];
+        return true;
+    }
+
+    if (!flashCount || !openFlash())
+    {
+        return false;
+    }
+    const uint16_t slot = policy == Policy::oldestFirst ? flashHead : (flashHead + flashCount - 1) % flashCapacity;
+    return seekFlash(slot) && flash.read(reinterpret_cast<uint8_t*>(&entry), sizeof(Entry)) == sizeof(Entry);
+}
+
+void Outbox::pop()
+{
+    const bool fromFlash = policy == Policy::oldestFirst ? flashCount != 0 : ramCount == 0;
+    if (!fromFlash)
+    {
+        if (ramCount)
+        {
+            if (policy == Policy::oldestFirst)
+            {
+                ramHead = (ramHead + 1) % ramCapacity;
+            }
+            --ramCount;
+        }
+        return;
+    }
+
+    if (flashCount)
+    {
+        if (policy == Policy::oldestFirst)
+        {
+            flashHead = (flashHead + 1) % flashCapacity;
+        }
+        --flashCount;
+        flashDirty = true;
+    }
+}
+
+void Outbox::flush()
+{
+    if (flashDirty)
+    {
+        if (!flashCount)
+        {
+            // Start from the beginning of an empty file again
+            flash.close();
+            SPIFFS.remove(OUTBOX_FILE);
+            flashHead = 0;
+        }
+        else if (openFlash())
+        {
+            writeHeader();
+        }
+        flashDirty = false;
+    }
+    if (flash)
+    {
+        flash.close();
+    }
+}
+
+void Outbox::loadFlash()
+{
+    File file = SPIFFS.open(OUTBOX_FILE, "r");
+    if (!file)
+    {
+        return;
+    }
+
+    FlashHeader header;
+    const bool valid = file.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) == sizeof(header)
+        && header.magic == OUTBOX_MAGIC && header.recordSize == sizeof(Entry) && header.capacity == flashCapacity
+        && header.head < flashCapacity && header.count <= flashCapacity;
+    file.close();
+
+    if (valid)
+    {
+        flashHead = header.head;
+        flashCount = header.count;
+        RNG_DEBUGF("[Outbox] Restored %u entries from flash\n", flashCount);
+    }
+    else
+    {
+        RNG_DEBUGLN(F("[Outbox] Discarding incompatible flash ring"));
+        SPIFFS.remove(OUTBOX_FILE);
+    }
+}
+
+bool Outbox::openFlash()
+{
+    if (!flash)
+    {
+        if (SPIFFS.exists(OUTBOX_FILE))
+        {
+            flash = SPIFFS.open(OUTBOX_FILE, "r+");
+        }
+        else
+        {
+            // Header must exist before seeking to the first slot
+            flash = SPIFFS.open(OUTBOX_FILE, "w+");
+            if (flash)
+            {
+                writeHeader();
+            }
+        }
+        if (!flash)
+        {
+            RNG_DEBUGLN(F("[Outbox] Could not open flash ring"));
+        }
+    }
+    return flash;
+}
+
+void Outbox::writeHeader()
+{
+    const FlashHeader header {OUTBOX_MAGIC, sizeof(Entry), flashCapacity, flashHead, flashCount};
+    flash.seek(0, SeekSet);
+    flash.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+}
+
+void Outbox::spill()
+{
+    if (!openFlash())
+    {
+        return;
+    }
+
+    // Move half of the RAM ring at once to limit the number of flash writes
+    uint16_t moving = ramCount / 2 ? ramCount / 2 : 1;
+    while (moving--)
+    {
+        const uint16_t slot = (flashHead + flashCount) % flashCapacity;
+        if (seekFlash(slot)
+            && flash.write(reinterpret_cast<const uint8_t*>(&ram[ramHead]), sizeof(Entry)) == sizeof(Entry))
+        {
+            if (flashCount == flashCapacity)
+            {
+                // Overwrote the oldest entry
+                flashHead = (flashHead + 1) % flashCapacity;
+                ++droppedCount;
+            }
+            else
+            {
+                ++flashCount;
+            }
+        }
+        else
+        {
+            RNG_DEBUGLN(F("[Outbox] Could not write flash ring"));
+            ++droppedCount;
+        }
+        ramHead = (ramHead + 1) % ramCapacity;
+        --ramCount;
+    }
+    flashDirty = true;
+    flush();
+}
+
+bool Outbox::seekFlash(const uint16_t slot)
+{
+    return flash.seek(sizeof(FlashHeader) + static_cast<uint32_t>(slot) * sizeof(Entry), SeekSet);
+}
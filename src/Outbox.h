@@ -0,0 +1,121 @@
+#pragma once
+
+#include <memory>
+
+#include <FS.h>
+
+#include "Renogy.h"
+
+/// @brief Bounded store for timestamped renogy data which could not be published yet
+///
+/// New entries are kept in a RAM ring. If a flash capacity is given, the older half of the RAM ring is moved into a
+/// ring file on flash whenever the RAM ring is full, so the flash tier always contains the oldest entries and
+/// survives reboots. When all tiers are full the oldest entry is dropped.
+class Outbox
+{
+public:
+    /// @brief Single stored state
+    struct Entry
+    {
+        uint32_t timestamp = 0; /// UTC epoch time in seconds the data was read at
+        Renogy::Data data; /// Data read from the controller
+    };
+
+    /// @brief Order in which entries are drained
+    enum class Policy : uint8_t
+    {
+        oldestFirst,
+        newestFirst,
+    };
+
+public:
+    /// @brief Construct a new Outbox object
+    ///
+    /// If the RAM ring cannot be allocated, the capacity is halved until it fits, see @ref getRamCapacity.
+    ///
+    /// @param ramCapacity Maximum number of entries kept in RAM, must not be 0
+    /// @param flashCapacity Maximum number of entries kept on flash, 0 to disable the flash tier
+    /// @param policy Order in which entries are drained
+    Outbox(const uint16_t ramCapacity, const uint16_t flashCapacity, const Policy policy);
+
+    Outbox(Outbox&&) = delete;
+
+    /// @brief Store an entry, dropping the oldest entry if full
+    ///
+    /// @param entry Entry to store
+    void push(const Entry& entry);
+
+    /// @brief Get the next entry according to the policy without removing it
+    ///
+    /// @param entry Entry to read into
+    /// @return true if an entry was read
+    /// @return false if the outbox is empty or flash could not be read
+    bool peek(Entry& entry);
+
+    /// @brief Remove the entry returned by the last @ref peek
+    void pop();
+
+    /// @brief Persist the flash ring position and release the flash file
+    ///
+    /// Should be called after a batch of @ref pop calls
+    void flush();
+
+    /// @brief Get the number of stored entries
+    size_t size() const { return ramCount + flashCount; }
+
+    /// @brief Check if there are no stored entries
+    bool empty() const { return size() == 0; }
+
+    /// @brief Get the number of entries the RAM ring holds, 0 if it could not be allocated at all
+    uint16_t getRamCapacity() const { return ramCapacity; }
+
+    /// @brief Get the number of entries dropped because the outbox was full
+    uint32_t dropped() const { return droppedCount; }
+
+private:
+    /// @brief Header of the flash ring file
+    struct FlashHeader
+    {
+        uint32_t magic; /// Identifies the file
+        uint16_t recordSize; /// Size of each entry, changes with the firmware
+        uint16_t capacity; /// Maximum number of entries
+        uint16_t head; /// Index of the oldest entry
+        uint16_t count; /// Number of entries
+    };
+
+    /// @brief Load the flash ring position, discarding files from other firmware or configurations
+    void loadFlash();
+
+    /// @brief Open the flash ring file
+    ///
+    /// @return true if the file is open
+    bool openFlash();
+
+    /// @brief Write the flash ring position to the open flash file
+    void writeHeader();
+
+    /// @brief Move the older half of the RAM ring to flash
+    void spill();
+
+    /// @brief Seek to the given slot of the flash ring
+    ///
+    /// @param slot Slot index
+    /// @return true if successful
+    bool seekFlash(const uint16_t slot);
+
+private:
+    uint16_t ramCapacity; /// Maximum number of entries in RAM
+    const uint16_t flashCapacity; /// Maximum number of entries on flash
+    const Policy policy; /// Drain order
+
+    std::unique_ptr<Entry[]> ram; /// RAM ring
+    uint16_t ramHead = 0; /// Index of the oldest entry in RAM
+    uint16_t ramCount = 0; /// Number of entries in RAM
+
+    File flash; /// Flash ring file, only open between flash access and @ref flush
+    uint16_t flashHead = 0; /// Index of the oldest entry on flash
+    uint16_t flashCount = 0; /// Number of entries on flash
+    bool flashDirty = false; /// Flash ring position changed since the last @ref flush
+
+    uint32_t droppedCount = 0; /// Number of dropped entries
+}; // class Outbox
@@ -1,110 +1,244 @@
 #include "OutputControl.h"
 
-OutputControl::OutputControl(Renogy& renogy, DeviceConfig& deviceConfig) : deviceConfig(deviceConfig)
+namespace
 {
-    pinMode(PIN_OUTPUT1, OUTPUT);
-    pinMode(PIN_OUTPUT2, OUTPUT);
-    pinMode(PIN_OUTPUT3, OUTPUT);
-    digitalWrite(PIN_OUTPUT1, LOW);
-    digitalWrite(PIN_OUTPUT2, LOW);
-    digitalWrite(PIN_OUTPUT3, LOW);
-    handleLoad = [&](const bool enable) {
-        renogy.enableLoad(enable);
-        deviceConfig.load.lastState = enable;
-    };
-    handleOut1 = [&](const bool enable) {
-        digitalWrite(PIN_OUTPUT1, enable);
-        deviceConfig.out1.lastState = enable;
-        _value.out1 = enable;
-        notify(_value);
-    };
-    handleOut2 = [&](const bool enable) {
-        digitalWrite(PIN_OUTPUT2, enable);
-        deviceConfig.out2.lastState = enable;
-        _value.out2 = enable;
-        notify(_value);
+    /// @brief Built-in driver of an output
+    struct OutputDescriptor
+    {
+        OutputControl::Driver driver; /// How the output is switched
+        uint8_t pin; /// Pin for Driver::gpio
+        const char* tag; /// Debug tag
     };
-    handleOut3 = [&](const bool enable) {
-        digitalWrite(PIN_OUTPUT3, enable);
-        deviceConfig.out3.lastState = enable;
-        _value.out3 = enable;
-        notify(_value);
+
+    /// Built-in drivers, indexed by DeviceConfig::Output
+    const OutputDescriptor OUTPUTS[DeviceConfig::OUTPUT_COUNT] = {
+        {OutputControl::Driver::renogyLoad, 0, "Load"},
+        {OutputControl::Driver::gpio, D5, "Out1"},
+        {OutputControl::Driver::gpio, D6, "Out2"},
+        {OutputControl::Driver::gpio, D7, "Out3"},
     };
-}
+} // namespace
 
-void OutputControl::enableLoad(const bool enable)
+OutputControl::OutputControl(Renogy& renogy, DeviceConfig& deviceConfig, RNGTime& time)
+    : renogy(renogy), deviceConfig(deviceConfig), time(time)
 {
-    handleLoad(enable);
+    for (uint8_t i = 0; i < DeviceConfig::OUTPUT_COUNT; ++i)
+    {
+        channels[i].driver = OUTPUTS[i].driver;
+        channels[i].pin = OUTPUTS[i].pin;
+        if (channels[i].driver == Driver::gpio)
+        {
+            pinMode(channels[i].pin, OUTPUT);
+            digitalWrite(channels[i].pin, LOW);
+        }
+    }
+    reconfigure();
 }
 
-void OutputControl::enableOut1(const bool enable)
+void OutputControl::enable(const Output output, const bool enable)
 {
-    handleOut1(enable);
+    const uint8_t index = static_cast<uint8_t>(output) % DeviceConfig::OUTPUT_COUNT;
+    channels[index].outputSwitch.force(enable, millis());
+    apply(index, enable);
 }
 
-void OutputControl::enableOut2(const bool enable)
+void OutputControl::setDuty(const Output output, const uint8_t percent)
 {
-    handleOut2(enable);
+    const uint8_t index = static_cast<uint8_t>(output) % DeviceConfig::OUTPUT_COUNT;
+    Channel& channel = channels[index];
+    channel.duty = percent > 100 ? 100 : percent;
+    if (channel.pwmField == Renogy::Field::count)
+    {
+        channel.level = PwmRamp::fromPercent(channel.duty);
+    }
+    enable(output, percent > 0);
 }
 
-void OutputControl::enableOut3(const bool enable)
+void OutputControl::setExternalDriver(const Output output, ExternalDriver handler)
 {
-    handleOut3(enable);
+    const uint8_t index = static_cast<uint8_t>(output) % DeviceConfig::OUTPUT_COUNT;
+    channels[index].external = handler;
+    channels[index].driver = handler ? Driver::external : OUTPUTS[index].driver;
 }
 
 void OutputControl::update(const Renogy::Data& data)
 {
-    handleOutput("Load", deviceConfig.load, data, handleLoad);
-    handleOutput("Out1", deviceConfig.out1, data, handleOut1);
-    handleOutput("Out2", deviceConfig.out2, data, handleOut2);
-    handleOutput("Out3", deviceConfig.out3, data, handleOut3);
+    for (uint8_t i = 0; i < DeviceConfig::OUTPUT_COUNT; ++i)
+    {
+        handleOutput(i, data);
+    }
 }
 
-void OutputControl::handleOutput(
-    const char* tag, OutputConfig& output, const Renogy::Data& data, std::function<void(const bool)> enable)
+void OutputControl::loop()
 {
-    if (output.inputType == InputType::disabled)
+    const uint32_t now = millis();
+    for (uint8_t i = 0; i < DeviceConfig::OUTPUT_COUNT; ++i)
     {
-        return;
+        Channel& channel = channels[i];
+        if (isPwm(i) && channel.ramp.update(now, deviceConfig.outputs[i].rampTime))
+        {
+            analogWrite(channel.pin, channel.ramp.getLevel());
+        }
     }
+}
 
-    float value = 0;
-    switch (output.inputType)
+void OutputControl::reconfigure()
+{
+    // The waveform is generated by the core from a timer interrupt, frequency and range are shared by all pins
+    analogWriteRange(PwmRamp::RANGE);
+    analogWriteFreq(deviceConfig.pwmFrequency);
+
+    for (uint8_t i = 0; i < DeviceConfig::OUTPUT_COUNT; ++i)
     {
-    case InputType::bsoc:
-        value = data.batteryCharge;
-        break;
-    case InputType::bvoltage:
-        value = data.batteryVoltage;
+        const OutputConfig& output = deviceConfig.outputs[i];
+        Channel& channel = channels[i];
+        channel.duty = output.duty;
+        channel.pwmField = Renogy::fieldFromName(output.pwmField.c_str());
+        if (channel.pwmField == Renogy::Field::count)
+        {
+            channel.level = PwmRamp::fromPercent(channel.duty);
+        }
+        if (isPwm(i))
+        {
+            retarget(i);
+        }
+        else if (channel.driver == Driver::gpio)
+        {
+            // Stops a running waveform as well
+            channel.ramp.setTarget(0, millis());
+            channel.ramp.update(millis(), 0);
+            digitalWrite(channel.pin, output.lastState);
+        }
+        // Recompiling would reset the duration qualifiers
+        if (channel.rule.getSource() != output.rule && !channel.rule.compile(output.rule.c_str()))
+        {
+            RNG_DEBUGF("[OutputControl][%s] Rule disabled, invalid at %u\n", OUTPUTS[i].tag,
+                static_cast<unsigned>(channel.rule.getErrorOffset()));
+        }
+        // Always reset, the location might have changed as well
+        if (!channel.schedule.set(output.scheduleStart.c_str(), output.scheduleEnd.c_str(), output.scheduleDays))
+        {
+            RNG_DEBUGF("[OutputControl][%s] Schedule disabled, invalid window\n", OUTPUTS[i].tag);
+        }
+    }
+}
+
+void OutputControl::apply(const uint8_t index, const bool enable)
+{
+    Channel& channel = channels[index];
+    switch (channel.driver)
+    {
+    case Driver::renogyLoad:
+        renogy.enableLoad(enable);
         break;
-    case InputType::pvoltage:
-        value = data.panelVoltage;
+    case Driver::gpio:
+        if (!isPwm(index))
+        {
+            digitalWrite(channel.pin, enable);
+        }
         break;
-    case InputType::pcurrent:
-        value = data.panelCurrent;
+    case Driver::external:
+        channel.external(static_cast<Output>(index), enable);
         break;
     }
+    deviceConfig.outputs[index].lastState = enable;
+    if (isPwm(index))
+    {
+        // The pin follows the ramp in loop
+        retarget(index);
+    }
+    _value.states[index] = enable;
+    notify(_value);
+}
 
-    RNG_DEBUGF("[OutputControl][%s] min %.2f, max %.2f, value %.2f\n", tag, output.min, output.max, value);
+bool OutputControl::isPwm(const uint8_t index) const
+{
+    return channels[index].driver == Driver::gpio && deviceConfig.outputs[index].pwm;
+}
 
-    if (value >= output.max)
+void OutputControl::retarget(const uint8_t index)
+{
+    Channel& channel = channels[index];
+    channel.ramp.setTarget(deviceConfig.outputs[index].lastState ? channel.level : 0, millis());
+}
+
+void OutputControl::handleOutput(const uint8_t index, const Renogy::Data& data)
+{
+    OutputConfig& output = deviceConfig.outputs[index];
+    Channel& channel = channels[index];
+    const char* tag = OUTPUTS[index].tag;
+
+    // The field only controls outputs driven with PWM, on/off outputs ignore it
+    const bool proportional = isPwm(index) && channel.pwmField != Renogy::Field::count;
+
+    bool requested = output.lastState;
+    if (!output.rule.isEmpty())
+    {
+        // An invalid rule is empty and keeps the output off
+        requested = channel.rule.evaluate(data, millis()) != output.inverted;
+    }
+    else if (output.inputType == InputType::disabled)
     {
-        const bool newState = !output.inverted;
-        if (output.lastState != newState)
+        if (channel.schedule.empty() && !proportional)
         {
-            // output.lastState = newState;
-            enable(newState);
-            RNG_DEBUGF("[OutputControl][%s] %.2f>=%.2f turned %s\n", tag, value, output.max, newState ? "on" : "off");
+            return;
         }
+        // Only the schedule or the proportional duty cycle controls the output
+        requested = true;
     }
-    else if (value < output.min)
+    else
     {
-        const bool newState = output.inverted;
-        if (output.lastState != newState)
+        float value = 0;
+        switch (output.inputType)
         {
-            // output.lastState = newState;
-            enable(newState);
-            RNG_DEBUGF("[OutputControl][%s] %.2f<%.2f turned %s\n", tag, value, output.min, newState ? "on" : "off");
+        case InputType::bsoc:
+            value = data.batteryCharge;
+            break;
+        case InputType::bvoltage:
+            value = data.batteryVoltage;
+            break;
+        case InputType::pvoltage:
+            value = data.panelVoltage;
+            break;
+        case InputType::pcurrent:
+            value = data.panelCurrent;
+            break;
         }
+
+        RNG_DEBUGF("[OutputControl][%s] min %.2f, max %.2f, value %.2f\n", tag, output.min, output.max, value);
+
+        // Between min and max the output keeps its state
+        if (value >= output.max)
+        {
+            requested = !output.inverted;
+        }
+        else if (value < output.min)
+        {
+            requested = output.inverted;
+        }
+    }
+
+    if (!channel.schedule.empty())
+    {
+        // Outside of the window, or without a synced clock, the output stays off
+        requested = requested && time.isSynced()
+            && channel.schedule.isActive(time.getUtcTime(), deviceConfig.getLocation());
+    }
+
+    if (proportional)
+    {
+        channel.level = PwmRamp::proportional(data.get(channel.pwmField), output.pwmLow, output.pwmHigh);
+        retarget(index);
+    }
+
+    const bool newState = channel.outputSwitch.update(requested, millis(), output.getLimits());
+    if (output.lastState != newState)
+    {
+        apply(index, newState);
+        RNG_DEBUGF("[OutputControl][%s] turned %s\n", tag, newState ? "on" : "off");
+    }
+    else if (requested != newState)
+    {
+        RNG_DEBUGF("[OutputControl][%s] switching %s held back\n", tag, requested ? "on" : "off");
     }
 }
\ No newline at end of file
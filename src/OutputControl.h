@@ -4,68 +4,121 @@
 
 #include "Config.h"
 #include "Observerable.h"
+#include "OutputRule.h"
+#include "OutputSwitch.h"
+#include "PwmRamp.h"
+#include "RNGTime.h"
 #include "Renogy.h"
+#include "Schedule.h"
+
+/// @brief Short alias of the output identifiers
+typedef DeviceConfig::Output Output;
 
 /// @brief Current output status
 struct OutputStatus
 {
-    bool out1 = false; /// The current state of output 1 (on=true, off=false)
-    bool out2 = false; /// The current state of output 2 (on=true, off=false)
-    bool out3 = false; /// The current state of output 3 (on=true, off=false)
+    bool states[DeviceConfig::OUTPUT_COUNT] = {}; /// The current state of each output (on=true, off=false)
+
+    /// @brief Get the current state of an output
+    bool get(const Output output) const { return states[static_cast<uint8_t>(output) % DeviceConfig::OUTPUT_COUNT]; }
 };
 
 /// @brief Class for controlling all outputs (Renogy Load output, out1, out2 and out3)
 ///
+/// Outputs are described by a table of drivers, control, status and command routing loop over it.
 class OutputControl : public Observerable<OutputStatus>
 {
 public:
+    /// @brief How an output is switched
+    enum class Driver : uint8_t
+    {
+        renogyLoad, /// Load output of the charge controller, switched via Modbus
+        gpio, /// Pin of the ESP
+        external, /// Handler registered with @ref setExternalDriver
+    };
+
+    /// @brief Handler switching an external output
+    typedef void (*ExternalDriver)(const Output output, const bool enable);
+
     /// @brief Construct a new Output Control object
     ///
     /// @param renogy Renogy controller
     /// @param deviceConfig Device config including output configs
-    OutputControl(Renogy& renogy, DeviceConfig& deviceConfig);
+    /// @param time Time source for schedules
+    OutputControl(Renogy& renogy, DeviceConfig& deviceConfig, RNGTime& time);
 
     /// @brief Update output states depending on individual OutputConfig
     ///
     /// @param data Latest Renogy data
     void update(const Renogy::Data& data);
 
-    /// @brief Control renogy load output
+    /// @brief Advance the soft-start ramps of PWM outputs, call as often as possible
+    void loop();
+
+    /// @brief Compile the rules of all outputs whose rule expression changed and reload the schedules
     ///
-    /// @param enable True to turn on, false to turn off
-    void enableLoad(const bool enable);
-    /// @brief Control RNGBridge output 1
+    /// Unchanged rules keep the state of their duration qualifiers.
+    void reconfigure();
+
+    /// @brief Switch an output manually, bypassing but counting towards its switching limits
     ///
+    /// @param output Output to switch
     /// @param enable True to turn on, false to turn off
-    void enableOut1(const bool enable);
-    /// @brief Control RNGBridge output 2
+    void enable(const Output output, const bool enable);
+
+    /// @brief Set the duty cycle of an output manually and switch it on, or off for 0 %
     ///
-    /// @param enable True to turn on, false to turn off
-    void enableOut2(const bool enable);
-    /// @brief Control RNGBridge output 3
+    /// The duty cycle applies until the config changes, outputs with a proportional field ignore it.
+    /// Outputs without PWM are simply switched on for any duty cycle above 0 %.
     ///
-    /// @param enable True to turn on, false to turn off
-    void enableOut3(const bool enable);
+    /// @param output Output to control
+    /// @param percent Duty cycle in percent
+    void setDuty(const Output output, const uint8_t percent);
+
+    /// @brief Switch an output with a handler instead of its built-in driver, e.g. for an I2C expander
+    ///
+    /// @param output Output to redirect
+    /// @param handler Handler switching the output, null to restore the built-in driver
+    void setExternalDriver(const Output output, ExternalDriver handler);
 
 private:
+    /// @brief Runtime state of an output
+    struct Channel
+    {
+        Driver driver; /// How the output is switched
+        uint8_t pin; /// Pin for Driver::gpio
+        ExternalDriver external = nullptr; /// Handler for Driver::external
+        OutputRule rule; /// Compiled rule, used instead of the setpoints if not empty
+        Schedule schedule; /// Time window, the output is only on within it if not empty
+        OutputSwitch outputSwitch; /// Anti-chatter state machine
+        PwmRamp ramp; /// Soft-start ramp for PWM outputs
+        uint8_t duty = 100; /// Duty cycle in percent while on, if not proportional
+        Renogy::Field pwmField = Renogy::Field::count; /// Field setting the duty cycle, count if none
+        uint16_t level = PwmRamp::RANGE; /// Level while on, from duty or pwmField
+    };
+
     /// @brief Handle output control for a given output
     ///
-    /// @param tag Debug tag
-    /// @param output Output configuration with setpoints
+    /// @param index Output index
     /// @param data Current renogy state data
-    /// @param enable Callback function for turning output on (passing true) or off (passing false)
-    void handleOutput(
-        const char* tag, OutputConfig& output, const Renogy::Data& data, std::function<void(const bool)> enable);
+    void handleOutput(const uint8_t index, const Renogy::Data& data);
 
-private:
-    constexpr static const uint8_t PIN_OUTPUT1 = D5; /// pin definition for first output control
-    constexpr static const uint8_t PIN_OUTPUT2 = D6; /// pin definition for second output control
-    constexpr static const uint8_t PIN_OUTPUT3 = D7; /// pin definition for third output control
+    /// @brief Drive an output and publish its new state
+    ///
+    /// @param index Output index
+    /// @param enable True to turn on, false to turn off
+    void apply(const uint8_t index, const bool enable);
+
+    /// @brief Check if an output is driven with PWM
+    bool isPwm(const uint8_t index) const;
 
+    /// @brief Update the ramp target of a PWM output from its state and level
+    void retarget(const uint8_t index);
+
+private:
+    Renogy& renogy; /// Controller driving the load output
     DeviceConfig& deviceConfig; /// Reference to device config including output config
+    RNGTime& time; /// Time source for schedules
 
-    std::function<void(const bool)> handleLoad; /// callback to control renogy load output
-    std::function<void(const bool)> handleOut1; /// callback to control RNGBridge output 1
-    std::function<void(const bool)> handleOut2; /// callback to control RNGBridge output 2
-    std::function<void(const bool)> handleOut3; /// callback to control RNGBridge output 3
+    Channel channels[DeviceConfig::OUTPUT_COUNT]; /// Runtime state of all outputs
 };
@@ -0,0 +1,356 @@
+#include "OutputRule.h"
+
+#include <cctype>
+#include <cstdlib>
+
+#include "Constants.h"
+
+namespace
+{
+    /// @brief Recursive descent parser emitting the postfix program
+    ///
+    /// expr := and ('||' and)*
+    /// and  := unary ('&&' unary)*
+    /// unary := '!'* term ['for' duration]
+    /// term := '(' expr ')' | field comparison number
+    class Parser
+    {
+    public:
+        Parser(const char* source, std::vector<OutputRule::Instruction>& program)
+            : source(source), pos(source), program(program)
+        {
+        }
+
+        /// @brief Parse the whole source
+        ///
+        /// @return true if the source is a single valid expression
+        bool parse() { return parseOr() && (skip(), *pos == '\0'); }
+
+        /// @brief Get the position of the last consumed character
+        size_t offset() const { return pos - source; }
+
+        /// @brief Get the number of duration qualifiers
+        uint8_t timerCount() const { return timers; }
+
+    private:
+        void skip()
+        {
+            while (isspace(static_cast<unsigned char>(*pos)))
+            {
+                ++pos;
+            }
+        }
+
+        bool accept(const char* token)
+        {
+            skip();
+            const size_t length = strlen(token);
+            if (strncmp(pos, token, length) != 0)
+            {
+                return false;
+            }
+            // Keywords must not be the prefix of a longer word
+            if (isalpha(static_cast<unsigned char>(token[0])) && isalnum(static_cast<unsigned char>(pos[length])))
+            {
+                return false;
+            }
+            pos += length;
+            return true;
+        }
+
+        bool emit(const OutputRule::Instruction& instruction, const int8_t stackChange)
+        {
+            depth += stackChange;
+            if (program.size() >= OutputRule::MAX_INSTRUCTIONS || depth > OutputRule::MAX_STACK)
+            {
+                return false;
+            }
+            program.push_back(instruction);
+            return true;
+        }
+
+        bool emit(const OutputRule::Op op, const int8_t stackChange)
+        {
+            OutputRule::Instruction instruction {};
+            instruction.op = op;
+            return emit(instruction, stackChange);
+        }
+
+        bool parseOr()
+        {
+            if (!parseAnd())
+            {
+                return false;
+            }
+            while (accept("||"))
+            {
+                if (!parseAnd() || !emit(OutputRule::Op::either, -1))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool parseAnd()
+        {
+            if (!parseUnary())
+            {
+                return false;
+            }
+            while (accept("&&"))
+            {
+                if (!parseUnary() || !emit(OutputRule::Op::both, -1))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool parseUnary()
+        {
+            // "!=" is only valid after a field, so a leading '!' is always a negation. Negations are counted instead of
+            // parsed recursively, so a long chain cannot exhaust the stack, and each pair cancels out.
+            bool negate = false;
+            while (accept("!"))
+            {
+                negate = !negate;
+            }
+            if (!parseTerm() || (accept("for") && !parseDuration()))
+            {
+                return false;
+            }
+            return !negate || emit(OutputRule::Op::negate, 0);
+        }
+
+        bool parseTerm()
+        {
+            if (accept("("))
+            {
+                if (++nesting > OutputRule::MAX_NESTING || !parseOr() || !accept(")"))
+                {
+                    return false;
+                }
+                --nesting;
+                return true;
+            }
+            return parseComparison();
+        }
+
+        bool parseComparison()
+        {
+            skip();
+            char name[16];
+            size_t length = 0;
+            while (isalpha(static_cast<unsigned char>(pos[length])) && length < sizeof(name) - 1)
+            {
+                name[length] = pos[length];
+                ++length;
+            }
+            name[length] = '\0';
+            const Renogy::Field field = Renogy::fieldFromName(name);
+            if (length == 0 || field == Renogy::Field::count)
+            {
+                return false;
+            }
+            pos += length;
+
+            OutputRule::Instruction instruction {};
+            instruction.op = OutputRule::Op::compare;
+            instruction.index = static_cast<uint8_t>(field);
+            // Longer operators first, "<" would also match "<="
+            if (accept("<="))
+            {
+                instruction.comparison = OutputRule::Comparison::lessEqual;
+            }
+            else if (accept(">="))
+            {
+                instruction.comparison = OutputRule::Comparison::greaterEqual;
+            }
+            else if (accept("=="))
+            {
+                instruction.comparison = OutputRule::Comparison::equal;
+            }
+            else if (accept("!="))
+            {
+                instruction.comparison = OutputRule::Comparison::notEqual;
+            }
+            else if (accept("<"))
+            {
+                instruction.comparison = OutputRule::Comparison::less;
+            }
+            else if (accept(">"))
+            {
+                instruction.comparison = OutputRule::Comparison::greater;
+            }
+            else
+            {
+                return false;
+            }
+
+            skip();
+            char* end;
+            instruction.threshold = strtof(pos, &end);
+            if (end == pos)
+            {
+                return false;
+            }
+            pos = end;
+            return emit(instruction, 1);
+        }
+
+        bool parseDuration()
+        {
+            skip();
+            char* end;
+            const unsigned long value = strtoul(pos, &end, 10);
+            if (end == pos || *pos == '-')
+            {
+                return false;
+            }
+            pos = end;
+
+            uint32_t scale = 1000;
+            if (accept("ms"))
+            {
+                scale = 1;
+            }
+            else if (accept("s"))
+            {
+                scale = 1000;
+            }
+            else if (accept("m"))
+            {
+                scale = 60000;
+            }
+            else if (accept("h"))
+            {
+                scale = 3600000;
+            }
+            if (value > OutputRule::MAX_DURATION_MS / scale)
+            {
+                return false;
+            }
+
+            OutputRule::Instruction instruction {};
+            instruction.op = OutputRule::Op::hold;
+            instruction.index = timers++;
+            instruction.duration = value * scale;
+            return emit(instruction, 0);
+        }
+
+    private:
+        const char* source; /// Start of the source
+        const char* pos; /// Current position in the source
+        std::vector<OutputRule::Instruction>& program; /// Program to append to
+        int8_t depth = 0; /// Stack depth after the emitted instructions
+        uint8_t nesting = 0; /// Current parenthesis nesting
+        uint8_t timers = 0; /// Number of emitted Op::hold instructions
+    };
+} // namespace
+
+bool OutputRule::compile(const char* source)
+{
+    program.clear();
+    timers.clear();
+    this->source = "";
+    errorOffset = 0;
+    if (!source || *source == '\0')
+    {
+        return true;
+    }
+
+    Parser parser(source, program);
+    if (!parser.parse())
+    {
+        errorOffset = parser.offset();
+        program.clear();
+        RNG_DEBUGF("[OutputRule] Invalid rule at %u: %s\n", static_cast<unsigned>(errorOffset), source);
+        return false;
+    }
+    program.shrink_to_fit();
+    timers.resize(parser.timerCount());
+    this->source = source;
+    return true;
+}
+
+bool OutputRule::verify(const char* source)
+{
+    OutputRule rule;
+    return rule.compile(source);
+}
+
+bool OutputRule::evaluate(const Renogy::Data& data, const uint32_t now)
+{
+    if (program.empty())
+    {
+        return false;
+    }
+
+    // Every instruction is executed on each call instead of short-circuiting, so all timers see every sample
+    uint32_t stack = 0;
+    for (const Instruction& instruction : program)
+    {
+        switch (instruction.op)
+        {
+        case Op::compare:
+        {
+            const float value = data.get(static_cast<Renogy::Field>(instruction.index));
+            bool result = false;
+            switch (instruction.comparison)
+            {
+            case Comparison::less:
+                result = value < instruction.threshold;
+                break;
+            case Comparison::lessEqual:
+                result = value <= instruction.threshold;
+                break;
+            case Comparison::greater:
+                result = value > instruction.threshold;
+                break;
+            case Comparison::greaterEqual:
+                result = value >= instruction.threshold;
+                break;
+            case Comparison::equal:
+                result = value == instruction.threshold;
+                break;
+            case Comparison::notEqual:
+                result = value != instruction.threshold;
+                break;
+            }
+            stack = (stack << 1) | result;
+            break;
+        }
+        case Op::both:
+            stack = (stack >> 1) & (stack | ~1u);
+            break;
+        case Op::either:
+            stack = (stack >> 1) | (stack & 1);
+            break;
+        case Op::negate:
+            stack ^= 1;
+            break;
+        case Op::hold:
+        {
+            Timer& timer = timers[instruction.index];
+            if (!(stack & 1))
+            {
+                timer.running = false;
+                break;
+            }
+            if (!timer.running)
+            {
+                timer.running = true;
+                timer.since = now;
+            }
+            if (now - timer.since < instruction.duration)
+            {
+                stack &= ~1u;
+            }
+            break;
+        }
+        }
+    }
+    return stack & 1;
+}
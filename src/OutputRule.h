@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+
+#include "Renogy.h"
+
+/// @brief Output condition compiled from a small expression language
+///
+/// A rule compares fields of @ref Renogy::Data (named as in @ref Renogy::fieldName) against numbers with `<`, `<=`,
+/// `>`, `>=`, `==` or `!=`. Comparisons can be combined with `&&`, `||`, `!` and parentheses, `&&` binds stronger
+/// than `||`. A comparison or parenthesized term followed by `for <n>[ms|s|m|h]` is only true once it has been true
+/// for the whole duration, e.g. `bsoc > 90 && pvoltage > 18 for 60s`.
+///
+/// The rule is compiled once into a flat postfix program, evaluating it does not allocate.
+class OutputRule
+{
+public:
+    constexpr static const uint8_t MAX_INSTRUCTIONS = 32; /// Longest program
+    constexpr static const uint8_t MAX_STACK = 32; /// Deepest evaluation stack, stored as bitmask
+    constexpr static const uint8_t MAX_NESTING = 8; /// Deepest parenthesis nesting
+    constexpr static const uint32_t MAX_DURATION_MS = 86400000; /// Longest duration qualifier
+
+    /// @brief Operation of an instruction
+    enum class Op : uint8_t
+    {
+        compare, /// Push the comparison of a field against the threshold
+        both, /// Pop two values, push true if both are true
+        either, /// Pop two values, push true if any is true
+        negate, /// Invert the top value
+        hold, /// Replace the top value with true once it has been true for the duration
+    };
+
+    /// @brief Comparison of a @ref Op::compare instruction
+    enum class Comparison : uint8_t
+    {
+        less,
+        lessEqual,
+        greater,
+        greaterEqual,
+        equal,
+        notEqual,
+    };
+
+    /// @brief Single instruction of the compiled program
+    struct Instruction
+    {
+        Op op;
+        Comparison comparison; /// Comparison for Op::compare
+        uint8_t index; /// Field for Op::compare, timer for Op::hold
+        union
+        {
+            float threshold; /// Threshold for Op::compare
+            uint32_t duration; /// Duration in ms for Op::hold
+        };
+    };
+
+    /// @brief Compile a rule, replacing the current program
+    ///
+    /// On failure the rule is left empty.
+    ///
+    /// @param source Rule expression, empty to clear the rule
+    /// @return true if the expression is valid
+    bool compile(const char* source);
+
+    /// @brief Check if a rule expression is valid without keeping the program
+    ///
+    /// @param source Rule expression
+    /// @return true if the expression is valid or empty
+    static bool verify(const char* source);
+
+    /// @brief Check if there is no program
+    bool empty() const { return program.empty(); }
+
+    /// @brief Get the expression the current program was compiled from
+    const String& getSource() const { return source; }
+
+    /// @brief Get the position where the last compile failed
+    ///
+    /// @return Offset into the source
+    size_t getErrorOffset() const { return errorOffset; }
+
+    /// @brief Evaluate the rule, must be called for every sample to keep duration qualifiers accurate
+    ///
+    /// @param data Latest Renogy data
+    /// @param now Current time in ms
+    /// @return Result of the expression, false if empty
+    bool evaluate(const Renogy::Data& data, const uint32_t now);
+
+private:
+    /// @brief State of a duration qualifier
+    struct Timer
+    {
+        uint32_t since = 0; /// Time in ms the term became true
+        bool running = false; /// The term is currently true
+    };
+
+    String source; /// Expression the program was compiled from
+    std::vector<Instruction> program; /// Compiled postfix program
+    std::vector<Timer> timers; /// One timer per Op::hold instruction
+    size_t errorOffset = 0; /// Position where the last compile failed
+};
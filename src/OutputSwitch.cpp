@@ -0,0 +1,66 @@
+#include "OutputSwitch.h"
+
+bool OutputSwitch::update(const bool requested, const uint32_t now, const Limits& limits)
+{
+    if (requested == state)
+    {
+        pending = false;
+        return state;
+    }
+    if (!pending)
+    {
+        pending = true;
+        pendingSince = now;
+    }
+
+    if (now - pendingSince < limits.settleTime)
+    {
+        return state;
+    }
+    const uint32_t minTime = state ? limits.minOnTime : limits.minOffTime;
+    if (switched && now - lastSwitch < minTime)
+    {
+        return state;
+    }
+    if (rateLimited(now, limits.maxSwitchesPerHour))
+    {
+        return state;
+    }
+
+    apply(requested, now);
+    return state;
+}
+
+void OutputSwitch::force(const bool newState, const uint32_t now)
+{
+    if (newState != state)
+    {
+        apply(newState, now);
+    }
+}
+
+bool OutputSwitch::rateLimited(const uint32_t now, const uint8_t limit) const
+{
+    const uint8_t window = limit < MAX_SWITCHES_PER_HOUR ? limit : MAX_SWITCHES_PER_HOUR;
+    if (window == 0 || historyCount < window)
+    {
+        return false;
+    }
+    // The window-th latest switch must have left the hour before another one is allowed
+    const uint8_t index = (historyNext + MAX_SWITCHES_PER_HOUR - window) % MAX_SWITCHES_PER_HOUR;
+    return now - history[index] < HOUR_MS;
+}
+
+void OutputSwitch::apply(const bool newState, const uint32_t now)
+{
+    state = newState;
+    pending = false;
+    switched = true;
+    lastSwitch = now;
+    history[historyNext] = now;
+    historyNext = (historyNext + 1) % MAX_SWITCHES_PER_HOUR;
+    if (historyCount < MAX_SWITCHES_PER_HOUR)
+    {
+        ++historyCount;
+    }
+}
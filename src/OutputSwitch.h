@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+
+/// @brief Anti-chatter state machine deciding when an output may actually switch
+///
+/// The requested state has to stay unchanged for the settle time. After that the output only switches if it
+/// has been in its current state for the minimum on or off time, and the number of switches within the last
+/// hour is below the limit. All times are passed in, so the machine runs on any clock.
+class OutputSwitch
+{
+public:
+    constexpr static const uint8_t MAX_SWITCHES_PER_HOUR = 16; /// Highest supported switch rate limit
+    constexpr static const uint32_t HOUR_MS = 3600000; /// Window of the switch rate limit
+
+    /// @brief Switching limits, zero disables a limit
+    struct Limits
+    {
+        uint32_t minOnTime; /// Minimum time in ms the output stays on
+        uint32_t minOffTime; /// Minimum time in ms the output stays off
+        uint32_t settleTime; /// Time in ms the requested state has to be stable
+        uint8_t maxSwitchesPerHour; /// Maximum number of switches within an hour, at most MAX_SWITCHES_PER_HOUR
+    };
+
+    /// @brief Request a state
+    ///
+    /// @param requested State the output should have
+    /// @param now Current time in ms
+    /// @param limits Switching limits
+    /// @return State the output should be set to
+    bool update(const bool requested, const uint32_t now, const Limits& limits);
+
+    /// @brief Record a switch which bypassed the limits, e.g. a manual command
+    ///
+    /// @param newState New state of the output
+    /// @param now Current time in ms
+    void force(const bool newState, const uint32_t now);
+
+    /// @brief Get the current state of the output
+    bool getState() const { return state; }
+
+private:
+    /// @brief Check if another switch would exceed the rate limit
+    bool rateLimited(const uint32_t now, const uint8_t limit) const;
+
+    /// @brief Switch the output and record the time
+    void apply(const bool newState, const uint32_t now);
+
+private:
+    bool state = false; /// Current output state
+    bool pending = false; /// The requested state differs from the current state
+    bool switched = false; /// The output switched at least once, lastSwitch is valid
+    uint32_t pendingSince = 0; /// Time in ms the requested state started to differ
+    uint32_t lastSwitch = 0; /// Time in ms of the last switch
+    uint32_t history[MAX_SWITCHES_PER_HOUR] = {}; /// Times in ms of the latest switches, ring buffer
+    uint8_t historyNext = 0; /// Next index to write in history
+    uint8_t historyCount = 0; /// Number of valid entries in history
+};
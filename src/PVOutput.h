@@ -93,6 +93,15 @@ public:
     /// Tries to get the status interval from PVOutput and if it is valid syncs the time and sets _started true
     void start();
 
+    ///@brief Apply a changed config without restarting
+    ///
+    /// Updates the time offset and starts again with the new system on the next @ref loop
+    void reconfigure()
+    {
+        _time.setTimeOffset(_config.timeOffset * 3600);
+        _started = false;
+    }
+
     ///@brief Updates the internal state
     ///
     /// Uploads data to PVOutput and resets counters
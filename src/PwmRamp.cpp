@@ -0,0 +1,59 @@
+#include "PwmRamp.h"
+
+uint16_t PwmRamp::proportional(const float value, const float low, const float high)
+{
+    if (low == high)
+    {
+        return value >= high ? RANGE : 0;
+    }
+    const float ratio = (value - low) / (high - low);
+    if (!(ratio > 0))
+    {
+        // Also catches NaN
+        return 0;
+    }
+    if (ratio >= 1)
+    {
+        return RANGE;
+    }
+    return static_cast<uint16_t>(ratio * RANGE + 0.5f);
+}
+
+uint16_t PwmRamp::fromPercent(const uint8_t percent)
+{
+    return percent >= 100 ? RANGE : percent * (RANGE / 100);
+}
+
+void PwmRamp::setTarget(const uint16_t newTarget, const uint32_t now)
+{
+    if (newTarget > level && target <= level)
+    {
+        // Start ramping from now, not from the last time the level settled
+        lastStep = now;
+    }
+    target = newTarget > RANGE ? RANGE : newTarget;
+}
+
+bool PwmRamp::update(const uint32_t now, const uint16_t rampTime)
+{
+    if (level == target)
+    {
+        return false;
+    }
+    if (target < level || rampTime == 0)
+    {
+        level = target;
+        lastStep = now;
+        return true;
+    }
+
+    // Only advance once at least one step is due, so short loop intervals do not round the ramp to zero
+    const uint32_t steps = static_cast<uint64_t>(now - lastStep) * RANGE / rampTime;
+    if (steps == 0)
+    {
+        return false;
+    }
+    lastStep += static_cast<uint64_t>(steps) * rampTime / RANGE;
+    level = steps >= static_cast<uint32_t>(target - level) ? target : level + steps;
+    return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+/// @brief Control law of a PWM output: proportional duty cycle and soft-start ramp
+///
+/// The waveform itself is generated by the timer driven analogWrite of the core, this class only decides the
+/// level. Rising levels ramp up over the ramp time, falling levels apply immediately so a load can always be shed
+/// right away. All times are passed in, so the ramp runs on any clock.
+class PwmRamp
+{
+public:
+    constexpr static const uint16_t RANGE = 1000; /// Level of 100 % duty cycle
+
+    /// @brief Map a value linearly onto the duty cycle range
+    ///
+    /// Setting low above high inverts the mapping.
+    ///
+    /// @param value Input value, e.g. the battery voltage
+    /// @param low Value at 0 % duty cycle
+    /// @param high Value at 100 % duty cycle
+    /// @return Level in [0, RANGE]
+    static uint16_t proportional(const float value, const float low, const float high);
+
+    /// @brief Convert a duty cycle in percent into a level
+    ///
+    /// @param percent Duty cycle in percent, values above 100 are limited
+    /// @return Level in [0, RANGE]
+    static uint16_t fromPercent(const uint8_t percent);
+
+    /// @brief Set the level to ramp to
+    ///
+    /// @param level Target level in [0, RANGE]
+    /// @param now Current time in ms
+    void setTarget(const uint16_t level, const uint32_t now);
+
+    /// @brief Advance the ramp
+    ///
+    /// @param now Current time in ms
+    /// @param rampTime Time in ms to ramp from 0 to 100 %, 0 to switch immediately
+    /// @return true if the level changed
+    bool update(const uint32_t now, const uint16_t rampTime);
+
+    /// @brief Get the current level
+    uint16_t getLevel() const { return level; }
+
+    /// @brief Get the target level
+    uint16_t getTarget() const { return target; }
+
+private:
+    uint16_t level = 0; /// Current level
+    uint16_t target = 0; /// Level to ramp to
+    uint32_t lastStep = 0; /// Time in ms the ramp last advanced
+};
@@ -10,6 +10,7 @@
 #include "PVOutput.h"
 #include "RNGTime.h"
 #include "Renogy.h"
+#include "Scheduler.h"
 
 // 60 requests per hour.
 // 300 requests per hour in donation mode.
@@ -26,8 +27,6 @@
 
 constexpr static const uint8_t LED = D1;
 
-uint8_t lastSecond = 0; /// The last seconds value
-uint8_t secondsPassedRenogy = 0; /// amount of seconds passed
 
 // DoubleResetDetector* drd;
 RNGTime _time;
@@ -39,6 +38,80 @@ Renogy* renogy;
 OutputControl* outputs;
 Networking networking(config);
 GUI gui;
+Scheduler scheduler;
+
+Scheduler::TaskId pollTask; /// Reads the controller
+Scheduler::TaskId mqttTask; /// Runs the MQTT client and publishes queued messages
+Scheduler::TaskId guiTask; /// Serializes the GUI status
+Scheduler::TaskId networkTask; /// Serves DNS and pushes status patches
+
+/// @brief Create the mqtt client according to the config
+void startMqtt()
+{
+    mqtt = new Mqtt(config, *outputs, _time);
+    mqtt->observe([](const String& status) { gui.updateMQTTStatus(status); });
+    mqtt->setPollHandler([]() { scheduler.trigger(pollTask); });
+}
+
+/// @brief Create the PVOutput uploader according to the config
+void startPVOutput()
+{
+    pvo = new PVOutput(config.getPvoutputConfig(), _time);
+    pvo->observe([](const String& status) { gui.updatePVOutputStatus(status); });
+    pvo->start();
+}
+
+/// @brief Once per second housekeeping: time, config changes and update checks
+void runSystem()
+{
+    // Signal start of work
+    digitalWrite(LED, HIGH);
+
+    _time.loop();
+
+    config.update();
+
+    const uint32_t timeS = millis() / 1000;
+    if (timeS % 5 == 0)
+    {
+        RNG_DEBUG(F("[System] Uptime: "));
+        RNG_DEBUGLN(timeS);
+    }
+
+    if (ota)
+    {
+        ota->loop();
+
+        // Check for software updates once a day after midnight, this task may not run in that exact second
+        static uint32_t checkedDay = 0;
+        const uint32_t day = _time.getEpochTime() / 86400;
+        if (_time.isSynced() && day != checkedDay)
+        {
+            // The check at startup covers the first day
+            if (checkedDay)
+            {
+                ota->checkForUpdate();
+            }
+            checkedDay = day;
+        }
+    }
+
+    // Signal end of work
+    digitalWrite(LED, LOW);
+}
+
+/// @brief Serialize the GUI status and push it to the clients right away if it changed
+void runGui()
+{
+    const uint32_t sequence = GUI::sequence;
+    gui.updateUptime(millis() / 1000);
+    gui.updateHeap(ESP.getFreeHeap());
+    gui.update();
+    if (GUI::sequence != sequence)
+    {
+        scheduler.trigger(networkTask);
+    }
+}
 
 void setup()
 {
@@ -72,8 +145,8 @@ void setup()
 
     DeviceConfig& deviceConfig = config.getDeviceConfig();
     renogy = new Renogy(Serial, deviceConfig.address);
-    outputs = new OutputControl(*renogy, config.getDeviceConfig());
-    networking.init(*outputs);
+    outputs = new OutputControl(*renogy, config.getDeviceConfig(), _time);
+    networking.init(*outputs, scheduler);
     // Last will of mqtt won't work this way
     // networking.setRebootHandler([]() {
     //     if (mqtt)
@@ -91,12 +164,9 @@ void setup()
         ota->checkForUpdate();
 
         // MQTT setup
-        const MqttConfig& mqttConfig = config.getMqttConfig();
-        if (mqttConfig.enabled)
+        if (config.getMqttConfig().enabled)
         {
-            mqtt = new Mqtt(mqttConfig, *outputs);
-            mqtt->observe([](const String& status) { gui.updateMQTTStatus(status); });
-            mqtt->connect();
+            startMqtt();
         }
         else
         {
@@ -104,12 +174,9 @@ void setup()
         }
 
         // PVOutput setup
-        const PVOutputConfig& pvoConfig = config.getPvoutputConfig();
-        if (pvoConfig.enabled)
+        if (config.getPvoutputConfig().enabled)
         {
-            pvo = new PVOutput(pvoConfig, _time);
-            pvo->observe([](const String& status) { gui.updatePVOutputStatus(status); });
-            pvo->start();
+            startPVOutput();
         }
         else
         {
@@ -117,24 +184,95 @@ void setup()
         }
     }
 
+    // Apply config changes in place, wifi changes restart instead
+    config.onChange(Config::Section::mqtt, []() {
+        if (mqtt)
+        {
+            mqtt->reconfigure();
+        }
+        else if (config.getMqttConfig().enabled && config.getNetworkConfig().clientEnabled)
+        {
+            startMqtt();
+        }
+    });
+    config.onChange(Config::Section::pvo, []() {
+        if (pvo && !config.getPvoutputConfig().enabled)
+        {
+            delete pvo;
+            pvo = nullptr;
+            gui.updatePVOutputStatus("Disabled");
+        }
+        else if (pvo)
+        {
+            pvo->reconfigure();
+        }
+        else if (config.getPvoutputConfig().enabled && config.getNetworkConfig().clientEnabled)
+        {
+            startPVOutput();
+        }
+    });
+    config.onChange(Config::Section::dev, []() {
+        renogy->setAddress(config.getDeviceConfig().address);
+        scheduler.setPeriod(pollTask, config.getDeviceConfig().pollInterval);
+        // Apply new output thresholds and rules right away instead of at the next poll
+        outputs->reconfigure();
+        outputs->update(renogy->_data);
+    });
+
     renogy->setListener([&](const Renogy::Data& data) {
-        if (pvo)
+        // The PVOutput averages are sized for one sample every RENOGY_INTERVAL, whatever the poll interval
+        static uint32_t pvoSampledAt = 0;
+        if (pvo && millis() - pvoSampledAt >= RENOGY_INTERVAL * 1000)
         {
+            pvoSampledAt = millis();
             pvo->updateData(data);
         }
 
         outputs->update(data);
 
         gui.updateRenogyStatus(data);
+        networking.updateRenogyData(data);
 
         if (mqtt)
         {
             mqtt->updateRenogyStatus(data);
+            // Publish right away instead of with the next periodic run
+            scheduler.trigger(mqttTask);
         }
+        scheduler.trigger(guiTask);
     });
 
     outputs->observe([](const OutputStatus status) { gui.updateOutputStatus(status); });
 
+    // Phases spread the periodic work across the second, budgets only flag slow tasks in the statistics
+    scheduler.add("outputs", []() { outputs->loop(); }, 10, 0, Scheduler::Priority::high, 500);
+    pollTask = scheduler.add(
+        "poll", []() { renogy->readAndProcessData(); }, deviceConfig.pollInterval, 100, Scheduler::Priority::high,
+        300000);
+    scheduler.add("system", runSystem, 1000, 0, Scheduler::Priority::normal, 5000);
+    mqttTask = scheduler.add(
+        "mqtt",
+        []() {
+            if (mqtt)
+            {
+                mqtt->loop();
+            }
+        },
+        250, 300, Scheduler::Priority::normal, 20000);
+    guiTask = scheduler.add("gui", runGui, 1000, 600, Scheduler::Priority::normal, 10000);
+    networkTask = scheduler.add(
+        "network", []() { networking.update(); }, 1000, 800, Scheduler::Priority::normal, 10000);
+    // Uploads block for a while, everything else goes first
+    scheduler.add(
+        "pvo",
+        []() {
+            if (pvo)
+            {
+                pvo->loop();
+            }
+        },
+        1000, 500, Scheduler::Priority::low, 2000000);
+
     // drd->stop();
     // delete drd;
 
@@ -144,61 +282,7 @@ void setup()
 
 void loop()
 {
-    const uint32_t timeS = millis() / 1000;
-    const uint8_t currentSecond = timeS % 60;
-
-    if (currentSecond != lastSecond)
-    {
-        // Signal start of work
-        digitalWrite(LED, HIGH);
-        lastSecond = currentSecond;
-
-        _time.loop();
-
-        if (currentSecond % 5 == 0)
-        {
-            RNG_DEBUG(F("[System] Uptime: "));
-            RNG_DEBUGLN(timeS);
-        }
-
-        ++secondsPassedRenogy;
-        if (secondsPassedRenogy >= RENOGY_INTERVAL)
-        {
-            secondsPassedRenogy = 0;
-            // Read and process data every 2 seconds
-            renogy->readAndProcessData();
-        }
-
-        if (mqtt)
-        {
-            mqtt->loop();
-        }
-
-        if (pvo)
-        {
-            pvo->loop();
-        }
-
-        if (ota)
-        {
-            ota->loop();
-
-            // Check for software updates every day at midnight
-            if (_time.getEpochTime() % 86400 == 0)
-            {
-                ota->checkForUpdate();
-            }
-        }
-
-        gui.updateUptime(timeS);
-        gui.updateHeap(ESP.getFreeHeap());
-        gui.update();
-
-        networking.update();
-
-        // Signal end of work
-        digitalWrite(LED, LOW);
-    }
+    scheduler.loop();
 
     // handle wifi or whatever the esp is doing
     // yield();
@@ -31,6 +31,11 @@ uint32_t RNGTime::getEpochTime() const
     return sntp_get_current_timestamp() + _offsetS;
 }
 
+uint32_t RNGTime::getUtcTime() const
+{
+    return sntp_get_current_timestamp();
+}
+
 struct tm RNGTime::getTmTime() const
 {
     time_t epoch = getEpochTime();
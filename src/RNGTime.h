@@ -19,6 +19,11 @@ public:
     /// @return time in seconds since Jan. 1, 1970
     uint32_t getEpochTime() const;
 
+    /// @brief Get the epoch time without offset
+    ///
+    /// @return UTC time in seconds since Jan. 1, 1970
+    uint32_t getUtcTime() const;
+
     /// @brief Get the current time as tm (with corrected year and month)
     ///
     /// @return struct tm
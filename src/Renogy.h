@@ -8,6 +8,40 @@
 class Renogy
 {
 public:
+    /// @brief Identifiers of the values contained in @ref Data
+    enum class Field : uint8_t
+    {
+        batteryCharge,
+        batteryVoltage,
+        batteryCurrent,
+        batteryTemperature,
+        consumption,
+        generation,
+        total,
+        loadVoltage,
+        loadCurrent,
+        loadEnabled,
+        panelVoltage,
+        panelCurrent,
+        chargingState,
+        errorState,
+        controllerTemperature,
+        count, /// Number of fields, not a field itself
+    };
+    constexpr static const uint8_t FIELD_COUNT = static_cast<uint8_t>(Field::count); /// Number of fields
+
+    /// @brief Get the short name of a field as used in configs and APIs (e.g. `bsoc`, `pvoltage`)
+    ///
+    /// @param field Field identifier
+    /// @return Name stored in flash
+    static const __FlashStringHelper* fieldName(const Field field);
+
+    /// @brief Get the field with the given short name
+    ///
+    /// @param name Short name of the field
+    /// @return Field identifier or Field::count if there is no field with the name
+    static Field fieldFromName(const char* name);
+
     /// @brief Contains data retreived from charge controller
     struct Data
     {
@@ -30,6 +64,12 @@ public:
         float panelCurrent = 0.0f; /// Solar panel current in Ampere
 
         bool loadEnabled = false; /// Load output enabled state, true=enabled, false=disabled
+
+        /// @brief Get the value of a single field
+        ///
+        /// @param field Field identifier
+        /// @return Value of the field, booleans are returned as 0 or 1
+        double get(const Field field) const;
     } _data;
 
     /// @brief Callback definition for data listener
@@ -39,7 +79,7 @@ public:
     /// @brief Construct a new Renogy object
     /// @param serial Hardware Serial for ModBus communication
     /// @param address Modbus device address
-    Renogy(HardwareSerial& serial, const uint8_t address)
+    Renogy(HardwareSerial& serial, const uint8_t address) : _serial(serial)
     {
         serial.setTimeout(100);
         // Modbus at 9600 baud
@@ -65,6 +105,11 @@ public:
     /// @brief Read and process the modbus data
     void readAndProcessData();
 
+    /// @brief Change the modbus address of the controller
+    ///
+    /// @param address Modbus device address
+    void setAddress(const uint8_t address) { _modbus.begin(address, _serial); }
+
     /// @brief Enable or disable the load output of the controller
     ///
     /// @param enable True to enable, false to disable load output
@@ -78,6 +123,7 @@ public:
     void readModel();
 
 private:
+    HardwareSerial& _serial; /// Serial the controller is connected to
     ModbusMaster _modbus;
     DataListener _listener;
     String model = "";
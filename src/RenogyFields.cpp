@@ -0,0 +1,66 @@
+#include "Renogy.h"
+
+namespace
+{
+    /// Short field names, in the order of Renogy::Field
+    const char FIELD_NAMES[Renogy::FIELD_COUNT][14] PROGMEM = {"bsoc", "bvoltage", "bcurrent", "btemperature",
+        "consumption", "generation", "total", "lvoltage", "lcurrent", "lenabled", "pvoltage", "pcurrent", "cstate",
+        "cerror", "ctemperature"};
+} // namespace
+
+const __FlashStringHelper* Renogy::fieldName(const Field field)
+{
+    return FPSTR(FIELD_NAMES[static_cast<uint8_t>(field) % FIELD_COUNT]);
+}
+
+Renogy::Field Renogy::fieldFromName(const char* name)
+{
+    for (uint8_t i = 0; i < FIELD_COUNT; ++i)
+    {
+        if (strcmp_P(name, FIELD_NAMES[i]) == 0)
+        {
+            return static_cast<Field>(i);
+        }
+    }
+    return Field::count;
+}
+
+double Renogy::Data::get(const Field field) const
+{
+    switch (field)
+    {
+    case Field::batteryCharge:
+        return batteryCharge;
+    case Field::batteryVoltage:
+        return batteryVoltage;
+    case Field::batteryCurrent:
+        return batteryCurrent;
+    case Field::batteryTemperature:
+        return batteryTemperature;
+    case Field::consumption:
+        return consumption;
+    case Field::generation:
+        return generation;
+    case Field::total:
+        return total;
+    case Field::loadVoltage:
+        return loadVoltage;
+    case Field::loadCurrent:
+        return loadCurrent;
+    case Field::loadEnabled:
+        return loadEnabled ? 1 : 0;
+    case Field::panelVoltage:
+        return panelVoltage;
+    case Field::panelCurrent:
+        return panelCurrent;
+    case Field::chargingState:
+        return chargingState;
+    case Field::errorState:
+        return errorState;
+    case Field::controllerTemperature:
+        return controllerTemperature;
+    case Field::count:
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,243 @@
+#include "Schedule.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace
+{
+    constexpr const uint32_t DAY_S = 86400; /// Seconds per day
+    constexpr const int16_t MAX_OFFSET_MINUTES = 720; /// Largest offset relative to the sun
+    constexpr const float SUN_ZENITH = 90.833f; /// Zenith at sunrise and sunset, including refraction
+    constexpr const float CIVIL_ZENITH = 96.0f; /// Zenith at civil dawn and dusk
+    constexpr const float DEG_TO_RAD = M_PI / 180.0f;
+    constexpr const float RAD_TO_DEG = 180.0f / M_PI;
+
+    /// Names of Schedule::Base, in enum order starting with sunrise
+    constexpr const char* SUN_EVENTS[] = {"sunrise", "sunset", "dawn", "dusk"};
+
+    /// @brief Wrap an angle or hour into [0, range)
+    float wrap(const float value, const float range)
+    {
+        const float result = fmodf(value, range);
+        return result < 0 ? result + range : result;
+    }
+} // namespace
+
+bool Schedule::set(const char* startText, const char* endText, const uint8_t dayMask)
+{
+    enabled = false;
+    invalidate();
+    if (!startText || *startText == '\0')
+    {
+        return true;
+    }
+    if (!parse(startText, start) || !parse(endText, end))
+    {
+        return false;
+    }
+    days = dayMask & ALL_DAYS;
+    enabled = true;
+    return true;
+}
+
+bool Schedule::verify(const char* text)
+{
+    Edge edge;
+    return text && (*text == '\0' || parse(text, edge));
+}
+
+bool Schedule::verifyWindow(const char* start, const char* end)
+{
+    if (!start || !end)
+    {
+        return false;
+    }
+    Edge edge;
+    return (*start == '\0' && *end == '\0') || (parse(start, edge) && parse(end, edge));
+}
+
+bool Schedule::parse(const char* text, Edge& edge)
+{
+    if (!text)
+    {
+        return false;
+    }
+
+    char* next;
+    for (uint8_t i = 0; i < sizeof(SUN_EVENTS) / sizeof(SUN_EVENTS[0]); ++i)
+    {
+        const size_t length = strlen(SUN_EVENTS[i]);
+        if (strncmp(text, SUN_EVENTS[i], length) != 0)
+        {
+            continue;
+        }
+        edge.base = static_cast<Base>(i + 1);
+        edge.minutes = 0;
+        text += length;
+        if (*text == '\0')
+        {
+            return true;
+        }
+        if (*text != '+' && *text != '-')
+        {
+            return false;
+        }
+        const long offset = strtol(text, &next, 10);
+        if (next == text + 1 || *next != '\0' || offset < -MAX_OFFSET_MINUTES || offset > MAX_OFFSET_MINUTES)
+        {
+            return false;
+        }
+        edge.minutes = offset;
+        return true;
+    }
+
+    // HH:MM
+    if (*text < '0' || *text > '9')
+    {
+        return false;
+    }
+    const long hours = strtol(text, &next, 10);
+    if (*next != ':' || hours > 23)
+    {
+        return false;
+    }
+    text = next + 1;
+    if (*text < '0' || *text > '9')
+    {
+        return false;
+    }
+    const long minutes = strtol(text, &next, 10);
+    if (*next != '\0' || next - text != 2 || minutes > 59)
+    {
+        return false;
+    }
+    edge.base = Base::clock;
+    edge.minutes = hours * 60 + minutes;
+    return true;
+}
+
+bool Schedule::isActive(const uint32_t utc, const Location& location)
+{
+    if (!enabled)
+    {
+        return false;
+    }
+    if (utc < nextChange)
+    {
+        return active;
+    }
+
+    const time_t local = static_cast<int64_t>(utc) + location.utcOffset;
+    struct tm date;
+    gmtime_r(&local, &date);
+    const uint32_t second = local % DAY_S;
+    const int64_t dayStart = local - second;
+    const uint16_t today = date.tm_yday + 1;
+    const uint16_t yesterday = date.tm_yday > 0 ? date.tm_yday : 365;
+    const uint8_t weekday = date.tm_wday;
+    const uint8_t previousWeekday = (weekday + 6) % 7;
+
+    const int32_t startToday = resolve(start, today, location);
+    const int32_t endToday = resolve(end, today, location);
+
+    // Recalculate at midnight at the latest, sun based edges move every day
+    active = false;
+    int64_t next = dayStart + DAY_S;
+
+    const int32_t startYesterday = resolve(start, yesterday, location);
+    const int32_t endYesterday = resolve(end, yesterday, location);
+    if ((days & (1 << previousWeekday)) && startYesterday >= 0 && endYesterday >= 0 && endYesterday <= startYesterday
+        && endToday >= 0 && second < static_cast<uint32_t>(endToday))
+    {
+        // Yesterday's window continues over midnight
+        active = true;
+        next = dayStart + endToday;
+    }
+    else if ((days & (1 << weekday)) && startToday >= 0 && endToday >= 0)
+    {
+        if (second < static_cast<uint32_t>(startToday))
+        {
+            next = dayStart + startToday;
+        }
+        else if (endToday <= startToday)
+        {
+            active = true;
+        }
+        else if (second < static_cast<uint32_t>(endToday))
+        {
+            active = true;
+            next = dayStart + endToday;
+        }
+    }
+
+    nextChange = next - location.utcOffset;
+    return active;
+}
+
+int32_t Schedule::resolve(const Edge& edge, const uint16_t dayOfYear, const Location& location)
+{
+    float hour;
+    switch (edge.base)
+    {
+    case Base::clock:
+        return edge.minutes * 60;
+    case Base::sunrise:
+        hour = sunTime(dayOfYear, location, SUN_ZENITH, true);
+        break;
+    case Base::sunset:
+        hour = sunTime(dayOfYear, location, SUN_ZENITH, false);
+        break;
+    case Base::dawn:
+        hour = sunTime(dayOfYear, location, CIVIL_ZENITH, true);
+        break;
+    case Base::dusk:
+        hour = sunTime(dayOfYear, location, CIVIL_ZENITH, false);
+        break;
+    default:
+        return -1;
+    }
+    if (hour < 0)
+    {
+        return -1;
+    }
+    const int32_t second = static_cast<int32_t>(hour * 3600) + location.utcOffset + edge.minutes * 60;
+    return ((second % static_cast<int32_t>(DAY_S)) + DAY_S) % DAY_S;
+}
+
+float Schedule::sunTime(const uint16_t dayOfYear, const Location& location, const float zenith, const bool rising)
+{
+    // Sunrise/sunset algorithm of the Almanac for Computers, accurate to about a minute
+    const float longitudeHour = location.longitude / 15.0f;
+    const float approximate = dayOfYear + ((rising ? 6.0f : 18.0f) - longitudeHour) / 24.0f;
+
+    const float anomaly = 0.9856f * approximate - 3.289f;
+    const float trueLongitude = wrap(anomaly + 1.916f * sinf(anomaly * DEG_TO_RAD)
+            + 0.020f * sinf(2 * anomaly * DEG_TO_RAD) + 282.634f,
+        360.0f);
+
+    // Right ascension in the same quadrant as the true longitude
+    float ascension = wrap(atanf(0.91764f * tanf(trueLongitude * DEG_TO_RAD)) * RAD_TO_DEG, 360.0f);
+    ascension += floorf(trueLongitude / 90.0f) * 90.0f - floorf(ascension / 90.0f) * 90.0f;
+    ascension /= 15.0f;
+
+    const float sinDeclination = 0.39782f * sinf(trueLongitude * DEG_TO_RAD);
+    const float cosDeclination = cosf(asinf(sinDeclination));
+    const float latitude = location.latitude * DEG_TO_RAD;
+    const float cosHourAngle
+        = (cosf(zenith * DEG_TO_RAD) - sinDeclination * sinf(latitude)) / (cosDeclination * cosf(latitude));
+    if (cosHourAngle > 1 || cosHourAngle < -1)
+    {
+        // Polar night or midnight sun
+        return -1;
+    }
+
+    float hourAngle = acosf(cosHourAngle) * RAD_TO_DEG;
+    if (rising)
+    {
+        hourAngle = 360.0f - hourAngle;
+    }
+    const float localMean = hourAngle / 15.0f + ascension - 0.06571f * approximate - 6.622f;
+    return wrap(localMean - longitudeHour, 24.0f);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+
+/// @brief Daily time window of an output, with edges at fixed times or relative to the sun
+///
+/// Edges are written as `HH:MM` or as `sunrise`, `sunset`, `dawn` or `dusk` (civil twilight) with an optional
+/// offset in minutes, e.g. `sunset-15`. A window whose end lies before its start continues over midnight.
+///
+/// The state is only recalculated when the next edge or midnight is reached, checking it in between costs a
+/// single comparison.
+class Schedule
+{
+public:
+    /// @brief Place and time zone the schedule is calculated for
+    struct Location
+    {
+        float latitude; /// Latitude in degrees, north positive
+        float longitude; /// Longitude in degrees, east positive
+        int32_t utcOffset; /// Offset of the local time to UTC in s
+    };
+
+    constexpr static const uint8_t ALL_DAYS = 0x7F; /// Day mask with all days of the week
+
+    /// @brief Set the window, resetting the cached state
+    ///
+    /// On failure the schedule is left empty.
+    ///
+    /// @param start Start of the window, empty to clear the schedule
+    /// @param end End of the window
+    /// @param days Days the window starts on, bit 0 is Sunday
+    /// @return true if both edges are valid
+    bool set(const char* start, const char* end, const uint8_t days);
+
+    /// @brief Check if an edge is valid
+    ///
+    /// @param edge Edge of a window, e.g. `07:30` or `dusk+10`
+    /// @return true if the edge can be used with @ref set or is empty
+    static bool verify(const char* edge);
+
+    /// @brief Check if a window is valid
+    ///
+    /// @param start Start of the window
+    /// @param end End of the window
+    /// @return true if both edges are valid, or both are empty for no window
+    static bool verifyWindow(const char* start, const char* end);
+
+    /// @brief Check if there is no window
+    bool empty() const { return !enabled; }
+
+    /// @brief Discard the cached state, e.g. after the location changed
+    void invalidate() { nextChange = 0; }
+
+    /// @brief Check if the window is open
+    ///
+    /// @param utc Current UTC epoch time in s
+    /// @param location Place and time zone
+    /// @return true if the window is open, false if closed or empty
+    bool isActive(const uint32_t utc, const Location& location);
+
+    /// @brief Get the time of the next recalculation
+    ///
+    /// @return UTC epoch time in s
+    uint32_t getNextChange() const { return nextChange; }
+
+private:
+    /// @brief Reference of an edge
+    enum class Base : uint8_t
+    {
+        clock, /// Fixed local time
+        sunrise, /// Sun rises above the horizon
+        sunset, /// Sun sets below the horizon
+        dawn, /// Civil dawn, sun 6 degrees below the horizon
+        dusk, /// Civil dusk, sun 6 degrees below the horizon
+    };
+
+    /// @brief Edge of the window
+    struct Edge
+    {
+        Base base; /// Reference of the edge
+        int16_t minutes; /// Local minute of the day for Base::clock, offset otherwise
+    };
+
+    /// @brief Parse an edge
+    ///
+    /// @return true if the edge is valid
+    static bool parse(const char* text, Edge& edge);
+
+    /// @brief Calculate the local time of an edge
+    ///
+    /// @param edge Edge to calculate
+    /// @param dayOfYear Day of the year, starting with 1
+    /// @param location Place and time zone
+    /// @return Local second of the day, negative if the sun does not reach the required altitude on that day
+    static int32_t resolve(const Edge& edge, const uint16_t dayOfYear, const Location& location);
+
+    /// @brief Calculate the UTC hour of sunrise or sunset
+    ///
+    /// @param dayOfYear Day of the year, starting with 1
+    /// @param location Place
+    /// @param zenith Zenith angle of the sun in degrees
+    /// @param rising true for sunrise, false for sunset
+    /// @return UTC hour in [0, 24) or a negative value if there is no such event on that day
+    static float sunTime(const uint16_t dayOfYear, const Location& location, const float zenith, const bool rising);
+
+private:
+    Edge start {}; /// Start of the window
+    Edge end {}; /// End of the window
+    uint8_t days = ALL_DAYS; /// Days the window starts on, bit 0 is Sunday
+    bool enabled = false; /// A window is set
+    bool active = false; /// Cached state
+    uint32_t nextChange = 0; /// UTC epoch time in s when the cached state expires
+};
@@ -0,0 +1,187 @@
+#include "Scheduler.h"
+
+#include "Constants.h"
+
+void Scheduler::Profile::add(const uint32_t us)
+{
+    if (current.count == 0 || us < current.minUs)
+    {
+        current.minUs = us;
+    }
+    if (us > current.maxUs)
+    {
+        current.maxUs = us;
+    }
+    ++current.count;
+    current.totalUs += us;
+
+    // Each bucket spans two bits of the time
+    const uint8_t bits = us ? 32 - __builtin_clz(us) : 0;
+    const uint8_t bucket = (bits + 1) / 2;
+    ++histogram[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1];
+}
+
+void Scheduler::Profile::roll()
+{
+    last = current;
+    current = Window();
+}
+
+uint32_t Scheduler::Profile::bucketLimit(const uint8_t bucket)
+{
+    return bucket < HISTOGRAM_BUCKETS - 1 ? 1UL << (2 * bucket) : 0;
+}
+
+Scheduler::TaskId Scheduler::add(const char* name, TaskFunction function, const uint32_t periodMs,
+    const uint32_t phaseMs, const Priority priority, const uint32_t budgetUs, const uint32_t deadlineMs)
+{
+    if (taskCount >= MAX_TASKS || !function)
+    {
+        return NO_TASK;
+    }
+    Task& task = tasks[taskCount];
+    task.name = name;
+    task.function = function;
+    task.periodMs = periodMs;
+    task.deadlineMs = deadlineMs ? deadlineMs : periodMs;
+    task.budgetUs = budgetUs;
+    task.releaseAt = millis() + phaseMs;
+    task.triggeredAt = 0;
+    task.priority = priority;
+    task.triggered = false;
+    task.stats = Stats();
+    return taskCount++;
+}
+
+void Scheduler::setPeriod(const TaskId id, const uint32_t periodMs)
+{
+    if (id >= taskCount || !periodMs)
+    {
+        return;
+    }
+    Task& task = tasks[id];
+    task.periodMs = periodMs;
+    task.deadlineMs = periodMs;
+    // A shorter period applies right away instead of after the pending release
+    const uint32_t releaseAt = millis() + periodMs;
+    if (static_cast<int32_t>(releaseAt - task.releaseAt) < 0)
+    {
+        task.releaseAt = releaseAt;
+    }
+}
+
+void Scheduler::trigger(const TaskId id)
+{
+    if (id >= taskCount)
+    {
+        return;
+    }
+    Task& task = tasks[id];
+    if (!task.triggered)
+    {
+        task.triggered = true;
+        task.triggeredAt = millis();
+    }
+}
+
+bool Scheduler::isReleased(const Task& task, const uint32_t now) const
+{
+    return task.triggered || (task.periodMs && static_cast<int32_t>(now - task.releaseAt) >= 0);
+}
+
+uint32_t Scheduler::deadline(const Task& task) const
+{
+    // Count from whichever release happened first, a pending trigger or the periodic release
+    if (task.triggered && (!task.periodMs || static_cast<int32_t>(task.triggeredAt - task.releaseAt) < 0))
+    {
+        return task.triggeredAt + task.deadlineMs;
+    }
+    return task.releaseAt + task.deadlineMs;
+}
+
+void Scheduler::rollWindow(const uint32_t now)
+{
+    for (uint8_t i = 0; i < taskCount; ++i)
+    {
+        tasks[i].stats.profile.roll();
+    }
+    loopProfile.roll();
+    windowLength = now - windowStart;
+    windowStart = now;
+}
+
+bool Scheduler::loop()
+{
+    const uint32_t cyclesPerUs = ESP.getCpuFreqMHz();
+    const uint32_t cycles = ESP.getCycleCount();
+    if (looped)
+    {
+        // The 32 bit cycle counter wraps after 53.7 s at 80 MHz and 26.8 s at 160 MHz, far beyond any sane interval
+        loopProfile.add((cycles - loopCycles) / cyclesPerUs);
+    }
+    loopCycles = cycles;
+    looped = true;
+
+    const uint32_t now = millis();
+    if (now - windowStart >= WINDOW_MS)
+    {
+        rollWindow(now);
+    }
+
+    Task* next = nullptr;
+    for (uint8_t i = 0; i < taskCount; ++i)
+    {
+        Task& task = tasks[i];
+        if (!isReleased(task, now))
+        {
+            continue;
+        }
+        if (!next || task.priority > next->priority
+            || (task.priority == next->priority && static_cast<int32_t>(deadline(task) - deadline(*next)) < 0))
+        {
+            next = &task;
+        }
+    }
+    if (!next)
+    {
+        return false;
+    }
+
+    Task& task = *next;
+    Stats& stats = task.stats;
+    if (static_cast<int32_t>(now - deadline(task)) > 0)
+    {
+        ++stats.late;
+    }
+
+    // Consume the release before running, the task may trigger itself again
+    if (task.periodMs && static_cast<int32_t>(now - task.releaseAt) >= 0)
+    {
+        task.releaseAt += task.periodMs;
+        if (static_cast<int32_t>(now - task.releaseAt) >= 0)
+        {
+            // Missed whole periods are skipped instead of run back to back
+            task.releaseAt = now + task.periodMs;
+        }
+    }
+    task.triggered = false;
+
+    const uint32_t start = ESP.getCycleCount();
+    task.function();
+    const uint32_t elapsed = (ESP.getCycleCount() - start) / cyclesPerUs;
+
+    ++stats.runs;
+    stats.lastUs = elapsed;
+    stats.totalUs += elapsed;
+    if (elapsed > stats.maxUs)
+    {
+        stats.maxUs = elapsed;
+    }
+    stats.profile.add(elapsed);
+    if (task.budgetUs && elapsed > task.budgetUs)
+    {
+        ++stats.overruns;
+        RNG_DEBUGF("[Scheduler] %s took %u us, budget %u us\n", task.name, elapsed, task.budgetUs);
+    }
+    return true;
+}
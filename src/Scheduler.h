@@ -0,0 +1,160 @@
+#pragma once
+
+#include <Arduino.h>
+
+/// @brief Cooperative scheduler running one task per call of @ref loop
+///
+/// Each task is released periodically at its own phase, so work is spread instead of bunched at the second
+/// boundary, and can additionally be triggered by events. Among the released tasks the one with the highest
+/// priority runs, ties are broken by the earliest deadline. Tasks are never preempted, their run time is measured
+/// against a budget so slow tasks show up in the statistics.
+///
+/// Run times and the interval between calls of @ref loop are measured with the CPU cycle counter and profiled in
+/// windows of @ref WINDOW_MS and in histograms, which only costs a few instructions per run.
+class Scheduler
+{
+public:
+    constexpr static const uint8_t MAX_TASKS = 12; /// Maximum number of tasks
+    constexpr static const uint8_t NO_TASK = 0xFF; /// Returned by @ref add if no task could be added
+    constexpr static const uint32_t WINDOW_MS = 60000; /// Length of a profiling window
+    constexpr static const uint8_t HISTOGRAM_BUCKETS = 12; /// Number of histogram buckets, see @ref Profile
+
+    /// @brief Function run by a task
+    typedef void (*TaskFunction)();
+
+    /// @brief Identifier of a task
+    typedef uint8_t TaskId;
+
+    /// @brief Priority of a task, released tasks with a higher priority run first
+    enum class Priority : uint8_t
+    {
+        low,
+        normal,
+        high,
+    };
+
+    /// @brief Run times within a profiling window
+    struct Window
+    {
+        uint32_t count = 0; /// Number of measurements
+        uint32_t minUs = 0; /// Shortest time in us
+        uint32_t maxUs = 0; /// Longest time in us
+        uint64_t totalUs = 0; /// Accumulated time in us
+
+        /// @brief Get the average time in us
+        uint32_t avgUs() const { return count ? totalUs / count : 0; }
+    };
+
+    /// @brief Profile of a measured time
+    ///
+    /// The histogram has logarithmic buckets, bucket i counts times below 4^i us and the last one all longer times.
+    struct Profile
+    {
+        Window current; /// Window being collected
+        Window last; /// Last complete window
+        uint32_t histogram[HISTOGRAM_BUCKETS] = {}; /// Number of measurements per bucket since boot
+
+        /// @brief Add a measurement
+        ///
+        /// @param us Measured time in us
+        void add(const uint32_t us);
+
+        /// @brief Complete the current window and start a new one
+        void roll();
+
+        /// @brief Get the exclusive upper limit of a histogram bucket in us, 0 for the unbounded last bucket
+        static uint32_t bucketLimit(const uint8_t bucket);
+    };
+
+    /// @brief Statistics of a task
+    struct Stats
+    {
+        uint32_t runs = 0; /// Number of runs
+        uint32_t late = 0; /// Runs started after their deadline
+        uint32_t overruns = 0; /// Runs exceeding the budget
+        uint32_t lastUs = 0; /// Run time of the last run in us
+        uint32_t maxUs = 0; /// Longest run time in us
+        uint64_t totalUs = 0; /// Accumulated run time in us
+        Profile profile; /// Profile of the run time
+    };
+
+    /// @brief Add a task
+    ///
+    /// @param name Name for statistics, must outlive the scheduler
+    /// @param function Function to run
+    /// @param periodMs Period in ms, 0 for tasks which only run when triggered
+    /// @param phaseMs Delay of the first release in ms, spreads tasks with the same period
+    /// @param priority Priority of the task
+    /// @param budgetUs Expected maximum run time in us, 0 to disable the check
+    /// @param deadlineMs Time in ms after the release by which the task should have started, 0 for the period
+    /// @return Identifier of the task or NO_TASK if the scheduler is full
+    TaskId add(const char* name, TaskFunction function, const uint32_t periodMs, const uint32_t phaseMs,
+        const Priority priority, const uint32_t budgetUs, const uint32_t deadlineMs = 0);
+
+    /// @brief Change the period of a task, its deadline becomes the new period
+    ///
+    /// @param task Task to change
+    /// @param periodMs New period in ms, must not be 0 for periodic tasks
+    void setPeriod(const TaskId task, const uint32_t periodMs);
+
+    /// @brief Run a task as soon as possible, e.g. after new data arrived
+    ///
+    /// Periodic releases are not affected.
+    ///
+    /// @param task Task to trigger
+    void trigger(const TaskId task);
+
+    /// @brief Run the most urgent released task, if any
+    ///
+    /// @return true if a task was run
+    bool loop();
+
+    /// @brief Get the number of tasks
+    uint8_t count() const { return taskCount; }
+
+    /// @brief Get the name of a task
+    const char* getName(const TaskId task) const { return tasks[task % MAX_TASKS].name; }
+
+    /// @brief Get the statistics of a task
+    const Stats& getStats(const TaskId task) const { return tasks[task % MAX_TASKS].stats; }
+
+    /// @brief Get the profile of the interval between calls of @ref loop, i.e. the loop jitter
+    const Profile& getLoopProfile() const { return loopProfile; }
+
+    /// @brief Get the length in ms of the last complete profiling window, 0 before the first one completed
+    uint32_t getWindowLength() const { return windowLength; }
+
+private:
+    /// @brief Scheduled task
+    struct Task
+    {
+        const char* name; /// Name for statistics
+        TaskFunction function; /// Function to run
+        uint32_t periodMs; /// Period in ms, 0 if only triggered
+        uint32_t deadlineMs; /// Relative deadline in ms
+        uint32_t budgetUs; /// Expected maximum run time in us, 0 if unchecked
+        uint32_t releaseAt; /// Time in ms of the next periodic release
+        uint32_t triggeredAt; /// Time in ms the pending trigger was set
+        Priority priority; /// Priority of the task
+        bool triggered; /// A trigger is pending
+        Stats stats; /// Statistics
+    };
+
+    /// @brief Check if a task is released
+    bool isReleased(const Task& task, const uint32_t now) const;
+
+    /// @brief Get the absolute deadline of a released task
+    uint32_t deadline(const Task& task) const;
+
+    /// @brief Complete the profiling window of all tasks and the loop
+    void rollWindow(const uint32_t now);
+
+private:
+    Task tasks[MAX_TASKS]; /// Tasks, the first taskCount are valid
+    uint8_t taskCount = 0; /// Number of tasks
+    Profile loopProfile; /// Profile of the interval between calls of loop
+    uint32_t loopCycles = 0; /// Cycle count at the last call of loop
+    bool looped = false; /// loop was called before, loopCycles is valid
+    uint32_t windowStart = 0; /// Time in ms the current profiling window started
+    uint32_t windowLength = 0; /// Length in ms of the last complete profiling window
+};
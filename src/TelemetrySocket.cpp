@@ -0,0 +1,178 @@
+#include "TelemetrySocket.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <ArduinoJson.h>
+
+#include "Constants.h"
+
+namespace
+{
+    /// @brief Multiplier applied to each field before it is packed, indexed by Renogy::Field
+    const uint8_t FIELD_SCALES[Renogy::FIELD_COUNT] PROGMEM = {1, 100, 100, 1, 1, 1, 1, 100, 100, 1, 100, 100, 1, 1, 1};
+
+    constexpr const uint16_t ALL_FIELDS = (1 << Renogy::FIELD_COUNT) - 1; /// Mask selecting all fields
+
+    /// @brief Check if a field is packed as `int32_t` instead of `int16_t`
+    bool isWide(const Renogy::Field field)
+    {
+        return field == Renogy::Field::total || field == Renogy::Field::errorState;
+    }
+} // namespace
+
+TelemetrySocket::TelemetrySocket(const char* url) : ws(url)
+{
+    ws.onEvent([this](AsyncWebSocket*, AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data,
+                   size_t len) { onEvent(client, type, arg, data, len); });
+}
+
+void TelemetrySocket::publish(const Renogy::Data& data)
+{
+    const uint32_t now = millis();
+    // Type, mask, time and all fields at their widest
+    uint8_t frame[1 + 2 + 4 + Renogy::FIELD_COUNT * 4];
+
+    for (Subscription& subscription : subscriptions)
+    {
+        if (!subscription.clientId || now - subscription.sentAt < subscription.intervalMs)
+        {
+            continue;
+        }
+        AsyncWebSocketClient* client = ws.client(subscription.clientId);
+        if (!client || client->queueIsFull())
+        {
+            // Slow clients skip samples instead of queueing them
+            continue;
+        }
+
+        size_t length = 0;
+        frame[length++] = FRAME_SAMPLE;
+        memcpy(frame + length, &subscription.fields, 2);
+        length += 2;
+        memcpy(frame + length, &now, 4);
+        length += 4;
+        for (uint8_t i = 0; i < Renogy::FIELD_COUNT; ++i)
+        {
+            if (!(subscription.fields & (1 << i)))
+            {
+                continue;
+            }
+            const Renogy::Field field = static_cast<Renogy::Field>(i);
+            const int32_t value = lround(data.get(field) * pgm_read_byte(&FIELD_SCALES[i]));
+            if (isWide(field))
+            {
+                memcpy(frame + length, &value, 4);
+                length += 4;
+            }
+            else
+            {
+                const int16_t narrow = std::max<int32_t>(INT16_MIN, std::min<int32_t>(value, INT16_MAX));
+                memcpy(frame + length, &narrow, 2);
+                length += 2;
+            }
+        }
+        client->binary(frame, length);
+        subscription.sentAt = now;
+    }
+}
+
+void TelemetrySocket::onEvent(AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data, size_t len)
+{
+    switch (type)
+    {
+    case WS_EVT_CONNECT:
+    {
+        Subscription* subscription = find(0);
+        if (!subscription)
+        {
+            RNG_DEBUGLN(F("[Telemetry] Too many clients"));
+            client->close(1013);
+            return;
+        }
+        *subscription = Subscription {client->id(), ALL_FIELDS, 0, 0};
+        RNG_DEBUGF("[Telemetry] Client %u connected\n", client->id());
+        break;
+    }
+    case WS_EVT_DISCONNECT:
+    {
+        Subscription* subscription = find(client->id());
+        if (subscription)
+        {
+            *subscription = Subscription();
+        }
+        break;
+    }
+    case WS_EVT_DATA:
+    {
+        const AwsFrameInfo* info = static_cast<AwsFrameInfo*>(arg);
+        Subscription* subscription = find(client->id());
+        // Subscriptions are small, fragmented messages are ignored
+        if (subscription && info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT)
+        {
+            subscribe(*subscription, client, data, len);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void TelemetrySocket::subscribe(
+    Subscription& subscription, AsyncWebSocketClient* client, const uint8_t* data, const size_t len)
+{
+    JsonDocument json;
+    if (deserializeJson(json, data, len) || !json.is<JsonObject>())
+    {
+        client->text("{\"error\":\"invalid json\"}");
+        return;
+    }
+
+    JsonArrayConst fields = json["fields"];
+    if (!fields.isNull())
+    {
+        uint16_t mask = 0;
+        for (JsonVariantConst name : fields)
+        {
+            const Renogy::Field field = Renogy::fieldFromName(name | "");
+            if (field != Renogy::Field::count)
+            {
+                mask |= 1 << static_cast<uint8_t>(field);
+            }
+        }
+        subscription.fields = mask;
+    }
+    if (json["interval"].is<uint32_t>())
+    {
+        subscription.intervalMs = std::min<uint32_t>(json["interval"].as<uint32_t>(), MAX_INTERVAL_MS);
+    }
+
+    // Acknowledge with the selected fields in frame order and their scales
+    json.clear();
+    JsonObject scales = json["fields"].to<JsonObject>();
+    for (uint8_t i = 0; i < Renogy::FIELD_COUNT; ++i)
+    {
+        if (subscription.fields & (1 << i))
+        {
+            scales[Renogy::fieldName(static_cast<Renogy::Field>(i))] = pgm_read_byte(&FIELD_SCALES[i]);
+        }
+    }
+    json["interval"] = subscription.intervalMs;
+
+    char buffer[384];
+    const size_t length = serializeJson(json, buffer, sizeof(buffer));
+    client->text(buffer, length);
+}
+
+TelemetrySocket::Subscription* TelemetrySocket::find(const uint32_t clientId)
+{
+    for (Subscription& subscription : subscriptions)
+    {
+        if (subscription.clientId == clientId)
+        {
+            return &subscription;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <ESPAsyncWebServer.h>
+
+#include "Renogy.h"
+
+/// @brief WebSocket pushing packed binary samples of the renogy data at every poll
+///
+/// Clients receive all fields at every poll after connecting. A text message like
+/// `{"fields":["bvoltage","pvoltage"],"interval":1000}` selects the fields and the minimum interval in ms between
+/// samples, it is answered with a text message listing the selected fields and their scale.
+///
+/// Sample frames are binary and little endian:
+/// - `uint8_t` frame type, @ref FRAME_SAMPLE
+/// - `uint16_t` mask of the contained fields, bit n is Renogy::Field n
+/// - `uint32_t` time of the poll in ms since boot
+/// - for each contained field in field order the value multiplied by its scale, `int32_t` for `total` and `cerror`,
+///   `int16_t` for all others
+class TelemetrySocket
+{
+public:
+    /// @brief Construct a new TelemetrySocket object
+    ///
+    /// @param url Path of the socket
+    TelemetrySocket(const char* url);
+
+    TelemetrySocket(TelemetrySocket&&) = delete;
+
+    /// @brief Get the handler to add to the webserver
+    AsyncWebSocket& handler() { return ws; }
+
+    /// @brief Send a sample to all subscribed clients which are due
+    ///
+    /// @param data Data read from the controller
+    void publish(const Renogy::Data& data);
+
+    /// @brief Drop disconnected clients, should be called once every second
+    void cleanup() { ws.cleanupClients(MAX_CLIENTS); }
+
+public:
+    constexpr static const uint8_t MAX_CLIENTS = 4; /// Maximum number of clients
+    constexpr static const uint8_t FRAME_SAMPLE = 1; /// Type of sample frames
+    constexpr static const uint16_t MAX_INTERVAL_MS = 60000; /// Maximum interval between samples
+
+private:
+    /// @brief Subscription of a connected client
+    struct Subscription
+    {
+        uint32_t clientId = 0; /// WebSocket client id, 0 if the slot is free
+        uint16_t fields = 0; /// Mask of the selected fields
+        uint16_t intervalMs = 0; /// Minimum interval between samples, 0 for every poll
+        uint32_t sentAt = 0; /// Time in ms the last sample was sent
+    };
+
+    /// @brief Handle events of the WebSocket
+    void onEvent(AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data, size_t len);
+
+    /// @brief Apply a subscription message and acknowledge it
+    ///
+    /// @param subscription Subscription of the client
+    /// @param client Client which sent the message
+    /// @param data Message
+    /// @param len Length of the message
+    void subscribe(Subscription& subscription, AsyncWebSocketClient* client, const uint8_t* data, const size_t len);
+
+    /// @brief Find the subscription of a client
+    ///
+    /// @param clientId WebSocket client id, 0 to find a free slot
+    /// @return Subscription or null if not found
+    Subscription* find(const uint32_t clientId);
+
+private:
+    AsyncWebSocket ws; /// WebSocket handler
+    Subscription subscriptions[MAX_CLIENTS]; /// Subscriptions of the connected clients
+}; // class TelemetrySocket
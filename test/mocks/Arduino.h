@@ -0,0 +1,135 @@
+#pragma once
+
+// Minimal host replacement of the Arduino core, only what the host tested modules and their headers need
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+#define FPSTR(p) (reinterpret_cast<const __FlashStringHelper*>(p))
+
+typedef const char* PGM_P;
+class __FlashStringHelper;
+
+#define strcmp_P strcmp
+#define strncpy_P strncpy
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define memcpy_P memcpy
+#define snprintf_P snprintf
+#define pgm_read_byte(p) (*reinterpret_cast<const uint8_t*>(p))
+
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define D2 4
+
+inline void pinMode(uint8_t, uint8_t) { }
+inline void digitalWrite(uint8_t, uint8_t) { }
+
+/// @brief Milliseconds since the first call, from the host clock
+inline unsigned long millis()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// @brief Microseconds since the first call, from the host clock
+inline unsigned long micros()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline long random(long max) { return max > 0 ? std::rand() % max : 0; }
+
+/// @brief Subset of the Arduino String on top of std::string
+class String
+{
+public:
+    String(const char* str = "") : str(str ? str : "") { }
+    String(const __FlashStringHelper* str) : String(reinterpret_cast<const char*>(str)) { }
+    String(const std::string& str) : str(str) { }
+
+    const char* c_str() const { return str.c_str(); }
+    size_t length() const { return str.length(); }
+    bool isEmpty() const { return str.empty(); }
+    bool equals(const char* other) const { return str == other; }
+
+    String& operator+=(const String& other)
+    {
+        str += other.str;
+        return *this;
+    }
+    String& operator+=(const char* other)
+    {
+        str += other;
+        return *this;
+    }
+    String& operator+=(char c)
+    {
+        str += c;
+        return *this;
+    }
+    friend String operator+(String a, const String& b) { return a += b; }
+    bool operator==(const String& other) const { return str == other.str; }
+    bool operator!=(const String& other) const { return str != other.str; }
+
+private:
+    std::string str;
+};
+
+/// @brief Output sink, the host version drops the debug output
+class Print
+{
+public:
+    virtual ~Print() = default;
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size)
+    {
+        size_t written = 0;
+        while (size--)
+        {
+            written += write(*buffer++);
+        }
+        return written;
+    }
+    size_t write(const char* str) { return write(reinterpret_cast<const uint8_t*>(str), strlen(str)); }
+
+    template <typename T>
+    size_t print(const T&)
+    {
+        return 0;
+    }
+    template <typename T>
+    size_t println(const T&)
+    {
+        return 0;
+    }
+    size_t println() { return 0; }
+    size_t printf_P(const char*, ...) { return 0; }
+};
+
+class Stream : public Print
+{
+public:
+    size_t write(uint8_t) override { return 1; }
+    void setTimeout(unsigned long) { }
+};
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long) { }
+};
+
+inline HardwareSerial Serial;
+inline HardwareSerial Serial1;
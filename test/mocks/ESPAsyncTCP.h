@@ -0,0 +1,320 @@
+#pragma once
+
+// Host replacement of the ESPAsyncTCP AsyncClient on top of non-blocking POSIX sockets, so MqttClient can be
+// benchmarked against a real broker. Callbacks run from asyncTcpPoll, which stands in for the lwIP system context.
+
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/tcp.h>
+#else
+#include <netinet/tcp.h>
+#endif
+
+#include "Arduino.h"
+
+class AsyncClient;
+
+typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
+typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void*, AsyncClient*, int8_t error)> AcErrorHandler;
+typedef std::function<void(void*, AsyncClient*, void* data, size_t len)> AcDataHandler;
+
+/// @brief Transmit work of all connections, to compare with the counters of the client on top
+struct AsyncTcpCounters
+{
+    uint32_t syscalls = 0; /// send calls into the kernel
+    uint32_t bytes = 0; /// Bytes accepted by the kernel
+};
+
+/// @brief Get the transmit counters of all connections
+inline AsyncTcpCounters& asyncTcpCounters()
+{
+    static AsyncTcpCounters counters;
+    return counters;
+}
+
+class AsyncClient
+{
+public:
+    constexpr static const uint16_t MSS = 1460; /// TCP_MSS of the ESP8266 lwIP build
+    constexpr static const size_t SEND_BUFFER = 2 * MSS; /// TCP_SND_BUF of the ESP8266 lwIP build
+    constexpr static const size_t RECEIVE_CHUNK = 536; /// Largest block passed to onData, like a small pbuf
+
+    AsyncClient() { clients().push_back(this); }
+
+    ~AsyncClient()
+    {
+        onDisconnect(nullptr);
+        close(true);
+        clients().erase(std::remove(clients().begin(), clients().end(), this), clients().end());
+    }
+
+    AsyncClient(const AsyncClient&) = delete;
+
+    void onConnect(AcConnectHandler handler, void* = nullptr) { connectHandler = handler; }
+    void onAck(AcAckHandler handler, void* = nullptr) { ackHandler = handler; }
+    void onError(AcErrorHandler handler, void* = nullptr) { errorHandler = handler; }
+    void onData(AcDataHandler handler, void* = nullptr) { dataHandler = handler; }
+    void onDisconnect(AcConnectHandler handler, void* = nullptr) { disconnectHandler = handler; }
+
+    bool connect(const char* host, const uint16_t port)
+    {
+        if (fd >= 0)
+        {
+            return false;
+        }
+        addrinfo hints {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        char service[6];
+        snprintf(service, sizeof(service), "%u", port);
+        if (getaddrinfo(host, service, &hints, &result) != 0)
+        {
+            return false;
+        }
+        fd = socket(result->ai_family, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            freeaddrinfo(result);
+            return false;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        // Segment like the ESP8266 does, the loopback interface would allow 64 kB
+        const int mss = MSS;
+        setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+        const int rc = ::connect(fd, result->ai_addr, result->ai_addrlen);
+        freeaddrinfo(result);
+        if (rc != 0 && errno != EINPROGRESS)
+        {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        established = false;
+        return true;
+    }
+
+    void close(const bool = false)
+    {
+        if (fd < 0)
+        {
+            return;
+        }
+        ::close(fd);
+        fd = -1;
+        established = false;
+        pending.clear();
+        if (disconnectHandler)
+        {
+            disconnectHandler(nullptr, this);
+        }
+    }
+
+    bool connected() const { return fd >= 0 && established; }
+
+    uint16_t getMss() const { return connected() ? MSS : 0; }
+
+    void setNoDelay(const bool noDelay)
+    {
+        const int value = noDelay;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    }
+
+    size_t add(const char* data, const size_t size, const uint8_t = 0)
+    {
+        if (!connected())
+        {
+            return 0;
+        }
+        const size_t accepted = std::min(size, SEND_BUFFER - pending.size());
+        pending.insert(pending.end(), data, data + accepted);
+        return accepted;
+    }
+
+    bool send()
+    {
+        if (!connected() || pending.empty())
+        {
+            return false;
+        }
+        output();
+        return true;
+    }
+
+    /// @brief Get the number of segments with data the kernel sent on this connection, 0 if unknown
+    uint32_t getDataSegmentsOut() const
+    {
+#ifdef __linux__
+        tcp_info info {};
+        socklen_t length = sizeof(info);
+        if (fd >= 0 && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+        {
+            return info.tcpi_data_segs_out;
+        }
+#endif
+        return 0;
+    }
+
+    static const char* errorToString(const int8_t error)
+    {
+        switch (error)
+        {
+        case -13:
+            return "ERR_ABRT";
+        case -14:
+            return "ERR_RST";
+        case -15:
+            return "ERR_CLSD";
+        default:
+            return "ERR_CONN";
+        }
+    }
+
+    /// @brief Get all live connections
+    static std::vector<AsyncClient*>& clients()
+    {
+        static std::vector<AsyncClient*> all;
+        return all;
+    }
+
+    /// @brief Handle socket events of this connection
+    ///
+    /// @param events Events returned by poll
+    void service(const short events)
+    {
+        if (!established)
+        {
+            if (!(events & (POLLOUT | POLLERR | POLLHUP)))
+            {
+                return;
+            }
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error)
+            {
+                fail(-14);
+                return;
+            }
+            established = true;
+            if (connectHandler)
+            {
+                connectHandler(nullptr, this);
+            }
+            return;
+        }
+        if ((events & POLLOUT) && !pending.empty())
+        {
+            output();
+        }
+        if (acked && ackHandler)
+        {
+            const size_t length = acked;
+            acked = 0;
+            ackHandler(nullptr, this, length, 0);
+        }
+        if (fd >= 0 && (events & (POLLIN | POLLHUP | POLLERR)))
+        {
+            uint8_t buffer[RECEIVE_CHUNK];
+            const ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+            if (received > 0)
+            {
+                if (dataHandler)
+                {
+                    dataHandler(nullptr, this, buffer, received);
+                }
+            }
+            else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                close();
+            }
+        }
+    }
+
+    /// @brief Socket events this connection waits for
+    short wantedEvents() const { return POLLIN | (!established || !pending.empty() || acked ? POLLOUT : 0); }
+
+    int getFd() const { return fd; }
+
+private:
+    /// @brief Hand queued data to the kernel, as much as it accepts
+    void output()
+    {
+        while (!pending.empty())
+        {
+            const ssize_t sent = ::send(fd, pending.data(), pending.size(), MSG_NOSIGNAL);
+            ++asyncTcpCounters().syscalls;
+            if (sent < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    fail(-14);
+                }
+                return;
+            }
+            pending.erase(pending.begin(), pending.begin() + sent);
+            acked += sent;
+            asyncTcpCounters().bytes += sent;
+        }
+    }
+
+    /// @brief Report an error and drop the connection
+    void fail(const int8_t error)
+    {
+        if (errorHandler)
+        {
+            errorHandler(nullptr, this, error);
+        }
+        close(true);
+    }
+
+private:
+    int fd = -1; /// Socket, -1 if closed
+    bool established = false; /// The TCP handshake completed
+    std::vector<uint8_t> pending; /// Data added but not yet accepted by the kernel
+    size_t acked = 0; /// Bytes accepted by the kernel since the last onAck
+    AcConnectHandler connectHandler;
+    AcAckHandler ackHandler;
+    AcErrorHandler errorHandler;
+    AcDataHandler dataHandler;
+    AcConnectHandler disconnectHandler;
+};
+
+/// @brief Run the callbacks of all connections, like the lwIP system context between two sketch loops
+///
+/// @param timeoutMs Longest time to wait for an event
+inline void asyncTcpPoll(const int timeoutMs)
+{
+    std::vector<pollfd> fds;
+    std::vector<AsyncClient*> owners;
+    for (AsyncClient* client : AsyncClient::clients())
+    {
+        if (client->getFd() >= 0)
+        {
+            fds.push_back({client->getFd(), client->wantedEvents(), 0});
+            owners.push_back(client);
+        }
+    }
+    if (fds.empty() || poll(fds.data(), fds.size(), timeoutMs) <= 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        if (fds[i].revents)
+        {
+            owners[i]->service(fds[i].revents);
+        }
+    }
+}
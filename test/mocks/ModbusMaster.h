@@ -0,0 +1,14 @@
+#pragma once
+
+#include "Arduino.h"
+
+/// @brief Declarations of ModbusMaster used by Renogy.h, the host tests never talk to a controller
+class ModbusMaster
+{
+public:
+    static const uint8_t ku8MBSuccess = 0x00;
+
+    void begin(uint8_t, Stream&) { }
+    void preTransmission(void (*)()) { }
+    void postTransmission(void (*)()) { }
+};
@@ -0,0 +1,237 @@
+// Benchmark of MqttClient against a real broker, e.g. a local mosquitto. The broker defaults to 127.0.0.1:1883 and
+// can be changed with MQTT_BENCH_HOST and MQTT_BENCH_PORT, the tests are ignored if no broker answers.
+
+#include <unity.h>
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdlib>
+#include <vector>
+
+#include "MqttClient.h"
+
+namespace
+{
+    const char* const ECHO_TOPIC = "rngbridge/bench/echo";
+    const char* const SPLIT_SUFFIXES[] = {"bsoc", "bvoltage", "bcurrent", "btemperature", "consumption", "generation",
+        "total", "lvoltage", "lcurrent", "pvoltage", "pcurrent", "cstate", "ctemperature"};
+    constexpr const size_t SPLIT_COUNT = sizeof(SPLIT_SUFFIXES) / sizeof(SPLIT_SUFFIXES[0]);
+    constexpr const size_t STATE_LENGTH = 450; /// Size of the status JSON published by the bridge
+    constexpr const uint32_t CONNECT_TIMEOUT_MS = 3000;
+    constexpr const uint32_t DRAIN_TIMEOUT_MS = 30000;
+
+    MqttClient* client = nullptr;
+    uint32_t echoes = 0; /// Messages received on ECHO_TOPIC
+    unsigned long echoAt = 0; /// Time in us of the latest echo
+
+    /// @brief Print a result line
+    void report(const char* format, ...)
+    {
+        char line[160];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        TEST_MESSAGE(line);
+    }
+
+    /// @brief Run the TCP callbacks and the client loop until the condition holds
+    ///
+    /// @return false if the timeout expired first
+    template <typename Condition>
+    bool runUntil(Condition condition, const uint32_t timeoutMs)
+    {
+        const unsigned long start = millis();
+        while (!condition())
+        {
+            if (millis() - start >= timeoutMs)
+            {
+                return false;
+            }
+            asyncTcpPoll(1);
+            client->loop();
+        }
+        return true;
+    }
+
+    /// @brief Publish, running the TCP callbacks and the client loop while the transmit ring or in-flight slots are
+    /// full
+    bool publishBlocking(const char* topic, const char* payload, const uint8_t qos)
+    {
+        return runUntil(
+            [&]() {
+                if (client->publish(topic, payload, false, qos))
+                {
+                    return true;
+                }
+                client->flush();
+                return false;
+            },
+            DRAIN_TIMEOUT_MS);
+    }
+
+    /// @brief Wait until the broker acknowledged all QoS 1 messages
+    bool drain()
+    {
+        client->flush();
+        return runUntil([]() { return client->inFlight() == 0; }, DRAIN_TIMEOUT_MS);
+    }
+
+    /// @brief Get the live TCP connection of the client
+    AsyncClient& connection() { return *AsyncClient::clients().front(); }
+} // namespace
+
+void setUp()
+{
+    const char* host = getenv("MQTT_BENCH_HOST") ? getenv("MQTT_BENCH_HOST") : "127.0.0.1";
+    const uint16_t port = getenv("MQTT_BENCH_PORT") ? atoi(getenv("MQTT_BENCH_PORT")) : 1883;
+
+    echoes = 0;
+    client = new MqttClient();
+    client->setServer(host, port);
+    client->setCallback([](char* topic, uint8_t*, unsigned int) {
+        if (strcmp(topic, ECHO_TOPIC) == 0)
+        {
+            echoAt = micros();
+            ++echoes;
+        }
+    });
+    client->connect("rngbridge-bench", "", "", "rngbridge/bench/status", 0, false, "offline");
+    if (!runUntil([]() { return client->connected(); }, CONNECT_TIMEOUT_MS))
+    {
+        TEST_IGNORE_MESSAGE("No MQTT broker, start mosquitto or set MQTT_BENCH_HOST and MQTT_BENCH_PORT");
+    }
+}
+
+void tearDown()
+{
+    if (client->connected())
+    {
+        client->disconnect();
+    }
+    delete client;
+    client = nullptr;
+}
+
+void test_round_trip_latency()
+{
+    constexpr const uint32_t SAMPLES = 1000;
+    TEST_ASSERT_TRUE(client->subscribe(ECHO_TOPIC));
+
+    std::vector<unsigned long> latencies;
+    latencies.reserve(SAMPLES);
+    for (uint32_t i = 0; i < SAMPLES; ++i)
+    {
+        const unsigned long sentAt = micros();
+        TEST_ASSERT_TRUE(client->publish(ECHO_TOPIC, "12.85", false));
+        client->flush();
+        TEST_ASSERT_TRUE(runUntil([=]() { return echoes > i; }, CONNECT_TIMEOUT_MS));
+        latencies.push_back(echoAt - sentAt);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    report("QoS 0 round trip over the broker: median %lu us, p99 %lu us, max %lu us", latencies[SAMPLES / 2],
+        latencies[SAMPLES * 99 / 100], latencies.back());
+}
+
+void test_throughput_qos0()
+{
+    constexpr const uint32_t MESSAGES = 20000;
+    const char* payload = "{\"bsoc\":87,\"bvoltage\":13.2,\"pvoltage\":18.4,\"pcurrent\":2.31,\"cstate\":2}";
+
+    const unsigned long start = micros();
+    for (uint32_t i = 0; i < MESSAGES; ++i)
+    {
+        TEST_ASSERT_TRUE(publishBlocking("rngbridge/bench/qos0", payload, 0));
+    }
+    // The broker handles packets of a connection in order, once the marker is acknowledged all messages arrived
+    TEST_ASSERT_TRUE(publishBlocking("rngbridge/bench/qos0", "end", 1));
+    TEST_ASSERT_TRUE(drain());
+    const double seconds = (micros() - start) / 1e6;
+
+    report("QoS 0: %u messages in %.3f s, %.0f messages/s, %.0f payload kB/s", MESSAGES, seconds, MESSAGES / seconds,
+        MESSAGES * strlen(payload) / seconds / 1000);
+}
+
+void test_throughput_qos1()
+{
+    constexpr const uint32_t MESSAGES = 5000;
+    const char* payload = "{\"bsoc\":87,\"bvoltage\":13.2,\"pvoltage\":18.4,\"pcurrent\":2.31,\"cstate\":2}";
+
+    const unsigned long start = micros();
+    for (uint32_t i = 0; i < MESSAGES; ++i)
+    {
+        TEST_ASSERT_TRUE(publishBlocking("rngbridge/bench/qos1", payload, 1));
+    }
+    TEST_ASSERT_TRUE(drain());
+    const double seconds = (micros() - start) / 1e6;
+
+    report("QoS 1 with %u in flight: %u messages in %.3f s, %.0f messages/s", MqttClient::MAX_IN_FLIGHT, MESSAGES,
+        seconds, MESSAGES / seconds);
+}
+
+void test_publish_cycle()
+{
+    // Same shape as a cycle of the bridge: retained QoS 1 state followed by the split values, then flush
+    constexpr const uint32_t CYCLES = 100;
+    char state[STATE_LENGTH + 1];
+    memset(state, 'x', STATE_LENGTH);
+    state[STATE_LENGTH] = '\0';
+    char topics[SPLIT_COUNT][40];
+    for (size_t i = 0; i < SPLIT_COUNT; ++i)
+    {
+        snprintf(topics[i], sizeof(topics[i]), "rngbridge/bench/%s", SPLIT_SUFFIXES[i]);
+    }
+
+    MqttClient::Stats total;
+    uint32_t syscalls = 0;
+    uint32_t segments = 0;
+    for (uint32_t cycle = 0; cycle < CYCLES; ++cycle)
+    {
+        const MqttClient::Stats before = client->getStats();
+        const uint32_t syscallsBefore = asyncTcpCounters().syscalls;
+        const uint32_t segmentsBefore = connection().getDataSegmentsOut();
+
+        TEST_ASSERT_TRUE(client->publish("rngbridge/bench/state", state, true, 1));
+        for (size_t i = 0; i < SPLIT_COUNT; ++i)
+        {
+            TEST_ASSERT_TRUE(client->publish(topics[i], "13.25", false));
+        }
+        client->flush();
+
+        const MqttClient::Stats& after = client->getStats();
+        total.publishes += after.publishes - before.publishes;
+        total.writes += after.writes - before.writes;
+        total.sends += after.sends - before.sends;
+        total.bytes += after.bytes - before.bytes;
+        syscalls += asyncTcpCounters().syscalls - syscallsBefore;
+        segments += connection().getDataSegmentsOut() - segmentsBefore;
+
+        // Let the acknowledgement arrive outside of the measured part
+        TEST_ASSERT_TRUE(drain());
+    }
+
+    report("Per cycle: %.1f publishes, %.1f bytes, %.2f writes, %.2f sends, %.2f send syscalls, %.2f data segments",
+        total.publishes / double(CYCLES), total.bytes / double(CYCLES), total.writes / double(CYCLES),
+        total.sends / double(CYCLES), syscalls / double(CYCLES), segments / double(CYCLES));
+
+    TEST_ASSERT_EQUAL_UINT32(CYCLES * (SPLIT_COUNT + 1), total.publishes);
+    // A cycle smaller than a segment leaves with a single send
+    TEST_ASSERT_LESS_THAN(AsyncClient::MSS, total.bytes / CYCLES);
+    TEST_ASSERT_EQUAL_UINT32(CYCLES, total.sends);
+    TEST_ASSERT_EQUAL_UINT32(CYCLES, syscalls);
+    if (segments)
+    {
+        TEST_ASSERT_EQUAL_UINT32(CYCLES, segments);
+    }
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip_latency);
+    RUN_TEST(test_throughput_qos0);
+    RUN_TEST(test_throughput_qos1);
+    RUN_TEST(test_publish_cycle);
+    return UNITY_END();
+}
@@ -0,0 +1,198 @@
+#include <unity.h>
+
+#include "OutputRule.h"
+
+namespace
+{
+    OutputRule rule;
+    Renogy::Data data;
+} // namespace
+
+void setUp()
+{
+    rule = OutputRule();
+    data = Renogy::Data();
+}
+
+void tearDown() { }
+
+void test_comparisons()
+{
+    data.batteryCharge = 50;
+    TEST_ASSERT_TRUE(rule.compile("bsoc >= 50"));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0));
+    TEST_ASSERT_TRUE(rule.compile("bsoc > 50"));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+    TEST_ASSERT_TRUE(rule.compile("bsoc<=50"));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0));
+    TEST_ASSERT_TRUE(rule.compile("bsoc < 50"));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+    TEST_ASSERT_TRUE(rule.compile("bsoc == 50"));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0));
+    TEST_ASSERT_TRUE(rule.compile("bsoc != 50"));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+}
+
+void test_and_binds_stronger_than_or()
+{
+    // Read as bsoc > 90 || (pvoltage > 18 && bvoltage > 13)
+    TEST_ASSERT_TRUE(rule.compile("bsoc > 90 || pvoltage > 18 && bvoltage > 13"));
+    data.batteryCharge = 95;
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0));
+    data.batteryCharge = 50;
+    data.panelVoltage = 19;
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+    data.batteryVoltage = 13.5;
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0));
+}
+
+void test_negation_and_parentheses()
+{
+    TEST_ASSERT_TRUE(rule.compile("!(bsoc<=20 || bvoltage < 11.5) && cstate != 0"));
+    data.batteryCharge = 50;
+    data.batteryVoltage = 12;
+    data.chargingState = 2;
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0));
+    data.batteryVoltage = 11;
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+    data.batteryVoltage = 12;
+    data.chargingState = 0;
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+}
+
+void test_long_negation_chain()
+{
+    // Rules arrive over HTTP and MQTT, a long chain of negations must not exhaust the stack
+    std::string chain(10000, '!');
+    TEST_ASSERT_TRUE(rule.compile((chain + "bsoc>50").c_str()));
+    data.batteryCharge = 60;
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0));
+    TEST_ASSERT_TRUE(rule.compile((chain + "!bsoc>50 for 1s").c_str()));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 1000));
+    TEST_ASSERT_FALSE(rule.compile((chain + "!").c_str()));
+    TEST_ASSERT_EQUAL(chain.size() + 1, rule.getErrorOffset());
+}
+
+void test_for_timer()
+{
+    TEST_ASSERT_TRUE(rule.compile("bsoc > 90 && pvoltage > 18 for 60s"));
+    data.batteryCharge = 95;
+    data.panelVoltage = 19;
+    TEST_ASSERT_FALSE(rule.evaluate(data, 1000));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 60999));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 61000));
+
+    // A single false sample restarts the timer
+    data.panelVoltage = 17;
+    TEST_ASSERT_FALSE(rule.evaluate(data, 62000));
+    data.panelVoltage = 19;
+    TEST_ASSERT_FALSE(rule.evaluate(data, 63000));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 122999));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 123000));
+}
+
+void test_for_timer_units()
+{
+    data.batteryCharge = 50;
+    TEST_ASSERT_TRUE(rule.compile("(bsoc > 1 || bsoc < 0) for 500ms"));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 10));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 510));
+
+    TEST_ASSERT_TRUE(rule.compile("bsoc > 1 for 2m"));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 119999));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 120000));
+
+    TEST_ASSERT_TRUE(rule.compile("bsoc > 1 for 1h"));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 3600000));
+}
+
+void test_for_timer_binds_to_term()
+{
+    // Only the second comparison is qualified, the first one acts immediately
+    TEST_ASSERT_TRUE(rule.compile("bsoc > 90 || pvoltage > 18 for 10s"));
+    data.panelVoltage = 19;
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+    data.batteryCharge = 95;
+    TEST_ASSERT_TRUE(rule.evaluate(data, 1000));
+    data.batteryCharge = 50;
+    TEST_ASSERT_TRUE(rule.evaluate(data, 10000));
+}
+
+void test_for_timer_wraps()
+{
+    data.batteryCharge = 50;
+    TEST_ASSERT_TRUE(rule.compile("bsoc > 1 for 1s"));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0xFFFFFE00));
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0x00000100));
+    TEST_ASSERT_TRUE(rule.evaluate(data, 0x00000200));
+}
+
+void test_invalid_rules()
+{
+    const struct
+    {
+        const char* source;
+        size_t offset;
+    } cases[] = {
+        {"bsoc", 4},
+        {"bsoc >", 6},
+        {"foo > 1", 0},
+        {"bsoc > 1 &&", 11},
+        {"(bsoc > 1", 9},
+        {"bsoc > 1)", 8},
+        {"bsoc > 1 for", 12},
+        {"bsoc > 1 for 2d", 14},
+        {"bsoc > 1 for 25h", 16},
+        {"((((((((((bsoc>1))))))))))", 9},
+    };
+    for (const auto& invalid : cases)
+    {
+        TEST_ASSERT_FALSE_MESSAGE(rule.compile(invalid.source), invalid.source);
+        TEST_ASSERT_EQUAL_MESSAGE(invalid.offset, rule.getErrorOffset(), invalid.source);
+        TEST_ASSERT_TRUE(rule.empty());
+        TEST_ASSERT_FALSE(OutputRule::verify(invalid.source));
+    }
+}
+
+void test_program_limit()
+{
+    std::string terms = "bsoc>1";
+    for (int i = 0; i < 14; ++i)
+    {
+        terms += " || bsoc>1";
+    }
+    TEST_ASSERT_TRUE(rule.compile(terms.c_str()));
+    for (int i = 0; i < 2; ++i)
+    {
+        terms += " && bsoc>1";
+    }
+    TEST_ASSERT_FALSE(rule.compile(terms.c_str()));
+}
+
+void test_empty_rule()
+{
+    TEST_ASSERT_TRUE(rule.compile(""));
+    TEST_ASSERT_TRUE(rule.empty());
+    TEST_ASSERT_FALSE(rule.evaluate(data, 0));
+    TEST_ASSERT_TRUE(OutputRule::verify(""));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_comparisons);
+    RUN_TEST(test_and_binds_stronger_than_or);
+    RUN_TEST(test_negation_and_parentheses);
+    RUN_TEST(test_long_negation_chain);
+    RUN_TEST(test_for_timer);
+    RUN_TEST(test_for_timer_units);
+    RUN_TEST(test_for_timer_binds_to_term);
+    RUN_TEST(test_for_timer_wraps);
+    RUN_TEST(test_invalid_rules);
+    RUN_TEST(test_program_limit);
+    RUN_TEST(test_empty_rule);
+    return UNITY_END();
+}
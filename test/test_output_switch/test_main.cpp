@@ -0,0 +1,106 @@
+#include <unity.h>
+
+#include "OutputSwitch.h"
+
+namespace
+{
+    OutputSwitch outputSwitch;
+} // namespace
+
+void setUp() { outputSwitch = OutputSwitch(); }
+
+void tearDown() { }
+
+void test_without_limits()
+{
+    const OutputSwitch::Limits limits {0, 0, 0, 0};
+    TEST_ASSERT_TRUE(outputSwitch.update(true, 0, limits));
+    TEST_ASSERT_FALSE(outputSwitch.update(false, 1, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(true, 2, limits));
+}
+
+void test_settle()
+{
+    const OutputSwitch::Limits limits {0, 0, 5000, 0};
+    TEST_ASSERT_FALSE(outputSwitch.update(true, 0, limits));
+    TEST_ASSERT_FALSE(outputSwitch.update(true, 4999, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(true, 5000, limits));
+
+    // Requesting the current state again restarts the settle time
+    TEST_ASSERT_TRUE(outputSwitch.update(false, 6000, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(true, 7000, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(false, 8000, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(false, 12999, limits));
+    TEST_ASSERT_FALSE(outputSwitch.update(false, 13000, limits));
+}
+
+void test_min_on_off()
+{
+    const OutputSwitch::Limits limits {10000, 20000, 0, 0};
+    TEST_ASSERT_TRUE(outputSwitch.update(true, 0, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(false, 9999, limits));
+    TEST_ASSERT_FALSE(outputSwitch.update(false, 10000, limits));
+    TEST_ASSERT_FALSE(outputSwitch.update(true, 29999, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(true, 30000, limits));
+}
+
+void test_settle_and_min_on()
+{
+    // The minimum on time counts from the switch, not from the request
+    const OutputSwitch::Limits limits {10000, 0, 5000, 0};
+    TEST_ASSERT_FALSE(outputSwitch.update(true, 0, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(true, 5000, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(false, 6000, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(false, 14999, limits));
+    TEST_ASSERT_FALSE(outputSwitch.update(false, 15000, limits));
+}
+
+void test_hourly_cap()
+{
+    const OutputSwitch::Limits limits {0, 0, 0, 4};
+    bool requested = true;
+    uint8_t switches = 0;
+    for (uint32_t now = 0; now < OutputSwitch::HOUR_MS; now += 60000)
+    {
+        if (outputSwitch.update(requested, now, limits) == requested)
+        {
+            ++switches;
+            requested = !requested;
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT8(4, switches);
+
+    // The fifth switch is allowed once the first one left the window
+    TEST_ASSERT_EQUAL(requested, outputSwitch.update(requested, OutputSwitch::HOUR_MS, limits));
+}
+
+void test_forced_switches_count()
+{
+    const OutputSwitch::Limits limits {0, 0, 0, 2};
+    outputSwitch.force(true, 0);
+    outputSwitch.force(false, 1);
+    TEST_ASSERT_FALSE(outputSwitch.update(true, 2, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(true, OutputSwitch::HOUR_MS, limits));
+}
+
+void test_clock_wraparound()
+{
+    const OutputSwitch::Limits limits {1000, 1000, 0, 0};
+    const uint32_t start = 0xFFFFFF00;
+    TEST_ASSERT_TRUE(outputSwitch.update(true, start, limits));
+    TEST_ASSERT_TRUE(outputSwitch.update(false, start + 999, limits));
+    TEST_ASSERT_FALSE(outputSwitch.update(false, start + 1000, limits));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_without_limits);
+    RUN_TEST(test_settle);
+    RUN_TEST(test_min_on_off);
+    RUN_TEST(test_settle_and_min_on);
+    RUN_TEST(test_hourly_cap);
+    RUN_TEST(test_forced_switches_count);
+    RUN_TEST(test_clock_wraparound);
+    return UNITY_END();
+}
@@ -0,0 +1,101 @@
+#include <unity.h>
+
+#include "PwmRamp.h"
+
+namespace
+{
+    PwmRamp ramp;
+} // namespace
+
+void setUp() { ramp = PwmRamp(); }
+
+void tearDown() { }
+
+void test_proportional()
+{
+    TEST_ASSERT_EQUAL_UINT16(0, PwmRamp::proportional(13.8f, 13.8f, 14.4f));
+    TEST_ASSERT_EQUAL_UINT16(500, PwmRamp::proportional(14.1f, 13.8f, 14.4f));
+    TEST_ASSERT_EQUAL_UINT16(PwmRamp::RANGE, PwmRamp::proportional(14.4f, 13.8f, 14.4f));
+}
+
+void test_proportional_limits()
+{
+    TEST_ASSERT_EQUAL_UINT16(0, PwmRamp::proportional(12, 13.8f, 14.4f));
+    TEST_ASSERT_EQUAL_UINT16(PwmRamp::RANGE, PwmRamp::proportional(15, 13.8f, 14.4f));
+}
+
+void test_proportional_inverted()
+{
+    TEST_ASSERT_EQUAL_UINT16(PwmRamp::RANGE, PwmRamp::proportional(0, 20, 0));
+    TEST_ASSERT_EQUAL_UINT16(500, PwmRamp::proportional(10, 20, 0));
+    TEST_ASSERT_EQUAL_UINT16(0, PwmRamp::proportional(25, 20, 0));
+}
+
+void test_from_percent()
+{
+    TEST_ASSERT_EQUAL_UINT16(0, PwmRamp::fromPercent(0));
+    TEST_ASSERT_EQUAL_UINT16(500, PwmRamp::fromPercent(50));
+    TEST_ASSERT_EQUAL_UINT16(PwmRamp::RANGE, PwmRamp::fromPercent(200));
+}
+
+void test_ramp_up_timing()
+{
+    const uint32_t start = 100;
+    ramp.setTarget(PwmRamp::RANGE, start);
+    uint32_t now = start;
+    while (ramp.getLevel() < PwmRamp::RANGE && now < start + 3000)
+    {
+        ramp.update(++now, 2000);
+    }
+    TEST_ASSERT_EQUAL_UINT32(2000, now - start);
+}
+
+void test_ramp_partial()
+{
+    ramp.setTarget(200, 0);
+    ramp.update(0, 0);
+    ramp.setTarget(PwmRamp::RANGE, 5000);
+    TEST_ASSERT_TRUE(ramp.update(5500, 2000));
+    TEST_ASSERT_EQUAL_UINT16(450, ramp.getLevel());
+    TEST_ASSERT_EQUAL_UINT16(PwmRamp::RANGE, ramp.getTarget());
+}
+
+void test_fall_is_immediate()
+{
+    ramp.setTarget(PwmRamp::RANGE, 0);
+    ramp.update(0, 0);
+    ramp.setTarget(200, 10);
+    TEST_ASSERT_TRUE(ramp.update(10, 2000));
+    TEST_ASSERT_EQUAL_UINT16(200, ramp.getLevel());
+    TEST_ASSERT_FALSE(ramp.update(20, 2000));
+}
+
+void test_without_ramp_time()
+{
+    ramp.setTarget(700, 0);
+    TEST_ASSERT_TRUE(ramp.update(0, 0));
+    TEST_ASSERT_EQUAL_UINT16(700, ramp.getLevel());
+}
+
+void test_clock_wraparound()
+{
+    const uint32_t start = 0xFFFFFF00;
+    ramp.setTarget(PwmRamp::RANGE, start);
+    ramp.update(start + 1000, 2000);
+    TEST_ASSERT_EQUAL_UINT16(500, ramp.getLevel());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_proportional);
+    RUN_TEST(test_proportional_limits);
+    RUN_TEST(test_proportional_inverted);
+    RUN_TEST(test_from_percent);
+    RUN_TEST(test_ramp_up_timing);
+    RUN_TEST(test_ramp_partial);
+    RUN_TEST(test_fall_is_immediate);
+    RUN_TEST(test_without_ramp_time);
+    RUN_TEST(test_clock_wraparound);
+    return UNITY_END();
+}
@@ -0,0 +1,132 @@
+#include <unity.h>
+
+#include "Schedule.h"
+
+namespace
+{
+    const Schedule::Location BERLIN {52.52f, 13.405f, 7200}; /// Summer time
+    const Schedule::Location TROMSO {69.65f, 18.96f, 7200}; /// Midnight sun in June
+    const uint32_t DAY = 1718928000; /// 2024-06-21 00:00 UTC, a Friday
+    const uint32_t MIDNIGHT = DAY - 7200; /// Local midnight in Berlin
+    const uint32_t HOUR = 3600;
+    const uint32_t TOLERANCE = 120; /// Accepted error of sun edges in s
+
+    Schedule schedule;
+} // namespace
+
+void setUp() { schedule = Schedule(); }
+
+void tearDown() { }
+
+void test_sun_edges()
+{
+    TEST_ASSERT_TRUE(schedule.set("sunrise", "sunset", Schedule::ALL_DAYS));
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 4 * HOUR, BERLIN));
+    const uint32_t sunrise = schedule.getNextChange();
+    TEST_ASSERT_UINT32_WITHIN(TOLERANCE, MIDNIGHT + 4 * HOUR + 43 * 60, sunrise);
+
+    TEST_ASSERT_TRUE(schedule.isActive(sunrise, BERLIN));
+    const uint32_t sunset = schedule.getNextChange();
+    TEST_ASSERT_UINT32_WITHIN(TOLERANCE, MIDNIGHT + 21 * HOUR + 33 * 60, sunset);
+    TEST_ASSERT_TRUE(schedule.isActive(sunset - 1, BERLIN));
+    TEST_ASSERT_FALSE(schedule.isActive(sunset, BERLIN));
+}
+
+void test_sun_edge_offsets()
+{
+    TEST_ASSERT_TRUE(schedule.set("sunrise+30", "sunset-45", Schedule::ALL_DAYS));
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 4 * HOUR, BERLIN));
+    TEST_ASSERT_UINT32_WITHIN(TOLERANCE, MIDNIGHT + 5 * HOUR + 13 * 60, schedule.getNextChange());
+    TEST_ASSERT_TRUE(schedule.isActive(MIDNIGHT + 12 * HOUR, BERLIN));
+    TEST_ASSERT_UINT32_WITHIN(TOLERANCE, MIDNIGHT + 20 * HOUR + 48 * 60, schedule.getNextChange());
+}
+
+void test_twilight_to_clock()
+{
+    TEST_ASSERT_TRUE(schedule.set("dusk", "23:00", Schedule::ALL_DAYS));
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 12 * HOUR, BERLIN));
+    const uint32_t dusk = schedule.getNextChange();
+    TEST_ASSERT_UINT32_WITHIN(TOLERANCE, MIDNIGHT + 22 * HOUR + 23 * 60, dusk);
+    TEST_ASSERT_TRUE(schedule.isActive(dusk + 1, BERLIN));
+    TEST_ASSERT_EQUAL_UINT32(MIDNIGHT + 23 * HOUR, schedule.getNextChange());
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 23 * HOUR, BERLIN));
+}
+
+void test_window_across_midnight()
+{
+    // Starts on Fridays only and ends on Saturday morning
+    TEST_ASSERT_TRUE(schedule.set("22:00", "06:00", 1 << 5));
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 3 * HOUR, BERLIN));
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 22 * HOUR - 1, BERLIN));
+    TEST_ASSERT_TRUE(schedule.isActive(MIDNIGHT + 22 * HOUR, BERLIN));
+    TEST_ASSERT_TRUE(schedule.isActive(MIDNIGHT + 24 * HOUR, BERLIN));
+    TEST_ASSERT_TRUE(schedule.isActive(MIDNIGHT + 29 * HOUR, BERLIN));
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 30 * HOUR, BERLIN));
+    // Saturday evening is not part of the window
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 46 * HOUR, BERLIN));
+}
+
+void test_window_across_midnight_every_day()
+{
+    TEST_ASSERT_TRUE(schedule.set("sunset", "sunrise", Schedule::ALL_DAYS));
+    TEST_ASSERT_TRUE(schedule.isActive(MIDNIGHT + 2 * HOUR, BERLIN));
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 12 * HOUR, BERLIN));
+    TEST_ASSERT_TRUE(schedule.isActive(MIDNIGHT + 23 * HOUR, BERLIN));
+    TEST_ASSERT_TRUE(schedule.isActive(MIDNIGHT + 25 * HOUR, BERLIN));
+}
+
+void test_polar_day()
+{
+    // The sun does not set, so the window never opens
+    TEST_ASSERT_TRUE(schedule.set("sunset-30", "sunrise+15", Schedule::ALL_DAYS));
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 12 * HOUR, TROMSO));
+    TEST_ASSERT_EQUAL_UINT32(MIDNIGHT + 24 * HOUR, schedule.getNextChange());
+}
+
+void test_invalidate()
+{
+    TEST_ASSERT_TRUE(schedule.set("sunrise", "sunset", Schedule::ALL_DAYS));
+    TEST_ASSERT_TRUE(schedule.isActive(MIDNIGHT + 12 * HOUR, BERLIN));
+    schedule.invalidate();
+    TEST_ASSERT_FALSE(schedule.isActive(MIDNIGHT + 12 * HOUR, TROMSO));
+}
+
+void test_verify()
+{
+    const char* valid[] = {"", "07:05", "7:05", "00:00", "23:59", "dawn-20", "dusk", "sunrise+720"};
+    for (const char* edge : valid)
+    {
+        TEST_ASSERT_TRUE_MESSAGE(Schedule::verify(edge), edge);
+    }
+    const char* invalid[] = {"24:00", "7:5", "12:60", "noon", "sunrise+", "sunset*2", "sunrise+721"};
+    for (const char* edge : invalid)
+    {
+        TEST_ASSERT_FALSE_MESSAGE(Schedule::verify(edge), edge);
+    }
+}
+
+void test_verify_window()
+{
+    TEST_ASSERT_TRUE(Schedule::verifyWindow("", ""));
+    TEST_ASSERT_TRUE(Schedule::verifyWindow("sunset", "06:00"));
+    TEST_ASSERT_FALSE(Schedule::verifyWindow("sunset", ""));
+    TEST_ASSERT_FALSE(Schedule::verifyWindow("", "06:00"));
+    TEST_ASSERT_FALSE(Schedule::verifyWindow("sunset", "24:00"));
+    TEST_ASSERT_FALSE(schedule.set("sunset", "", Schedule::ALL_DAYS));
+    TEST_ASSERT_TRUE(schedule.empty());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_sun_edges);
+    RUN_TEST(test_sun_edge_offsets);
+    RUN_TEST(test_twilight_to_clock);
+    RUN_TEST(test_window_across_midnight);
+    RUN_TEST(test_window_across_midnight_every_day);
+    RUN_TEST(test_polar_day);
+    RUN_TEST(test_invalidate);
+    RUN_TEST(test_verify);
+    RUN_TEST(test_verify_window);
+    return UNITY_END();
+}